@@ -20,8 +20,78 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "backend_event_loop.h"
+#ifdef HAVE_IO_URING
+#include "backend_event_loop_uring.h"
+#endif
+
+//Large enough for re-arming the polls of all handles without submitting
+#define URING_ENTRIES 64
+
+//Handles and timeouts are allocated in blocks and recycled through a free list
+//(linked through the first bytes of the free objects). Loops run in different
+//threads, so the pools are locked. They are only used when creating/freeing
+//handles, never when running the loop
+#define BACKEND_POOL_BLOCK 32
+
+struct backend_pool {
+    void *free_list;
+    size_t obj_size;
+    pthread_mutex_t lock;
+};
+
+static struct backend_pool epoll_handle_pool = {
+    NULL, sizeof(struct backend_epoll_handle), PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct backend_pool timeout_pool = {
+    NULL, sizeof(struct backend_timeout_handle), PTHREAD_MUTEX_INITIALIZER
+};
+
+static void *backend_pool_get(struct backend_pool *pool)
+{
+    uint8_t *block, *obj;
+    uint32_t i;
+
+    pthread_mutex_lock(&(pool->lock));
+
+    if (!pool->free_list &&
+        (block = calloc(BACKEND_POOL_BLOCK, pool->obj_size))) {
+        for (i = 0; i < BACKEND_POOL_BLOCK; i++) {
+            obj = block + (i * pool->obj_size);
+            *((void**) obj) = pool->free_list;
+            pool->free_list = obj;
+        }
+    }
+
+    if ((obj = pool->free_list))
+        pool->free_list = *((void**) obj);
+
+    pthread_mutex_unlock(&(pool->lock));
+
+    if (obj)
+        memset(obj, 0, pool->obj_size);
+
+    return obj;
+}
+
+static void backend_pool_put(struct backend_pool *pool, void *obj)
+{
+    pthread_mutex_lock(&(pool->lock));
+    *((void**) obj) = pool->free_list;
+    pool->free_list = obj;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+uint64_t backend_get_time_ms()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
+}
 
 struct backend_event_loop* backend_event_loop_create()
 {
@@ -46,12 +116,17 @@ void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 	handle->data = ptr;
 	handle->fd = fd;
 	handle->cb = cb;
+	handle->events = 0;
+	handle->recv_cb = NULL;
+	handle->send_cb = NULL;
+	handle->buf_group = 0;
+	handle->armed = false;
+	handle->stale = false;
 }
 
 struct backend_epoll_handle* backend_create_epoll_handle(
         void *ptr, int fd, backend_epoll_cb cb){
-    struct backend_epoll_handle *handle =
-        calloc(sizeof(struct backend_epoll_handle), 1);
+    struct backend_epoll_handle *handle = backend_pool_get(&epoll_handle_pool);
 
     if(handle != NULL)
 		backend_configure_epoll_handle(handle, ptr, fd, cb);
@@ -59,17 +134,65 @@ struct backend_epoll_handle* backend_create_epoll_handle(
     return handle;
 }
 
+void backend_free_epoll_handle(struct backend_epoll_handle *handle)
+{
+    backend_pool_put(&epoll_handle_pool, handle);
+}
+
 int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t events,
         int32_t op, int32_t fd, void *ptr)
 {
     struct epoll_event ev;
 
+#ifdef HAVE_IO_URING
+    if (del->uring)
+        return backend_uring_update(del->uring, events, op, ptr);
+#endif
+
     ev.events = events;
     ev.data.ptr = ptr;
 
     return epoll_ctl(del->efd, op, fd, &ev);
 } 
 
+bool backend_event_loop_use_uring(struct backend_event_loop *del)
+{
+#ifdef HAVE_IO_URING
+    if (!del->uring)
+        del->uring = backend_uring_create(URING_ENTRIES);
+
+    return del->uring != NULL;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+bool backend_event_loop_set_recv_bufs(struct backend_event_loop *del,
+                                      struct backend_epoll_handle *handle,
+                                      uint8_t *bufs, uint32_t buf_size,
+                                      uint16_t num_bufs)
+{
+#ifdef HAVE_IO_URING
+    if (del->uring)
+        return backend_uring_set_recv_bufs(del->uring, handle, bufs, buf_size,
+                                           num_bufs);
+#endif
+    return false;
+}
+
+int32_t backend_event_loop_send(struct backend_event_loop *del,
+                                struct backend_epoll_handle *handle,
+                                const void *buf, uint32_t len)
+{
+#ifdef HAVE_IO_URING
+    if (del->uring)
+        return backend_uring_send(del->uring, handle, buf, len);
+#endif
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
 void backend_insert_timeout(struct backend_event_loop *del,
                             struct backend_timeout_handle *handle)
 {
@@ -104,10 +227,7 @@ struct backend_timeout_handle* backend_event_loop_create_timeout(
         uint64_t timeout_clock, backend_timeout_cb timeout_cb, void *ptr,
         uint32_t intvl)
 {
-    //In an improved version, handle can be passed as argument so that it is up
-    //to application how to allocate it
-    struct backend_timeout_handle *handle =
-        calloc(sizeof(struct backend_timeout_handle), 1);
+    struct backend_timeout_handle *handle = backend_pool_get(&timeout_pool);
 
     if (!handle)
         return NULL;
@@ -120,15 +240,19 @@ struct backend_timeout_handle* backend_event_loop_create_timeout(
     return handle;
 }
 
+void backend_event_loop_free_timeout(struct backend_timeout_handle *handle)
+{
+    if (handle->timeout_next.le_prev)
+        backend_remove_timeout(handle);
+
+    backend_pool_put(&timeout_pool, handle);
+}
+
 static void backend_event_loop_run_timers(struct backend_event_loop *del)
 {
     struct backend_timeout_handle *timeout = del->timeout_list.lh_first;
     struct backend_timeout_handle *cur_timeout;
-    struct timeval tv;
-    uint64_t cur_time;
-
-    gettimeofday(&tv, NULL);
-    cur_time = (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
+    uint64_t cur_time = backend_get_time_ms();
 
     while (timeout != NULL) {
         if (timeout->timeout_clock <= cur_time) {
@@ -156,14 +280,12 @@ void backend_event_loop_run(struct backend_event_loop *del)
     struct epoll_event events[MAX_EPOLL_EVENTS];
     int nfds, i, sleep_time;
 
-    struct timeval tv;
     uint64_t cur_time;
     struct backend_timeout_handle *timeout;
 
     while(!del->stop){
         timeout = del->timeout_list.lh_first;
-        gettimeofday(&tv, NULL);
-        cur_time = (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
+        cur_time = backend_get_time_ms();
        
         if (timeout != NULL) {
             if (cur_time > timeout->timeout_clock)
@@ -174,6 +296,29 @@ void backend_event_loop_run(struct backend_event_loop *del)
             sleep_time = -1;
         }
 
+        if (del->busy_poll)
+            sleep_time = 0;
+
+#ifdef HAVE_IO_URING
+        //Readiness is delivered as completions, which are consumed after the
+        //timers have run (same order as with epoll)
+        if (del->uring) {
+            if (backend_uring_wait(del->uring, sleep_time) < 0 &&
+                errno != ETIME && errno != EINTR)
+                continue;
+
+            if (timeout != NULL)
+                backend_event_loop_run_timers(del);
+
+            backend_uring_dispatch(del->uring);
+
+            if (del->itr_cb != NULL)
+                del->itr_cb(del->itr_data);
+
+            continue;
+        }
+#endif
+
 		nfds = epoll_wait(del->efd, events, MAX_EPOLL_EVENTS, sleep_time);
 
 		if (nfds < 0)
@@ -198,6 +343,14 @@ void backend_event_loop_run(struct backend_event_loop *del)
         if (del->itr_cb != NULL)
             del->itr_cb(del->itr_data);
     }
+
+#ifdef HAVE_IO_URING
+    //Requests queued by the last callbacks (sends) would otherwise be lost.
+    //Netlink requests are handled while they are submitted, so their
+    //completions are ready right away
+    if (del->uring && !backend_uring_submit(del->uring))
+        backend_uring_dispatch(del->uring);
+#endif
 }
 
 void backend_event_loop_stop(struct backend_event_loop *del)
@@ -30,11 +30,31 @@
 typedef void(*backend_epoll_cb)(void *ptr, int32_t fd, uint32_t events);
 typedef void(*backend_timeout_cb)(void *ptr);
 typedef backend_timeout_cb backend_itr_cb;
+//len is -errno if receiving failed
+typedef void(*backend_recv_cb)(void *ptr, int32_t fd, uint8_t *buf,
+                               int32_t len);
+typedef void(*backend_send_cb)(void *ptr, int32_t res);
 
 struct backend_epoll_handle{
     void *data;
     int32_t fd;
     backend_epoll_cb cb;
+
+    //Events the handle is registered for, used to re-arm io_uring polls
+    uint32_t events;
+
+    //io_uring only. When the handle has receive buffers (buf_group, see
+    //backend_event_loop_set_recv_bufs()), its datagrams are received by the
+    //ring and passed to recv_cb instead of calling cb. send_cb is called when
+    //a send has completed
+    backend_recv_cb recv_cb;
+    backend_send_cb send_cb;
+    uint8_t buf_group;
+
+    //io_uring only. A request for the handle is outstanding in the ring, and
+    //if stale, it was made for an fd that has since been removed
+    bool armed;
+    bool stale;
 };
 
 //timeout_clock is first timeout in wallclock (ms), intvl is frequency after
@@ -53,19 +73,52 @@ struct backend_event_loop{
     LIST_HEAD(timeout, backend_timeout_handle) timeout_list;
     int32_t efd;
 
+    //Wait for events with io_uring rather than epoll, see
+    //backend_event_loop_use_uring()
+    struct backend_uring *uring;
+
+    //Never sleep in epoll_wait(), for the lowest possible latency
+    bool busy_poll;
     bool stop;
 };
 
-//Create an backend_event_loop struct
-//TODO: Currently, allocations are made from heap. Add support for using
-//deciding how the struct should be allocated. This also applies to
-//backend_create_epoll_handle()
+//Current wallclock in ms. This is the clock used for timeout_clock, so use it
+//when computing when a timeout should fire
+uint64_t backend_get_time_ms();
+
+//Create an backend_event_loop struct. Handles and timeouts are allocated from
+//pools, see backend_free_epoll_handle() and backend_event_loop_free_timeout()
 struct backend_event_loop* backend_event_loop_create();
 
 //Update file descriptor + ptr to efd in events according to op
 int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t events,
         int32_t op, int32_t fd, void *ptr);
 
+//Switch the loop from epoll to io_uring. Returns false if io_uring is not
+//available (or not compiled in), in which case the loop keeps using epoll.
+//File descriptors that were added before the switch must be added again
+bool backend_event_loop_use_uring(struct backend_event_loop *del);
+
+//Let io_uring receive the datagrams of handle into num_bufs (a power of two)
+//buffers of buf_size bytes, with a multishot receive. The datagrams are passed
+//to recv_cb of handle, and a buffer is only valid during the callback.
+//Returns false if the loop does not use io_uring or the buffers could not be
+//registered (5.19), in which case the handle is polled. It is also polled if
+//the kernel lacks multishot receives (6.0). Must be called before the handle
+//is added
+bool backend_event_loop_set_recv_bufs(struct backend_event_loop *del,
+                                      struct backend_epoll_handle *handle,
+                                      uint8_t *bufs, uint32_t buf_size,
+                                      uint16_t num_bufs);
+
+//Queue a send on the fd of handle. It is submitted together with the next
+//wait for events, and send_cb of handle is called when it has completed. buf
+//must not be changed until then. Returns -1 if the loop does not use io_uring
+//(or the ring is full), and the caller must send by itself
+int32_t backend_event_loop_send(struct backend_event_loop *del,
+                                struct backend_epoll_handle *handle,
+                                const void *buf, uint32_t len);
+
 //Insert timeout into list, we need manual control of adding timeouts
 void backend_insert_timeout(struct backend_event_loop *del,
                             struct backend_timeout_handle *handle);
@@ -76,6 +129,9 @@ struct backend_timeout_handle* backend_event_loop_create_timeout(
         uint64_t timeout_clock, backend_timeout_cb timeout_cb, void *ptr,
         uint32_t intvl);
 
+//Return a timeout to the pool, removing it from the list if it is armed
+void backend_event_loop_free_timeout(struct backend_timeout_handle *handle);
+
 //Fill handle with ptr, fd, and cb. Used by create_epoll_handle and can be used
 //by applications that use a different allocater for handle
 void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
@@ -85,6 +141,10 @@ void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 struct backend_epoll_handle* backend_create_epoll_handle(void *ptr, int fd,
         backend_epoll_cb cb);
 
+//Return a handle to the pool. The file descriptor must have been removed from
+//the loop
+void backend_free_epoll_handle(struct backend_epoll_handle *handle);
+
 //Run event loop described by efd. Let it be up to the user how efd shall be
 //stored
 //Function is for now never supposed to return. If it returns, something has
@@ -0,0 +1,595 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "backend_event_loop.h"
+#include "backend_event_loop_uring.h"
+
+//Max number of provided buffer groups, one per receiving handle
+#define URING_MAX_BUF_GROUPS 4
+
+//Provided buffers for the multishot receive of a handle (the group id is the
+//index in backend_uring). avail is the number of buffers in the ring, from
+//our point of view. The buffers used by the completions of one dispatch are
+//returned to the ring when all of them have been handled, see
+//backend_uring_dispatch()
+struct uring_buf_group {
+    struct io_uring_buf_ring *ring;
+    size_t ring_len;
+    uint8_t *bufs;
+    uint16_t *used;
+    uint32_t buf_size;
+    uint16_t num_bufs;
+    uint16_t num_used;
+    uint16_t avail;
+    uint16_t tail;
+};
+
+//The event loop uses io_uring for readiness (one poll request per fd), for
+//receiving datagrams (one multishot receive per fd, into a provided buffer
+//ring), for sends and for waiting with a timeout. It is small enough that we
+//use the system calls directly rather than depending on liburing
+struct backend_uring {
+    int32_t fd;
+
+    //Submission ring
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    struct io_uring_sqe *sqes;
+
+    //Completion ring
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+    //Number of sqes queued since last io_uring_enter()
+    uint32_t to_submit;
+
+    struct uring_buf_group groups[URING_MAX_BUF_GROUPS];
+    uint8_t num_groups;
+
+    //Cleared if the kernel does not support multishot receive (6.0), then
+    //all handles are polled
+    bool use_recv;
+};
+
+//Completion of IORING_OP_ASYNC_CANCEL, must not be mistaken for a handle
+#define URING_REMOVE_TAG 0
+
+//Set in the user_data of sends. Handles are pointers, so the bit is free
+#define URING_SEND_TAG 1
+
+static int uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+                       uint32_t flags, void *arg, size_t arg_len)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, arg, arg_len);
+}
+
+static int uring_register(int fd, uint32_t opcode, void *arg,
+                          uint32_t nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void backend_uring_destroy(struct backend_uring *uring)
+{
+    uint8_t i;
+
+    for (i = 0; i < uring->num_groups; i++) {
+        munmap(uring->groups[i].ring, uring->groups[i].ring_len);
+        free(uring->groups[i].used);
+    }
+
+    if (uring->sqes)
+        munmap(uring->sqes, uring->sqes_len);
+
+    if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+        munmap(uring->cq_ring, uring->cq_ring_len);
+
+    if (uring->sq_ring)
+        munmap(uring->sq_ring, uring->sq_ring_len);
+
+    if (uring->fd >= 0)
+        close(uring->fd);
+
+    free(uring);
+}
+
+struct backend_uring *backend_uring_create(uint32_t entries)
+{
+    struct backend_uring *uring = calloc(sizeof(struct backend_uring), 1);
+    struct io_uring_params p;
+    uint8_t *sq_ring, *cq_ring;
+
+    if (!uring)
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+
+    if ((uring->fd = uring_setup(entries, &p)) < 0) {
+        free(uring);
+        return NULL;
+    }
+
+    //Waiting with a timeout requires IORING_ENTER_EXT_ARG
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        backend_uring_destroy(uring);
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    uring->sq_ring_len = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+    uring->cq_ring_len = p.cq_off.cqes +
+                         (p.cq_entries * sizeof(struct io_uring_cqe));
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_len > uring->sq_ring_len)
+            uring->sq_ring_len = uring->cq_ring_len;
+        uring->cq_ring_len = uring->sq_ring_len;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd,
+                          IORING_OFF_SQ_RING);
+
+    if (uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        backend_uring_destroy(uring);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, uring->fd,
+                              IORING_OFF_CQ_RING);
+
+        if (uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+            backend_uring_destroy(uring);
+            return NULL;
+        }
+    }
+
+    uring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        backend_uring_destroy(uring);
+        return NULL;
+    }
+
+    sq_ring = uring->sq_ring;
+    uring->sq_head = (uint32_t*) (sq_ring + p.sq_off.head);
+    uring->sq_tail = (uint32_t*) (sq_ring + p.sq_off.tail);
+    uring->sq_array = (uint32_t*) (sq_ring + p.sq_off.array);
+    uring->sq_mask = *((uint32_t*) (sq_ring + p.sq_off.ring_mask));
+    uring->sq_entries = p.sq_entries;
+
+    cq_ring = uring->cq_ring;
+    uring->cq_head = (uint32_t*) (cq_ring + p.cq_off.head);
+    uring->cq_tail = (uint32_t*) (cq_ring + p.cq_off.tail);
+    uring->cq_mask = *((uint32_t*) (cq_ring + p.cq_off.ring_mask));
+    uring->cqes = (struct io_uring_cqe*) (cq_ring + p.cq_off.cqes);
+
+    return uring;
+}
+
+int32_t backend_uring_submit(struct backend_uring *uring)
+{
+    int retval;
+
+    if (!uring->to_submit)
+        return 0;
+
+    retval = uring_enter(uring->fd, uring->to_submit, 0, 0, NULL, 0);
+
+    if (retval < 0)
+        return -1;
+
+    uring->to_submit -= retval;
+    return 0;
+}
+
+//Returns the next free sqe (zeroed), submitting the queued ones if the ring
+//is full
+static struct io_uring_sqe *uring_get_sqe(struct backend_uring *uring)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t tail = *(uring->sq_tail);
+    uint32_t idx;
+
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+            uring->sq_entries) {
+        if (backend_uring_submit(uring) ||
+            tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+                uring->sq_entries)
+            return NULL;
+    }
+
+    idx = tail & uring->sq_mask;
+    sqe = &(uring->sqes[idx]);
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+static void uring_queue_sqe(struct backend_uring *uring)
+{
+    __atomic_store_n(uring->sq_tail, *(uring->sq_tail) + 1, __ATOMIC_RELEASE);
+    uring->to_submit++;
+}
+
+//Polls are one-shot and re-armed after the callback has run. This gives the
+//same level-triggered behavior as our epoll usage, a multishot poll only
+//fires on new wakeups and would stall if a callback leaves data in the socket
+static int32_t uring_arm_poll(struct backend_uring *uring,
+                              struct backend_epoll_handle *handle,
+                              uint32_t events)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handle->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uint64_t) (uintptr_t) handle;
+    uring_queue_sqe(uring);
+    handle->armed = true;
+
+    return 0;
+}
+
+//A multishot receive keeps receiving into the provided buffers, one completion
+//per datagram, until it fails or runs out of buffers. Receiving is what makes
+//the kernel produce the next part of a netlink dump, so the receive does not
+//stall like a multishot poll
+static int32_t uring_arm_recv(struct backend_uring *uring,
+                              struct backend_epoll_handle *handle)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = handle->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = handle->buf_group - 1;
+    sqe->user_data = (uint64_t) (uintptr_t) handle;
+    uring_queue_sqe(uring);
+    handle->armed = true;
+
+    return 0;
+}
+
+static int32_t uring_arm(struct backend_uring *uring,
+                         struct backend_epoll_handle *handle)
+{
+    if (handle->buf_group && uring->use_recv)
+        return uring_arm_recv(uring, handle);
+    else
+        return uring_arm_poll(uring, handle, handle->events);
+}
+
+static void uring_add_buf(struct uring_buf_group *group, uint16_t bid)
+{
+    struct io_uring_buf *buf = &(group->ring->bufs[group->tail &
+                                                   (group->num_bufs - 1)]);
+
+    buf->addr = (uint64_t) (uintptr_t) (group->bufs + (bid * group->buf_size));
+    buf->len = group->buf_size;
+    buf->bid = bid;
+    group->tail++;
+    group->avail++;
+}
+
+static void uring_publish_bufs(struct uring_buf_group *group)
+{
+    __atomic_store_n(&(group->ring->tail), group->tail, __ATOMIC_RELEASE);
+}
+
+bool backend_uring_set_recv_bufs(struct backend_uring *uring,
+                                 struct backend_epoll_handle *handle,
+                                 uint8_t *bufs, uint32_t buf_size,
+                                 uint16_t num_bufs)
+{
+    struct uring_buf_group *group = &(uring->groups[uring->num_groups]);
+    struct io_uring_buf_reg reg;
+    uint16_t i;
+
+    if (uring->num_groups == URING_MAX_BUF_GROUPS || !num_bufs ||
+        (num_bufs & (num_bufs - 1))) {
+        errno = EINVAL;
+        return false;
+    }
+
+    group->ring_len = num_bufs * sizeof(struct io_uring_buf);
+    group->ring = mmap(NULL, group->ring_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (group->ring == MAP_FAILED) {
+        group->ring = NULL;
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) group->ring;
+    reg.ring_entries = num_bufs;
+    reg.bgid = uring->num_groups;
+
+    if (!(group->used = calloc(num_bufs, sizeof(uint16_t))) ||
+        uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(group->ring, group->ring_len);
+        free(group->used);
+        memset(group, 0, sizeof(*group));
+        return false;
+    }
+
+    group->bufs = bufs;
+    group->buf_size = buf_size;
+    group->num_bufs = num_bufs;
+
+    for (i = 0; i < num_bufs; i++)
+        uring_add_buf(group, i);
+
+    uring_publish_bufs(group);
+
+    handle->buf_group = ++uring->num_groups;
+    uring->use_recv = true;
+
+    return true;
+}
+
+int32_t backend_uring_send(struct backend_uring *uring,
+                           struct backend_epoll_handle *handle,
+                           const void *buf, uint32_t len)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = handle->fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->user_data = ((uint64_t) (uintptr_t) handle) | URING_SEND_TAG;
+    uring_queue_sqe(uring);
+
+    return 0;
+}
+
+int32_t backend_uring_update(struct backend_uring *uring, uint32_t events,
+        int32_t op, void *ptr)
+{
+    struct backend_epoll_handle *handle = ptr;
+    struct io_uring_sqe *sqe;
+
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        //Store the events, so that the poll can be re-armed. If the poll of a
+        //removed fd is still outstanding, the handle is armed again when it
+        //completes. Arming it now would leave two polls for the handle
+        handle->events = events;
+
+        if (handle->armed)
+            return 0;
+
+        return uring_arm(uring, handle);
+    case EPOLL_CTL_DEL:
+        handle->events = 0;
+
+        //The request might already have completed, with the completion still
+        //in the ring. Then the cancel fails, and the completion is ignored
+        if (!handle->armed)
+            return 0;
+
+        if (!(sqe = uring_get_sqe(uring)))
+            return -1;
+
+        handle->stale = true;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) (uintptr_t) handle;
+        sqe->user_data = URING_REMOVE_TAG;
+        uring_queue_sqe(uring);
+
+        return backend_uring_submit(uring);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+int32_t backend_uring_wait(struct backend_uring *uring, int32_t sleep_time)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    uint32_t min_complete = sleep_time ? 1 : 0;
+    int retval;
+
+    memset(&arg, 0, sizeof(arg));
+
+    if (sleep_time >= 0) {
+        ts.tv_sec = sleep_time / 1000;
+        ts.tv_nsec = (sleep_time % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    retval = uring_enter(uring->fd, uring->to_submit, min_complete,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg));
+
+    if (retval < 0)
+        return -1;
+
+    uring->to_submit -= retval;
+    return 0;
+}
+
+//Handle a completion of the multishot receive of handle. buf is NULL if no
+//datagram was received
+static void uring_dispatch_recv(struct backend_uring *uring,
+                                struct backend_epoll_handle *handle,
+                                uint8_t *buf, int32_t res)
+{
+    struct uring_buf_group *group = &(uring->groups[handle->buf_group - 1]);
+
+    //Multishot receive is not supported, poll the handles instead
+    if (res == -EINVAL && !handle->armed) {
+        uring->use_recv = false;
+
+        if (handle->events)
+            uring_arm_poll(uring, handle, handle->events);
+
+        return;
+    }
+
+    //ENOBUFS is also how the kernel reports that the ring is out of buffers.
+    //Since the buffers are only returned at the end of a dispatch, that is
+    //the case exactly when we have no buffers left in the ring
+    if (res != -ENOBUFS || group->avail)
+        handle->recv_cb(handle->data, handle->fd, buf, res);
+
+    //The receive is armed again when the buffers have been returned. Like
+    //polls, a receive that failed is not re-armed, except for overruns
+    if (handle->events && !handle->armed && (res >= 0 || res == -ENOBUFS))
+        uring_arm_recv(uring, handle);
+}
+
+void backend_uring_dispatch(struct backend_uring *uring)
+{
+    struct backend_epoll_handle *handle;
+    struct uring_buf_group *group;
+    struct io_uring_cqe *cqe;
+    uint8_t *buf;
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags, i, j;
+    uint32_t head = *(uring->cq_head);
+    uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        cqe = &(uring->cqes[head & uring->cq_mask]);
+        user_data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+
+        //Release the cqe before the callback, which might queue new sqes
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (user_data == URING_REMOVE_TAG)
+            continue;
+
+        handle = (struct backend_epoll_handle*) (uintptr_t)
+                 (user_data & ~((uint64_t) URING_SEND_TAG));
+
+        if (user_data & URING_SEND_TAG) {
+            if (handle->send_cb)
+                handle->send_cb(handle->data, res);
+            continue;
+        }
+
+        buf = NULL;
+
+        if ((flags & IORING_CQE_F_BUFFER) && handle->buf_group) {
+            group = &(uring->groups[handle->buf_group - 1]);
+            group->used[group->num_used++] = flags >> IORING_CQE_BUFFER_SHIFT;
+            group->avail--;
+            buf = group->bufs + ((flags >> IORING_CQE_BUFFER_SHIFT) *
+                                 group->buf_size);
+        }
+
+        //Polls are one-shot, receives are done when F_MORE is not set. The
+        //completions of a removed fd are ignored, but if the handle has been
+        //added again, its new request is armed when the old one is done
+        if (!(flags & IORING_CQE_F_MORE))
+            handle->armed = false;
+
+        if (handle->stale) {
+            if (!handle->armed) {
+                handle->stale = false;
+
+                if (handle->events)
+                    uring_arm(uring, handle);
+            }
+
+            continue;
+        }
+
+        //A receive that fails with EINVAL might be the first one, on a kernel
+        //without multishot receive
+        if (handle->buf_group && (uring->use_recv || res == -EINVAL)) {
+            uring_dispatch_recv(uring, handle, buf, res);
+            continue;
+        }
+
+        //Failed polls are not re-armed
+        if (res < 0)
+            continue;
+
+        handle->cb(handle->data, handle->fd, (uint32_t) res);
+
+        if (handle->events && !handle->armed)
+            uring_arm_poll(uring, handle, handle->events);
+    }
+
+    for (i = 0; i < uring->num_groups; i++) {
+        group = &(uring->groups[i]);
+
+        if (!group->num_used)
+            continue;
+
+        for (j = 0; j < group->num_used; j++)
+            uring_add_buf(group, group->used[j]);
+
+        group->num_used = 0;
+        uring_publish_bufs(group);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_EVENT_LOOP_URING_H
+#define BACKEND_EVENT_LOOP_URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct backend_event_loop;
+struct backend_epoll_handle;
+struct backend_uring;
+
+//Set up the io_uring used by the event loop. Returns NULL if the kernel does
+//not support io_uring, or lacks the features we need (IORING_FEAT_EXT_ARG, 5.11)
+struct backend_uring *backend_uring_create(uint32_t entries);
+void backend_uring_destroy(struct backend_uring *uring);
+
+//Equivalent to epoll_ctl(). Only EPOLL_CTL_ADD and EPOLL_CTL_DEL are supported
+int32_t backend_uring_update(struct backend_uring *uring, uint32_t events,
+        int32_t op, void *ptr);
+
+//Register the receive buffers of handle as a provided buffer ring
+bool backend_uring_set_recv_bufs(struct backend_uring *uring,
+                                 struct backend_epoll_handle *handle,
+                                 uint8_t *bufs, uint32_t buf_size,
+                                 uint16_t num_bufs);
+
+//Queue a send on the fd of handle, completed through send_cb
+int32_t backend_uring_send(struct backend_uring *uring,
+                           struct backend_epoll_handle *handle,
+                           const void *buf, uint32_t len);
+
+//Submit queued requests without waiting
+int32_t backend_uring_submit(struct backend_uring *uring);
+
+//Submit queued requests (re-armed polls) and wait up to sleep_time ms (-1 is
+//forever) for at least one completion, in a single system call. Returns -1 on
+//error (including timeout and EINTR)
+int32_t backend_uring_wait(struct backend_uring *uring, int32_t sleep_time);
+
+//Run the callback of every handle that has become ready (or has received a
+//datagram) and re-arm its poll or receive
+void backend_uring_dispatch(struct backend_uring *uring);
+#endif
@@ -14,6 +14,7 @@
  * TCP closer. If not, see http://www.gnu.org/licenses/.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -28,12 +29,56 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sched.h>
+#include <signal.h>
 
 #include "tcp_closer.h"
 #include "tcp_closer_netlink.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_worker.h"
+#include "tcp_closer_control.h"
+#include "tcp_closer_flows.h"
+#include "tcp_closer_peers.h"
+#include "tcp_closer_events.h"
+#include "tcp_closer_exclude.h"
+#include "tcp_closer_record.h"
+#include "tcp_closer_procnet.h"
+#include "tcp_closer_shm.h"
+#include "tcp_closer_profile.h"
+#include "tcp_closer_idle.h"
+#include "tcp_closer_lib.h"
 #include "backend_event_loop.h"
 #include "tcp_closer_log.h"
 
+//Used by the signal handler to stop the event loops, so that the snapshot is
+//written and the summary logged on shutdown
+static struct tcp_closer_ctx *main_ctx;
+
+static void stop_handler(int signum)
+{
+    uint16_t i;
+
+    main_ctx->stop_signaled = true;
+    backend_event_loop_stop(main_ctx->event_loop);
+
+    for (i = 1; i < main_ctx->num_threads && main_ctx->workers; i++) {
+        backend_event_loop_stop(main_ctx->workers[i]->event_loop);
+    }
+}
+
+static void install_stop_handler(struct tcp_closer_ctx *ctx)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+
+    main_ctx = ctx;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
+
 static void show_help();
 
 static char *inet_diag_op_code_str[] = {
@@ -50,30 +95,10 @@ static char *inet_diag_op_code_str[] = {
 	"INET_DIAG_BC_MARK_COND"
 };
 
-static void dump_timeout_cb(void *ptr)
-{
-    struct tcp_closer_ctx *ctx = ptr;
-
-    //Check if dump is in progress
-
-    if (ctx->dump_in_progress) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Dump in progress\n");
-        //Start some shorter interval?
-        return;
-    }
-
-    if (send_diag_msg(ctx) < 0) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Sending diag message failed "
-                                "with %s (%u)\n", strerror(errno), errno);
-        //Start some shorter interval?
-    }
-
-    ctx->dump_in_progress = true;
-}
-
 static void output_filter(struct tcp_closer_ctx *ctx)
 {
     uint16_t num_ops = ctx->diag_filter_len / sizeof(struct inet_diag_bc_op);
+    struct inet_diag_hostcond *cond;
     uint16_t i;
 
     TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Content of INET_DIAG filter:\n");
@@ -86,23 +111,90 @@ static void output_filter(struct tcp_closer_ctx *ctx)
         TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "diag_filter[%u]->no = %u\n", i,
                                 ctx->diag_filter[i].no);
         TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "\n");
+
+        //Host conditions (exclusions) are followed by the condition and the
+        //address, skip past them
+        if (ctx->diag_filter[i].code == INET_DIAG_BC_D_COND) {
+            cond = (struct inet_diag_hostcond*) &(ctx->diag_filter[i + 1]);
+            i += (sizeof(*cond) + (cond->family == AF_INET ? 4 : 16)) /
+                 sizeof(struct inet_diag_bc_op);
+        }
+    }
+}
+
+static bool port_in_list(const uint16_t *ports, uint16_t num_ports,
+                         uint32_t port)
+{
+    uint16_t i;
+
+    for (i = 0; i < num_ports; i++) {
+        if (ports[i] == port) {
+            return true;
+        }
     }
+
+    return false;
 }
 
-static void create_filter(int argc, char *argv[], struct tcp_closer_ctx *ctx,
+//Check that the filter matches exactly the configured ports on one side, when
+//the other side is a port it accepts. Mistakes in the offsets show up at the
+//boundaries, so the ports next to every configured port are checked too
+static bool verify_filter_side(struct tcp_closer_ctx *ctx, bool sport_side,
+                               const uint16_t *ports, uint16_t num_ports,
+                               const uint16_t *other, uint16_t num_other)
+{
+    struct tcp_closer_lib_sock sock;
+    uint32_t port, candidates[3 * MAX_NUM_PORTS + 2];
+    uint16_t i, num_candidates = 0;
+    bool expected;
+
+    candidates[num_candidates++] = 0;
+    candidates[num_candidates++] = 0xFFFF;
+
+    for (i = 0; i < num_ports; i++) {
+        candidates[num_candidates++] = ports[i] - 1;
+        candidates[num_candidates++] = ports[i];
+        candidates[num_candidates++] = ports[i] + 1;
+    }
+
+    memset(&sock, 0, sizeof(sock));
+    sock.family = ctx->socket_family;
+
+    for (i = 0; i < num_candidates; i++) {
+        port = candidates[i];
+
+        if (port > 0xFFFF) {
+            continue;
+        }
+
+        if (sport_side) {
+            sock.sport = port;
+            sock.dport = num_other ? other[0] : port;
+        } else {
+            sock.dport = port;
+            sock.sport = num_other ? other[0] : port;
+        }
+
+        expected = !num_ports || port_in_list(ports, num_ports, port);
+
+        if (tcp_closer_lib_filter_run(ctx->diag_filter, ctx->diag_filter_len,
+                                      &sock) != expected) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Filter %s %s port %u\n",
+                                    expected ? "does not match" : "matches",
+                                    sport_side ? "source" : "destination",
+                                    port);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool create_filter(int argc, char *argv[], struct tcp_closer_ctx *ctx,
                           uint16_t num_sport, uint16_t num_dport)
 {
-    //Destination ports are always stored after source ports in our buffer
-    struct inet_diag_bc_op *diag_sports = ctx->diag_filter;
-    struct inet_diag_bc_op *diag_dports = ctx->diag_filter +
-                                          (num_sport ? ((num_sport - 1) * 5) + 4 : 0);
-    uint16_t diag_sports_idx = 0, diag_dports_idx = 0, diag_sports_num = 1,
-             diag_dports_num = 1;
-
-    //Value used by the generic part of the function
-    struct inet_diag_bc_op *diag_cur_ops;
-    uint16_t *diag_cur_idx, *diag_cur_num, diag_cur_count, left_of_filter;
-    uint8_t code_ge, code_le;
+    uint16_t sports[MAX_NUM_PORTS], dports[MAX_NUM_PORTS];
+    uint16_t sports_idx = 0, dports_idx = 0, i;
 
     int opt;
     struct option long_options[] = {
@@ -120,100 +212,233 @@ static void create_filter(int argc, char *argv[], struct tcp_closer_ctx *ctx,
     opterr = 0;
 
     while ((opt = getopt_long(argc, argv, "s:d:", long_options, NULL)) != -1) {
-        if (opt != 's' && opt != 'd') {
-            continue;
+        if (opt == 's') {
+            sports[sports_idx++] = atoi(optarg);
+        } else if (opt == 'd') {
+            dports[dports_idx++] = atoi(optarg);
         }
+    }
 
-        if (opt == 's') {
-            code_ge = INET_DIAG_BC_S_GE;
-            code_le = INET_DIAG_BC_S_LE;
-            diag_cur_ops = diag_sports;
-            diag_cur_idx = &diag_sports_idx;
-            diag_cur_num = &diag_sports_num;
-            diag_cur_count = num_sport;
-        } else {
-            code_ge = INET_DIAG_BC_D_GE;
-            code_le = INET_DIAG_BC_D_LE;
-            diag_cur_ops = diag_dports;
-            diag_cur_idx = &diag_dports_idx;
-            diag_cur_num = &diag_dports_num;
-            diag_cur_count = num_dport;
+    if (ctx->shm) {
+        for (i = 0; i < num_sport; i++) {
+            tcp_closer_shm_add_rule(ctx, sports[i], SHM_RULE_SPORT);
         }
 
-        //Create the greater than operation. The only interesting thing
-        //going on is the value of no. If this is the last sport and
-        //we don't match, we should abort loop. Thus, we set it to 0xFFFF to
-        //ensure that len will be negative
-        diag_cur_ops[*diag_cur_idx].code = code_ge;
-        diag_cur_ops[*diag_cur_idx].yes = sizeof(struct inet_diag_bc_op) * 2;
-        diag_cur_ops[*diag_cur_idx].no = *diag_cur_num == diag_cur_count ?
-                                         0 :
-                                         sizeof(struct inet_diag_bc_op) * 5;
-        diag_cur_ops[(*diag_cur_idx) + 1].code = INET_DIAG_BC_NOP;
-        diag_cur_ops[(*diag_cur_idx) + 1].yes = sizeof(struct inet_diag_bc_op);
-        diag_cur_ops[(*diag_cur_idx) + 1].no = atoi(optarg);
-
-        //Same as above. Here, yes is interesting. We can jump straight to
-        //dports. This means offset is sizeof() * 2 to pass this block.
-        //Then, we add sizeof() * 4 * (num_sport - diag_sports_num) to pass
-        //rest of sport comparisons
-        diag_cur_ops[(*diag_cur_idx) + 2].code = code_le;
-        diag_cur_ops[(*diag_cur_idx) + 2].yes = sizeof(struct inet_diag_bc_op) * 2;
-        diag_cur_ops[(*diag_cur_idx) + 2].no = *diag_cur_num == diag_cur_count ?
-                                               0 :
-                                               sizeof(struct inet_diag_bc_op) * 3;
-        diag_cur_ops[(*diag_cur_idx) + 3].code = INET_DIAG_BC_NOP;
-        diag_cur_ops[(*diag_cur_idx) + 3].yes = sizeof(struct inet_diag_bc_op);
-        diag_cur_ops[(*diag_cur_idx) + 3].no = atoi(optarg);
-
-        if (*diag_cur_num != diag_cur_count) {
-            diag_cur_ops[(*diag_cur_idx) + 4].code = INET_DIAG_BC_JMP;
-            diag_cur_ops[(*diag_cur_idx) + 4].yes = sizeof(struct inet_diag_bc_op);
-
-            //Logic behind this calculation is as follows. If we hit a JMP, we
-            //want to skip all the remaining operations of this type. All
-            //comparisons block, except the last one, contains a JMP op. The
-            //last block does not need a JMP op, since we will either fail and
-            //jump to the end (no can have any offset) or continue with
-            //comparisons/finish if we match.
-            //
-            //The offset for any jump block is sizeof() * (num_left - 1) * 5 +
-            //sizeof() * 4 + sizeof(). First part all all normal blocks, second
-            //is the size of the last block and third is this struct
-            diag_cur_ops[(*diag_cur_idx) + 4].no = sizeof(struct inet_diag_bc_op) +
-                                                   ((diag_cur_count - *diag_cur_num - 1) * sizeof(struct inet_diag_bc_op) * 5) +
-                                                   sizeof(struct inet_diag_bc_op) * 4;
-            (*diag_cur_idx) += 5;
-        } else {
-            (*diag_cur_idx) += 4;
+        for (i = 0; i < num_dport; i++) {
+            tcp_closer_shm_add_rule(ctx, dports[i], SHM_RULE_DPORT);
         }
+    }
+
+    if (ctx->idle_stats_intvl &&
+        !tcp_closer_idle_init(ctx, sports, num_sport, dports, num_dport)) {
+        return false;
+    }
+
+    tcp_closer_lib_filter_write(ctx->diag_filter, sports, num_sport, dports,
+                                num_dport);
+
+    //Run the same checks as the kernel, so that a broken filter is reported
+    //here and not as an error on the first dump
+    if (!tcp_closer_lib_filter_audit(ctx->diag_filter, ctx->diag_filter_len)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Generated filter is invalid\n");
+        return false;
+    }
+
+    return verify_filter_side(ctx, true, sports, num_sport, dports,
+                              num_dport) &&
+           verify_filter_side(ctx, false, dports, num_dport, sports,
+                              num_sport);
+}
+
+static bool validate_adaptive_interval(struct tcp_closer_ctx *ctx)
+{
+    uint32_t base_interval = ctx->dump_interval;
+
+    if (!ctx->dump_interval) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "--adaptive_interval requires "
+                                "--interval\n");
+        return false;
+    }
+
+    if (!ctx->min_interval) {
+        ctx->min_interval = base_interval < SCHED_DEFAULT_MIN_INTVL ?
+                            base_interval : SCHED_DEFAULT_MIN_INTVL;
+    }
+
+    if (!ctx->max_interval) {
+        ctx->max_interval = base_interval * SCHED_DEFAULT_MAX_MULT;
+    }
 
-        (*diag_cur_num) += 1;
+    if (ctx->min_interval > base_interval ||
+        ctx->max_interval < base_interval) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Interval (%ums) must be "
+                                "between min_interval (%ums) and max_interval "
+                                "(%ums)\n", base_interval, ctx->min_interval,
+                                ctx->max_interval);
+        return false;
     }
 
-    if (num_sport) {
-        diag_sports_idx -= 4;
-        if (num_dport) {
-            left_of_filter = ((num_dport - 1) * sizeof(struct inet_diag_bc_op) * 5) +
-                             sizeof(struct inet_diag_bc_op) * 4;
+    ctx->cur_interval = base_interval;
+    return true;
+}
+
+static bool configure_peers(struct tcp_closer_ctx *ctx)
+{
+    uint8_t max_prefix = ctx->socket_family == AF_INET ? 32 : 128;
+
+    if (ctx->peer_prefix == UINT8_MAX) {
+        ctx->peer_prefix = max_prefix;
+    } else if (ctx->peer_prefix > max_prefix) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "peer_prefix can't be larger than "
+                                "%u\n", max_prefix);
+        return false;
+    }
+
+    return tcp_closer_peers_init(ctx, ctx->peer_prefix, ctx->peer_idle_pct);
+}
+
+//Handle options that only have a long version. Returns false if the value of
+//the option is invalid
+static bool parse_long_option(struct tcp_closer_ctx *ctx, const char *name,
+                              const char *value)
+{
+    if (!strcmp("use_proc", name)) {
+        ctx->use_netlink = false;
+    } else if (!strcmp("proc_kill", name)) {
+        ctx->proc_kill = true;
+    } else if (!strcmp("disable_syslog", name)) {
+        ctx->use_syslog = false;
+    } else if (!strcmp("last_recv_limit", name)) {
+        if (!atoi(value)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
+                                    "last_recv_limit (value %s)\n", value);
+            return false;
+        }
+
+        ctx->last_data_recv_limit = atoi(value);
+    } else if (!strcmp("adaptive_interval", name)) {
+        ctx->adaptive_interval = true;
+    } else if (!strcmp("min_interval", name)) {
+        if (!atoi(value)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
+                                    "min_interval (value %s)\n", value);
+            return false;
+        }
+
+        ctx->min_interval = atoi(value);
+    } else if (!strcmp("max_interval", name)) {
+        if (!atoi(value)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
+                                    "max_interval (value %s)\n", value);
+            return false;
+        }
+
+        ctx->max_interval = atoi(value);
+    } else if (!strcmp("cpu_list", name)) {
+        ctx->cpu_list = value;
+    } else if (!strcmp("sched_policy", name)) {
+        if (!strcmp("idle", value)) {
+            ctx->sched_policy = SCHED_IDLE;
+        } else if (!strcmp("batch", value)) {
+            ctx->sched_policy = SCHED_BATCH;
         } else {
-            left_of_filter = 0;
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
+                                    "sched_policy (value %s)\n", value);
+            return false;
         }
+    } else if (!strcmp("nice", name)) {
+        ctx->nice_value = atoi(value);
 
-        diag_sports[diag_sports_idx].no = left_of_filter +
-                                          sizeof(struct inet_diag_bc_op) * 4
-                                          + 4;
-        diag_sports[diag_sports_idx + 2].no = left_of_filter +
-                                              sizeof(struct inet_diag_bc_op) * 2
-                                              + 4;
-    }
+        if (ctx->nice_value < -20 || ctx->nice_value > 19) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid nice value "
+                                    "(value %s)\n", value);
+            return false;
+        }
+
+        ctx->set_nice = true;
+    } else if (!strcmp("dump_budget", name)) {
+        if (!atoi(value)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
+                                    "dump_budget (value %s)\n", value);
+            return false;
+        }
+
+        ctx->dump_budget = atoi(value);
+    } else if (!strcmp("quiet", name)) {
+        ctx->quiet_mode = true;
+    } else if (!strcmp("dry_run", name)) {
+        ctx->dry_run = true;
+    } else if (!strcmp("control_socket", name)) {
+        ctx->control_path = value;
+    } else if (!strcmp("track_flows", name)) {
+        ctx->track_flows = true;
+    } else if (!strcmp("snapshot", name)) {
+        ctx->track_flows = true;
+        ctx->snapshot_path = value;
+    } else if (!strcmp("interval_ms", name)) {
+        if (!atoi(value)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid dump "
+                                    "interval (value %s)\n", value);
+            return false;
+        }
+
+        ctx->dump_interval = atoi(value);
+    } else if (!strcmp("busy_poll", name)) {
+        ctx->busy_poll = true;
+    } else if (!strcmp("io_uring", name)) {
+        ctx->use_io_uring = true;
+    } else if (!strcmp("exclude_file", name)) {
+        ctx->exclude_path = value;
+    } else if (!strcmp("events", name)) {
+        ctx->events_path = value;
+    } else if (!strcmp("record", name)) {
+        ctx->record_path = value;
+    } else if (!strcmp("replay", name)) {
+        ctx->replay_path = value;
+    } else if (!strcmp("replay_paced", name)) {
+        ctx->replay_paced = true;
+    } else if (!strcmp("proc_net", name)) {
+        ctx->use_proc_net = true;
+    } else if (!strcmp("shm", name)) {
+        ctx->shm_name = value;
+    } else if (!strcmp("profile", name)) {
+        ctx->use_profile = true;
+    } else if (!strcmp("idle_stats", name)) {
+        if (!atoi(value)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid idle_stats "
+                                    "interval (value %s)\n", value);
+            return false;
+        }
+
+        ctx->idle_stats_intvl = atoi(value) * 1000;
+    } else if (!strcmp("peer_idle_fraction", name)) {
+        ctx->peer_idle_pct = atoi(value);
+
+        if (!ctx->peer_idle_pct || atoi(value) > 100) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
+                                    "peer_idle_fraction (value %s)\n", value);
+            return false;
+        }
+    } else if (!strcmp("peer_prefix", name)) {
+        if (atoi(value) < 0 || atoi(value) > 128) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid peer_prefix "
+                                    "(value %s)\n", value);
+            return false;
+        }
 
-    if (num_dport) {
-        diag_dports_idx -= 4;
+        ctx->peer_prefix = atoi(value);
+    } else if (!strcmp("threads", name)) {
+        ctx->num_threads = atoi(value);
 
-        diag_dports[diag_dports_idx].no = (sizeof(struct inet_diag_bc_op) * 4) + 4;
-        diag_dports[diag_dports_idx + 2].no = (sizeof(struct inet_diag_bc_op) * 2) + 4;
+        if (!ctx->num_threads || ctx->num_threads > TCP_CLOSER_MAX_THREADS) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid number of "
+                                    "threads (value %s, max %u)\n", value,
+                                    TCP_CLOSER_MAX_THREADS);
+            return false;
+        }
     }
+
+    return true;
 }
 
 //Counts config ports and returns false if any unknown options is found
@@ -233,8 +458,36 @@ static bool parse_cmdargs(int argc, char *argv[], uint16_t *num_sport,
         {"verbose",         no_argument,        NULL,   'v'},
         {"help",            no_argument,        NULL,   'h'},
         {"use_proc",        no_argument,        NULL,    0 },
+        {"proc_kill",       no_argument,        NULL,    0 },
         {"disable_syslog",  no_argument,        NULL,    0 },
         {"last_recv_limit", required_argument,  NULL,    0 },
+        {"adaptive_interval", no_argument,      NULL,    0 },
+        {"min_interval",    required_argument,  NULL,    0 },
+        {"max_interval",    required_argument,  NULL,    0 },
+        {"cpu_list",        required_argument,  NULL,    0 },
+        {"sched_policy",    required_argument,  NULL,    0 },
+        {"nice",            required_argument,  NULL,    0 },
+        {"dump_budget",     required_argument,  NULL,    0 },
+        {"threads",         required_argument,  NULL,    0 },
+        {"control_socket",  required_argument,  NULL,    0 },
+        {"quiet",           no_argument,        NULL,    0 },
+        {"dry_run",         no_argument,        NULL,    0 },
+        {"track_flows",     no_argument,        NULL,    0 },
+        {"snapshot",        required_argument,  NULL,    0 },
+        {"peer_idle_fraction", required_argument, NULL,  0 },
+        {"peer_prefix",     required_argument,  NULL,    0 },
+        {"events",          required_argument,  NULL,    0 },
+        {"record",          required_argument,  NULL,    0 },
+        {"replay",          required_argument,  NULL,    0 },
+        {"replay_paced",    no_argument,        NULL,    0 },
+        {"proc_net",        no_argument,        NULL,    0 },
+        {"shm",             required_argument,  NULL,    0 },
+        {"profile",         no_argument,        NULL,    0 },
+        {"idle_stats",      required_argument,  NULL,    0 },
+        {"interval_ms",     required_argument,  NULL,    0 },
+        {"busy_poll",       no_argument,        NULL,    0 },
+        {"io_uring",        no_argument,        NULL,    0 },
+        {"exclude_file",    required_argument,  NULL,    0 },
         {0,                 0,                  0,       0 }
     };
 
@@ -242,25 +495,8 @@ static bool parse_cmdargs(int argc, char *argv[], uint16_t *num_sport,
                                         long_options, &option_index)) != -1) {
         switch (opt) {
         case 0:
-            //TODO: When we add more arguments with only a long option, we will
-            //split handling long options into a separate function
-            if (!strcmp("use_proc", long_options[option_index].name)) {
-                ctx->use_netlink = false;
-            } else if (!strcmp("disable_syslog",
-                               long_options[option_index].name)) {
-                ctx->use_syslog = false;
-            } else if (!strcmp("last_recv_limit",
-                               long_options[option_index].name)) {
-                if (!atoi(optarg)) {
-                    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid "
-                                            "last_recv_limit (value %s)\n",
-                                            optarg);
-                    error = true;
-                } else {
-                    ctx->last_data_recv_limit = atoi(optarg);
-                }
-            }
-
+            error = !parse_long_option(ctx, long_options[option_index].name,
+                                       optarg);
             break;
         case 's':
             if (!atoi(optarg)) {
@@ -295,7 +531,7 @@ static bool parse_cmdargs(int argc, char *argv[], uint16_t *num_sport,
                 TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Found invalid dump "
                                         "interval (value %s)\n", optarg);
             } else {
-                ctx->dump_interval = atoi(optarg);
+                ctx->dump_interval = atoi(optarg) * 1000;
             }
             break;
         case 'v':
@@ -343,67 +579,56 @@ static bool parse_cmdargs(int argc, char *argv[], uint16_t *num_sport,
         }
     }
 
-#ifdef NO_SOCK_DESTROY
-    if (!error && ctx->use_netlink) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "SOCK_DESTROY not supported. You "
-                                "must set the --use_proc command line "
-                                "argument\n");
+    if (!error && ctx->adaptive_interval) {
+        error = !validate_adaptive_interval(ctx);
+    }
+
+    //A dump is split across intervals when the budget is exceeded, so there
+    //has to be an interval
+    if (!error && ctx->dump_budget && !ctx->dump_interval) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "--dump_budget requires "
+                                "--interval\n");
+        error = true;
+    }
+
+    //There is no time of last received data in /proc, so sockets can only be
+    //matched on ports and addresses
+    if (!error && ctx->use_proc_net &&
+        (ctx->idle_time || ctx->last_data_recv_limit)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "--proc_net requires an idle "
+                                "time of 0 and no --last_recv_limit\n");
         error = true;
     }
-#endif
 
     return !error;
 }
 
-static bool configure(struct tcp_closer_ctx *ctx, int argc, char *argv[])
+//Fall back to closing sockets through /proc if SOCK_DESTROY is not supported
+//by the kernel (or the build). Workers are copies of ctx, so they inherit the
+//choice
+static void probe_destroy(struct tcp_closer_ctx *ctx)
 {
-    uint16_t num_sport = 0, num_dport = 0;
-
-    if (!(ctx->event_loop = backend_event_loop_create())) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create event loop\n");
-        return false;
-    }
+    int error;
 
-    if (!(ctx->diag_dump_socket = mnl_socket_open(NETLINK_INET_DIAG))) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create inet_diag dump "
-                                "socket. Error: %s (%u)\n", strerror(errno),
-                                errno);
-        return false;
+    if (!ctx->use_netlink || ctx->dry_run) {
+        return;
     }
 
-    if (!(ctx->diag_destroy_socket = mnl_socket_open(NETLINK_INET_DIAG))) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create inet_diag dump "
-                                "socket. Error: %s (%u)\n", strerror(errno),
-                                errno);
-        return false;
+    if (!(error = tcp_closer_netlink_probe_destroy(ctx))) {
+        return;
     }
 
-    mnl_socket_bind(ctx->diag_dump_socket, 0, MNL_SOCKET_AUTOPID);
-    mnl_socket_bind(ctx->diag_destroy_socket, 0, MNL_SOCKET_AUTOPID);
-
-    if (!(ctx->dump_handle = backend_create_epoll_handle(ctx,
-                                                         mnl_socket_get_fd(ctx->diag_dump_socket),
-                                                         recv_diag_msg))) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create diag dump "
-                                "epoll handle\n");
-        return false;
-    }
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "SOCK_DESTROY is not usable, closing "
+                            "sockets through /proc. Reason: %s (%u)\n",
+                            strerror(error), error);
+    ctx->use_netlink = false;
+}
 
-    //Set clock to 0 so we send first dump request right away
-    if (!(ctx->dump_timeout = backend_event_loop_create_timeout(0,
-                                                                dump_timeout_cb,
-                                                                ctx, 0))) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create dump "
-                                "timeout\n");
-        return false;
-    }
-    backend_insert_timeout(ctx->event_loop, ctx->dump_timeout);
+static bool configure(struct tcp_closer_ctx *ctx, int argc, char *argv[])
+{
+    uint16_t num_sport = 0, num_dport = 0;
 
-    if (!(ctx->destroy_handle = backend_create_epoll_handle(ctx,
-                                                            mnl_socket_get_fd(ctx->diag_destroy_socket),
-                                                            recv_destroy_msg))) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create diag dump "
-                                "epoll handle\n");
+    if (!tcp_closer_worker_init(ctx)) {
         return false;
     }
 
@@ -420,27 +645,46 @@ static bool configure(struct tcp_closer_ctx *ctx, int argc, char *argv[])
         return false;
     }
 
+    //A replay only evaluates the captured sockets, nothing is destroyed
+    if (ctx->replay_path) {
+        ctx->dry_run = true;
+        ctx->num_threads = 0;
+        ctx->record_path = NULL;
+        ctx->control_path = NULL;
+        ctx->shm_name = NULL;
+    }
+
+    //The file is read in one go, there are no dump messages to split between
+    //threads or over several intervals
+    if (ctx->use_proc_net) {
+        ctx->num_threads = 0;
+        ctx->dump_budget = 0;
+    }
+
+    if (!tcp_closer_sched_apply_cpu(ctx)) {
+        return false;
+    }
+
     if (ctx->dump_interval) {
-        ctx->dump_timeout->intvl = ctx->dump_interval * 1000;
+        ctx->dump_timeout->intvl = ctx->dump_interval;
+    }
+
+    //The main context is initialized before the options are parsed
+    ctx->event_loop->busy_poll = ctx->busy_poll;
+
+    probe_destroy(ctx);
+
+    //Failing is not fatal, we keep using epoll
+    if (ctx->use_io_uring) {
+        tcp_closer_worker_use_uring(ctx);
     }
 
     TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "# source ports: %u # destination "
-                            "ports: %u idle time: %ums interval: %usec\n",
+                            "ports: %u idle time: %ums interval: %ums\n",
                             num_sport, num_dport, ctx->idle_time,
                             ctx->dump_interval);
 
-    //Since there is no equal operator, a port comparison will requires five
-    //bc_op-structs. Two for LE (since ports is kept in a second struct), two
-    //for GE and one for JMP
-    if (num_sport) {
-        ctx->diag_filter_len += sizeof(struct inet_diag_bc_op) * 5 * (num_sport - 1) +
-                                sizeof(struct inet_diag_bc_op) * 4;
-    }
-
-    if (num_dport) {
-        ctx->diag_filter_len += sizeof(struct inet_diag_bc_op) * 5 * (num_dport - 1) +
-                                sizeof(struct inet_diag_bc_op) * 4;
-    }
+    ctx->diag_filter_len = tcp_closer_lib_filter_len(num_sport, num_dport);
 
     ctx->diag_filter = calloc(ctx->diag_filter_len, 1);
     if (!ctx->diag_filter) {
@@ -449,9 +693,56 @@ static bool configure(struct tcp_closer_ctx *ctx, int argc, char *argv[])
         return false;
     }
 
-    create_filter(argc, argv, ctx, num_sport, num_dport);
+    //Created before the filter, so that the ports can be added as rules
+    if (ctx->shm_name && !tcp_closer_shm_init(ctx, ctx->shm_name)) {
+        return false;
+    }
 
-    return true;
+    if (!create_filter(argc, argv, ctx, num_sport, num_dport)) {
+        return false;
+    }
+
+    if (ctx->exclude_path && (!tcp_closer_exclude_init(ctx, ctx->exclude_path) ||
+                              !tcp_closer_exclude_compile(ctx))) {
+        return false;
+    }
+
+    //Shards split the port space on the side that the user has not restricted,
+    //since that is where the connections are spread out. If both sides are
+    //restricted, any side works
+    ctx->shard_on_sport = !num_sport;
+
+    tcp_closer_netlink_select_parser(ctx);
+
+    if (!tcp_closer_sched_init_shards(ctx)) {
+        return false;
+    }
+
+    if (ctx->control_path && !tcp_closer_control_init(ctx, ctx->control_path)) {
+        return false;
+    }
+
+    if (ctx->track_flows && !tcp_closer_flows_init(ctx, ctx->snapshot_path)) {
+        return false;
+    }
+
+    if (ctx->peer_idle_pct && !configure_peers(ctx)) {
+        return false;
+    }
+
+    if (ctx->events_path && !tcp_closer_events_init(ctx, ctx->events_path)) {
+        return false;
+    }
+
+    if (ctx->record_path && !tcp_closer_record_init(ctx, ctx->record_path)) {
+        return false;
+    }
+
+    if (ctx->use_proc_net && !tcp_closer_procnet_init(ctx)) {
+        return false;
+    }
+
+    return tcp_closer_workers_create(ctx);
 }
 
 static void show_help()
@@ -469,13 +760,82 @@ static void show_help()
     fprintf(stdout, "\t-f/--logfile : Path to logfile (default is stderr)\n");
     fprintf(stdout, "\t-v/--verbose : More verbose output\n");
     fprintf(stdout, "\t-h/--help : This output\n");
-    fprintf(stdout, "\t--use_proc : Find inode in proc + kill instead of using "
-            "SOCK_DESTROY\n");
+    fprintf(stdout, "\t--use_proc : Find inode in proc and shut down the "
+            "socket (using pidfd_getfd) instead of using SOCK_DESTROY\n");
+    fprintf(stdout, "\t--proc_kill : With --use_proc, kill the process owning "
+            "the socket instead of shutting down the socket\n");
     fprintf(stdout, "\t--disable_syslog : Do not write log messages to syslog\n");
     fprintf(stdout, "\t--last_recv_limit : Upper limit for last data received "
             "(in ms). Defaults to 0 and is used to filter out recently "
             "established connections. Before data is received, a connection "
             "contains a bogus last data received timestamp\n");
+    fprintf(stdout, "\t--adaptive_interval : Adapt the dump interval to the "
+            "cost of dumps and the number of matched sockets. Requires "
+            "--interval\n");
+    fprintf(stdout, "\t--min_interval : Lower limit for the adaptive interval "
+            "(in ms). Defaults to %u ms or interval, whichever is smaller\n",
+            SCHED_DEFAULT_MIN_INTVL);
+    fprintf(stdout, "\t--max_interval : Upper limit for the adaptive interval "
+            "(in ms). Defaults to %u x interval\n", SCHED_DEFAULT_MAX_MULT);
+    fprintf(stdout, "\t--cpu_list : Pin tcp_closer to the given CPUs (for "
+            "example 0-3,6)\n");
+    fprintf(stdout, "\t--sched_policy : Run tcp_closer with the idle or batch "
+            "scheduling policy\n");
+    fprintf(stdout, "\t--nice : Nice value of tcp_closer (-20 - 19)\n");
+    fprintf(stdout, "\t--dump_budget : CPU time budget per dump (in ms). When "
+            "a dump exceeds the budget, the port space is split into shards "
+            "and one shard is dumped per interval. Requires --interval\n");
+    fprintf(stdout, "\t--threads : Number of threads used for dumping and "
+            "destroying sockets (max %u). Each thread dumps its own part of "
+            "the port space\n", TCP_CLOSER_MAX_THREADS);
+    fprintf(stdout, "\t--quiet : Do not log every destroyed socket\n");
+    fprintf(stdout, "\t--dry_run : Log matching sockets, but do not destroy "
+            "them\n");
+    fprintf(stdout, "\t--control_socket : Path of Unix datagram socket used "
+            "for requesting scans, statistics and pausing/resuming dumps\n");
+    fprintf(stdout, "\t--track_flows : Keep track of how long every socket "
+            "has been seen. Sockets with a bogus last data received (see "
+            "--last_recv_limit) are destroyed when they have been known for "
+            "longer than idle_time\n");
+    fprintf(stdout, "\t--snapshot : Path of file that the flows are saved to "
+            "periodically and on shutdown, and loaded from on start. Implies "
+            "--track_flows\n");
+    fprintf(stdout, "\t--peer_idle_fraction : Group sockets by remote peer. "
+            "When at least this percentage (1-100) of the connections to a "
+            "peer are idle, all connections to the peer are destroyed\n");
+    fprintf(stdout, "\t--peer_prefix : Prefix length used for grouping peers "
+            "(for example 24 or 64). Defaults to the full address\n");
+    fprintf(stdout, "\t--events : Write one NDJSON record per destroyed "
+            "socket and per dump to the given file or FIFO, or to a Unix "
+            "datagram socket (unix:<path>)\n");
+    fprintf(stdout, "\t--exclude_file : File with networks, UIDs and pids "
+            "whose connections are never destroyed\n");
+    fprintf(stdout, "\t--interval_ms : Same as --interval, but in ms\n");
+    fprintf(stdout, "\t--busy_poll : Poll the netlink sockets without sleeping, "
+            "for the lowest possible latency. Uses a full CPU per thread, so "
+            "combine with --cpu_list\n");
+    fprintf(stdout, "\t--record : Write all datagrams received from the "
+            "kernel (dumps and destroy acks) to the given capture file\n");
+    fprintf(stdout, "\t--replay : Evaluate the dumps in the given capture "
+            "file instead of dumping, and report the throughput. Implies "
+            "--dry_run\n");
+    fprintf(stdout, "\t--replay_paced : With --replay, feed the dumps at the "
+            "recorded pace instead of as fast as possible\n");
+    fprintf(stdout, "\t--proc_net : Read the sockets from /proc/net/tcp[6] "
+            "instead of dumping them with inet_diag. Requires an idle time "
+            "of 0\n");
+    fprintf(stdout, "\t--shm : Publish statistics and recent decisions in a "
+            "shared memory segment with the given name (for example "
+            "tcp_closer), read by tcp-closer-top\n");
+    fprintf(stdout, "\t--profile : Count cycles and instructions per "
+            "pipeline stage with perf_event_open() and log cycles per "
+            "socket in the summary (per dump with --verbose)\n");
+    fprintf(stdout, "\t--idle_stats : Log the idle time distribution of "
+            "every port and the most idle connections every given number of "
+            "seconds\n");
+    fprintf(stdout, "\t--io_uring : Receive and send netlink messages and "
+            "wait for timers with io_uring instead of epoll (falls back to "
+            "epoll if not supported)\n");
     fprintf(stdout, "\n");
     fprintf(stdout, "At least one source or destination port must be given.\n"
                     "We will kill connections where the source port is one of\n"
@@ -488,6 +848,7 @@ static void show_help()
 int main(int argc, char *argv[])
 {
     struct tcp_closer_ctx *ctx = NULL;
+    bool retval;
 
     //Parse options, so far it just to get sport and dport
     if (argc < 2) {
@@ -505,6 +866,15 @@ int main(int argc, char *argv[])
     ctx->logfile = stderr;
     ctx->use_syslog = true;
     ctx->socket_family = AF_INET;
+    ctx->sched_policy = SCHED_OTHER;
+    ctx->shard_port_hi = 0xFFFF;
+    ctx->peer_prefix = UINT8_MAX;
+
+    ctx->stats = calloc(sizeof(struct tcp_closer_stats), 1);
+    if (!ctx->stats) {
+        fprintf(stderr, "Failed to allocate memory for statistics\n");
+        return 1;
+    }
 
     if (!configure(ctx, argc, argv)) {
         return 1;
@@ -514,13 +884,18 @@ int main(int argc, char *argv[])
         output_filter(ctx);
     }
 
-    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
-                              mnl_socket_get_fd(ctx->diag_dump_socket),
-                              ctx->dump_handle);
+    if (ctx->replay_path) {
+        if (ctx->use_profile) {
+            tcp_closer_profile_start(ctx);
+        }
+
+        retval = tcp_closer_record_replay(ctx, ctx->replay_path,
+                                          ctx->replay_paced);
+        tcp_closer_profile_log(ctx);
+        return !retval;
+    }
 
-    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
-                              mnl_socket_get_fd(ctx->diag_destroy_socket),
-                              ctx->destroy_handle);
+    install_stop_handler(ctx);
 
-    backend_event_loop_run(ctx->event_loop);
+    tcp_closer_workers_run(ctx);
 }
@@ -19,12 +19,30 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 struct inet_diag_bc_op;
+struct inet_diag_msg;
 struct mnl_socket;
 struct backend_event_loop;
 struct backend_epoll_handle;
 struct backend_timeout_handle;
+struct mmsghdr;
+struct iovec;
+struct tcp_closer_control;
+struct tcp_closer_flows;
+struct tcp_closer_peers;
+struct tcp_closer_events;
+struct tcp_closer_exclude;
+struct tcp_closer_destroy_pending;
+struct tcp_closer_record;
+struct tcp_closer_batch;
+struct tcp_closer_procnet;
+struct tcp_closer_arena;
+struct tcp_closer_shm_writer;
+struct tcp_closer_shm_worker;
+struct tcp_closer_profile;
+struct tcp_closer_idle;
 
 //This is an artifical limitation introduced by me, but is large enough for at
 //least my use-cases. Since there is no EQ operator, we need to check a port for
@@ -38,17 +56,145 @@ struct backend_timeout_handle;
 //0xFFFF
 #define MAX_NUM_PORTS 128
 
+//Counters are shared between all workers, so they must always be updated
+//using TCP_CLOSER_STATS_ADD
+#define TCP_CLOSER_STATS_ADD(ctx, counter, value) \
+    __atomic_add_fetch(&((ctx)->stats->counter), value, __ATOMIC_RELAXED)
+
+//Larger than any errno value used by the kernel (EHWPOISON is 133)
+#define TCP_CLOSER_MAX_ERRNO 134
+
+struct tcp_closer_stats {
+    uint64_t dumps;
+    uint64_t sockets_matched;
+    uint64_t destroy_sent;
+    uint64_t destroy_failed;
+    uint64_t recv_calls;
+    uint64_t datagrams;
+    uint64_t datagrams_truncated;
+    uint64_t proc_shutdowns;
+    uint64_t proc_kills;
+
+    //Failed destroy requests per errno (0 is used for errno values that are
+    //out of range), and the sockets that were closed through /proc instead
+    uint64_t destroy_errno[TCP_CLOSER_MAX_ERRNO];
+    uint64_t destroy_fallbacks;
+
+    //Receive buffer overruns (ENOBUFS) and dumps restarted by the watchdog
+    uint64_t overruns;
+    uint64_t dump_restarts;
+};
+
 struct tcp_closer_ctx {
     struct backend_event_loop *event_loop;
     struct inet_diag_bc_op *diag_filter;
     struct mnl_socket *diag_dump_socket;
     struct backend_epoll_handle *dump_handle;
     struct backend_timeout_handle *dump_timeout;
+    struct backend_timeout_handle *dump_watchdog;
     struct mnl_socket *diag_destroy_socket;
     struct backend_epoll_handle *destroy_handle;
     FILE *logfile;
 
+    //Receive buffer for dumps, RECV_NUM_SLOTS slots of RECV_SLOT_SIZE bytes
+    uint8_t *recv_buf;
+    struct mmsghdr *recv_msgs;
+    struct iovec *recv_iovs;
+    struct tcp_closer_stats *stats;
+
+    //Dump request, built before the first dump and reused. With shards, only
+    //the shard prefix of the filter is updated before sending. The request is
+    //rebuilt when sharding is switched on/off
+    uint8_t *dump_req;
+    uint32_t dump_req_len;
+    struct inet_diag_bc_op *dump_req_filter;
+
+    //Preformatted destroy requests, DESTROY_SEND_SLOTS batches of
+    //DESTROY_BATCH_SIZE requests of DESTROY_MSG_SIZE bytes. destroy_slot is
+    //the batch being filled, destroy_sends the number of batches queued in
+    //io_uring that have not been sent yet
+    uint8_t *destroy_buf;
+    uint32_t destroy_batch_len;
+    uint8_t destroy_slot;
+    uint8_t destroy_sends;
+    //Receive buffer for destroy acks with io_uring
+    uint8_t *destroy_ack_buf;
+    uint32_t destroy_seq;
+
+    //Inode of the socket of every outstanding destroy request, indexed by
+    //sequence number. Used to close the socket through /proc if the request
+    //fails
+    struct tcp_closer_destroy_pending *destroy_pending;
+
+    //Idle-to-destroy latency of sockets destroyed with SOCK_DESTROY, recorded
+    //when the request is acked. SCHED_LATENCY_MAX_MS + 1 buckets of 1ms
+    uint32_t *latency_hist;
+
+    //Wall clock time of every dump (or shard), same buckets as latency_hist
+    uint32_t *dump_hist;
+
+    //Control socket, only used by the main context
+    struct tcp_closer_control *control;
+    const char *control_path;
+
+    //Flow table (--track_flows/--snapshot), every worker has its own
+    struct tcp_closer_flows *flows;
+    const char *snapshot_path;
+
+    //Per-peer aggregation (--peer_idle_fraction), every worker has its own
+    struct tcp_closer_peers *peers;
+    uint8_t peer_prefix;
+    uint8_t peer_idle_pct;
+
+    //Exclusions (--exclude_file) are shared, the inodes of excluded pids are
+    //collected by every worker before every dump
+    struct tcp_closer_exclude *exclude;
+    const char *exclude_path;
+    uint32_t *exclude_inodes;
+    uint32_t exclude_num_inodes;
+    uint32_t exclude_inodes_size;
+
+    //Structured event output (--events), every worker has its own buffer
+    struct tcp_closer_events *events;
+    const char *events_path;
+
+    //Capture of the received datagrams (--record), and capture to replay
+    //instead of dumping (--replay)
+    struct tcp_closer_record *record;
+    const char *record_path;
+    const char *replay_path;
+
+    //Statistics segment (--shm), shared by all workers, and the part of it
+    //that is written by this worker
+    struct tcp_closer_shm_writer *shm;
+    struct tcp_closer_shm_worker *shm_worker;
+    const char *shm_name;
+
+    //Cycles per pipeline stage (--profile), opened by the thread running the
+    //event loop of the worker
+    struct tcp_closer_profile *profile;
+
+    //Idle time histograms and most idle sockets (--idle_stats), every worker
+    //has its own. The report interval is in ms
+    struct tcp_closer_idle *idle;
+    uint32_t idle_stats_intvl;
+
+    //Read sockets from /proc/net/tcp[6] instead of dumping them (--proc_net)
+    struct tcp_closer_procnet *procnet;
+
+    //Only set in the main context when more than one thread is used. Index 0
+    //is the main context
+    struct tcp_closer_ctx **workers;
+    pthread_t thread;
+    uint16_t num_threads;
+
+    //Inodes of sockets to close through /proc (--use_proc)
+    uint32_t *proc_inodes;
+    uint32_t proc_inodes_len;
+    uint32_t proc_inodes_size;
+
     uint32_t diag_filter_len;
+    //Dump interval in ms (-i is in seconds)
     uint32_t dump_interval;
 
     //Limit for tcpi_last_data_recv before killing socket
@@ -61,12 +207,78 @@ struct tcp_closer_ctx {
     //used to ignore such connections.
     uint32_t last_data_recv_limit;
 
+    //Computed from the limits above by tcp_closer_netlink_select_parser(). A
+    //socket is matched if match_min_idle <= last_data_recv <= match_max_idle
+    uint32_t match_min_idle;
+    uint32_t match_max_idle;
+
+    //Scratch memory of the current dump, released when the dump is done
+    struct tcp_closer_arena *arena;
+
+    //Sockets of the datagram being parsed, the variant of parse_batch for the
+    //current configuration and the implementation of the idle limit check
+    struct tcp_closer_batch *batch;
+    void (*parse_batch)(struct tcp_closer_ctx *ctx);
+    void (*match_range)(const uint32_t *values, uint32_t num, uint32_t min,
+                        uint32_t max, uint64_t *bitmap);
+
+    //State used by the adaptive dump interval (see tcp_closer_sched.c). All
+    //intervals and durations are in ms. dump_start is in the clock used by the
+    //event loop
+    uint64_t dump_start;
+    //Time of the last datagram received for the current dump
+    uint64_t dump_last_recv;
+    //Receive buffer size of the netlink sockets, 0 is the system default.
+    //Grows on overruns
+    uint32_t rcvbuf_size;
+    uint32_t min_interval;
+    uint32_t max_interval;
+    uint32_t cur_interval;
+    uint32_t dump_matched;
+    uint32_t last_dump_duration;
+    uint32_t last_dump_matched;
+    uint8_t interval_reason;
+
+    //CPU placement and per-dump CPU budget. When a dump uses more CPU time
+    //than dump_budget (ms), the port space (shard_port_lo - shard_port_hi) is
+    //split into num_shards ranges and one range is dumped per interval
+    const char *cpu_list;
+    struct inet_diag_bc_op *shard_filter;
+    uint64_t dump_cpu_start;
+    uint32_t dump_budget;
+    uint32_t last_dump_cpu_us;
+    int32_t sched_policy;
+    int32_t nice_value;
+    uint16_t shard_port_lo;
+    uint16_t shard_port_hi;
+    uint16_t num_shards;
+    uint16_t shard_idx;
+
     uint8_t socket_family;
 
     bool verbose_mode;
+    bool quiet_mode;
+    bool dry_run;
     bool use_netlink;
+    bool proc_kill;
     bool dump_in_progress;
     bool use_syslog;
+    bool adaptive_interval;
+    bool set_nice;
+    bool shard_on_sport;
+    bool use_shard_filter;
+    bool paused;
+    bool control_scan;
+    bool track_flows;
+    bool busy_poll;
+    bool use_io_uring;
+    bool replay_paced;
+    bool use_proc_net;
+    bool use_profile;
+    bool dump_req_sharded;
+
+    //Set in the main context by the SIGTERM/SIGINT handler
+    volatile bool stop_signaled;
 };
 
 #endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcp_closer_arena.h"
+
+struct tcp_closer_arena *tcp_closer_arena_create(size_t size)
+{
+    struct tcp_closer_arena *arena = calloc(sizeof(struct tcp_closer_arena),
+                                            1);
+
+    if (!arena) {
+        return NULL;
+    }
+
+    if (!(arena->buf = malloc(size))) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->size = size;
+    return arena;
+}
+
+void *tcp_closer_arena_alloc(struct tcp_closer_arena *arena, size_t size)
+{
+    struct tcp_closer_arena_chunk *chunk;
+
+    size = ARENA_ALIGN(size);
+
+    if (arena->size - arena->used >= size) {
+        arena->last = arena->used;
+        arena->used += size;
+        return arena->buf + arena->last;
+    }
+
+    if (!(chunk = malloc(sizeof(struct tcp_closer_arena_chunk) + size))) {
+        return NULL;
+    }
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->overflow += size;
+
+    return chunk->data;
+}
+
+void *tcp_closer_arena_grow(struct tcp_closer_arena *arena, void *ptr,
+                            size_t old_size, size_t new_size)
+{
+    void *new_ptr;
+
+    if (ptr == arena->buf + arena->last &&
+        arena->size - arena->last >= ARENA_ALIGN(new_size)) {
+        arena->used = arena->last + ARENA_ALIGN(new_size);
+        return ptr;
+    }
+
+    //The old memory is released with the rest of the dump
+    if ((new_ptr = tcp_closer_arena_alloc(arena, new_size)) && ptr) {
+        memcpy(new_ptr, ptr, old_size);
+    }
+
+    return new_ptr;
+}
+
+void tcp_closer_arena_reset(struct tcp_closer_arena *arena)
+{
+    struct tcp_closer_arena_chunk *chunk;
+    size_t new_size;
+    uint8_t *buf;
+
+    while ((chunk = arena->chunks)) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    //Make room for everything the dump needed, including the copies left
+    //behind when growing. If this fails, the old block is kept
+    if (arena->overflow) {
+        new_size = arena->size;
+
+        while (new_size < arena->used + arena->overflow) {
+            new_size *= 2;
+        }
+
+        if ((buf = malloc(new_size))) {
+            free(arena->buf);
+            arena->buf = buf;
+            arena->size = new_size;
+        }
+    }
+
+    arena->used = 0;
+    arena->last = 0;
+    arena->overflow = 0;
+}
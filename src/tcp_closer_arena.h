@@ -0,0 +1,63 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_ARENA_H
+#define TCP_CLOSER_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARENA_INITIAL_SIZE  (64 * 1024)
+#define ARENA_ALIGN(len)    (((len) + 15) & ~((size_t) 15))
+
+//Memory that does not fit in the block is allocated from the heap, one chunk
+//per allocation, and freed on reset
+struct tcp_closer_arena_chunk {
+    struct tcp_closer_arena_chunk *next;
+    uint8_t data[];
+};
+
+//Scratch memory for the current dump. Allocations are bumped from one block
+//and all of them are released at once when the dump is done. If a dump needed
+//more than the block, the block is grown on reset, so after the first large
+//dumps no memory is allocated from the heap
+struct tcp_closer_arena {
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+
+    //Offset of the last allocation, which can be grown in place
+    size_t last;
+
+    //Bytes allocated in chunks since the last reset
+    size_t overflow;
+    struct tcp_closer_arena_chunk *chunks;
+};
+
+struct tcp_closer_arena *tcp_closer_arena_create(size_t size);
+
+//Returns 16 byte aligned memory, or NULL if the heap is exhausted
+void *tcp_closer_arena_alloc(struct tcp_closer_arena *arena, size_t size);
+
+//Grow an allocation from old_size to new_size bytes, keeping the content.
+//The last allocation from the block is grown in place when there is room
+void *tcp_closer_arena_grow(struct tcp_closer_arena *arena, void *ptr,
+                            size_t old_size, size_t new_size);
+
+//Release everything allocated since the last reset
+void tcp_closer_arena_reset(struct tcp_closer_arena *arena);
+
+#endif
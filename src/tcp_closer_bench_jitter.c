@@ -0,0 +1,150 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+//A stand-in for a latency-critical service sharing CPUs with tcp_closer. A
+//busy loop pinned to one CPU runs units of work that take about
+//BENCH_UNIT_US when it has the CPU to itself, and logs the percentiles of the
+//time each unit took. Run it once alone and once next to tcp_closer (for
+//example with --cpu_list, --sched_policy or --dump_budget), the difference is
+//the impact of the dumps.
+//
+//Usage: tcp-closer-bench-jitter [seconds] [cpu]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+
+#define BENCH_UNIT_US 50
+
+//Unit times are counted in 1us buckets, longer units in the last bucket
+#define BENCH_MAX_US 100000
+
+static uint64_t bench_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//The result of the work is stored here, so that it can not be optimized away
+static volatile uint32_t bench_sink;
+
+//xorshift32
+static uint32_t bench_work(uint32_t state, uint32_t iterations)
+{
+    uint32_t i;
+
+    for (i = 0; i < iterations; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+    }
+
+    return state;
+}
+
+//Number of iterations that take BENCH_UNIT_US. The fastest of a few runs is
+//used, so that being interrupted while calibrating does not matter
+static uint32_t bench_calibrate(uint32_t *state)
+{
+    uint64_t elapsed, best = UINT64_MAX;
+    uint32_t i;
+
+    for (i = 0; i < 20; i++) {
+        elapsed = bench_time_ns();
+        *state = bench_work(*state, 1000000);
+        elapsed = bench_time_ns() - elapsed;
+
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return (BENCH_UNIT_US * 1000ULL * 1000000) / (best ? best : 1);
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint16_t percentiles[] = {500, 900, 990, 999};
+    uint32_t *hist = calloc(BENCH_MAX_US + 1, sizeof(uint32_t));
+    uint32_t seconds = 10, state = 1, iterations, i, max = 0;
+    uint64_t start, end, unit_start, num_units = 0, count = 0;
+    uint8_t pct_idx = 0;
+    cpu_set_t cpus;
+    int cpu = 0;
+
+    if (!hist) {
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 1) {
+        seconds = strtoul(argv[1], NULL, 10);
+    }
+
+    if (argc > 2) {
+        cpu = atoi(argv[2]);
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        perror("sched_setaffinity");
+        return EXIT_FAILURE;
+    }
+
+    iterations = bench_calibrate(&state);
+    start = bench_time_ns();
+    end = start + seconds * 1000000000ULL;
+    unit_start = start;
+
+    while (unit_start < end) {
+        state = bench_work(state, iterations);
+        start = bench_time_ns();
+        i = (start - unit_start) / 1000;
+        hist[i < BENCH_MAX_US ? i : BENCH_MAX_US]++;
+        unit_start = start;
+        num_units++;
+    }
+
+    bench_sink = state;
+    fprintf(stdout, "%lu units of %uus on CPU %d:", num_units, BENCH_UNIT_US,
+            cpu);
+
+    //Percentiles are in 1/1000
+    for (i = 0; i <= BENCH_MAX_US; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+
+        count += hist[i];
+        max = i;
+
+        while (pct_idx < sizeof(percentiles) / sizeof(percentiles[0]) &&
+               count * 1000 >= num_units * percentiles[pct_idx]) {
+            fprintf(stdout, " p%g %uus", percentiles[pct_idx] / 10.0, i);
+            pct_idx++;
+        }
+    }
+
+    fprintf(stdout, " max %uus%s\n", max,
+            max == BENCH_MAX_US ? " (or more)" : "");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_control.h"
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "tcp_closer_lib.h"
+#include "tcp_closer_exclude.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_worker.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+static void control_vreply(struct tcp_closer_ctx *ctx,
+                           const struct sockaddr_un *client,
+                           socklen_t client_len, const char *fmt, va_list args)
+{
+    struct tcp_closer_control *control = ctx->control;
+    char reply[CONTROL_MSG_SIZE];
+    int len;
+
+    //Client did not bind its socket, so there is no one to reply to
+    if (client_len <= sizeof(sa_family_t)) {
+        return;
+    }
+
+    len = vsnprintf(reply, sizeof(reply), fmt, args);
+
+    if (len >= (int) sizeof(reply)) {
+        len = sizeof(reply) - 1;
+    }
+
+    if (sendto(control->fd, reply, len, 0, (const struct sockaddr*) client,
+               client_len) < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to send control reply. "
+                                "Error: %s (%u)\n", strerror(errno), errno);
+    }
+}
+
+static void control_reply(struct tcp_closer_ctx *ctx, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+//Reply to the client of the request that is being handled
+static void control_reply(struct tcp_closer_ctx *ctx, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    control_vreply(ctx, &(ctx->control->client), ctx->control->client_len,
+                   fmt, args);
+    va_end(args);
+}
+
+static void control_reply_scan(struct tcp_closer_ctx *ctx, const char *fmt,
+                               ...) __attribute__((format(printf, 2, 3)));
+
+//Reply to the client that requested the current scan. Other requests can be
+//handled while the scan is pending or running, so control->client might
+//belong to someone else by now
+static void control_reply_scan(struct tcp_closer_ctx *ctx, const char *fmt,
+                               ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    control_vreply(ctx, &(ctx->control->scan_client),
+                   ctx->control->scan_client_len, fmt, args);
+    va_end(args);
+}
+
+static void control_set_paused(struct tcp_closer_ctx *ctx, bool paused)
+{
+    uint16_t i;
+
+    if (!ctx->workers) {
+        __atomic_store_n(&(ctx->paused), paused, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (i = 0; i < ctx->num_threads; i++) {
+        __atomic_store_n(&(ctx->workers[i]->paused), paused, __ATOMIC_RELAXED);
+    }
+}
+
+static void control_reply_stats(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_stats *stats = ctx->stats;
+
+    control_reply(ctx, "OK dumps=%lu matched=%lu destroy_sent=%lu "
+                  "destroy_failed=%lu destroy_fallbacks=%lu proc_shutdowns=%lu "
+                  "proc_kills=%lu overruns=%lu dump_restarts=%lu last_dump_ms=%u interval_ms=%u reason=\"%s\" paused=%u\n",
+                  __atomic_load_n(&(stats->dumps), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->sockets_matched), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->destroy_sent), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->destroy_failed), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->destroy_fallbacks), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->proc_shutdowns), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->proc_kills), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->overruns), __ATOMIC_RELAXED),
+                  __atomic_load_n(&(stats->dump_restarts), __ATOMIC_RELAXED),
+                  ctx->last_dump_duration,
+                  ctx->adaptive_interval ? ctx->cur_interval :
+                                           ctx->dump_interval,
+                  tcp_closer_sched_reason_str(ctx->interval_reason),
+                  ctx->paused);
+}
+
+//Append a host condition to the scan filter. The filter is a list of
+//conditions that all have to match, so if a condition is not met we jump past
+//the end of the filter. The no offsets are fixed up when the filter is
+//complete
+static bool control_add_cond(struct tcp_closer_control *control, uint8_t code,
+                             const char *addr_str, int32_t port)
+{
+    struct inet_diag_bc_op *op;
+    struct inet_diag_hostcond *cond;
+    char addr_buf[INET6_ADDRSTRLEN];
+    char *prefix_str;
+    uint8_t addr_len = 0, max_prefix = 0;
+    int prefix_len = -1;
+
+    op = (struct inet_diag_bc_op*) (control->filter + control->filter_len);
+    cond = (struct inet_diag_hostcond*) (op + 1);
+    memset(op, 0, sizeof(*op) + sizeof(*cond) + 16);
+    cond->family = AF_UNSPEC;
+    cond->port = port;
+
+    if (addr_str) {
+        if (strlen(addr_str) >= sizeof(addr_buf)) {
+            return false;
+        }
+
+        strcpy(addr_buf, addr_str);
+        prefix_str = strchr(addr_buf, '/');
+
+        if (prefix_str) {
+            *prefix_str++ = '\0';
+            prefix_len = atoi(prefix_str);
+        }
+
+        if (inet_pton(AF_INET, addr_buf, cond->addr) == 1) {
+            cond->family = AF_INET;
+            addr_len = 4;
+        } else if (inet_pton(AF_INET6, addr_buf, cond->addr) == 1) {
+            cond->family = AF_INET6;
+            addr_len = 16;
+        } else {
+            return false;
+        }
+
+        max_prefix = addr_len * 8;
+
+        if (prefix_len > max_prefix) {
+            return false;
+        }
+
+        cond->prefix_len = prefix_len < 0 ? max_prefix : prefix_len;
+
+        if (control->family && control->family != cond->family) {
+            return false;
+        }
+
+        control->family = cond->family;
+    }
+
+    op->code = code;
+    op->yes = sizeof(*op) + sizeof(*cond) + addr_len;
+    control->filter_len += op->yes;
+
+    return true;
+}
+
+static void control_finish_filter(struct tcp_closer_control *control)
+{
+    struct inet_diag_bc_op *op;
+    uint32_t offset = 0;
+
+    while (offset < control->filter_len) {
+        op = (struct inet_diag_bc_op*) (control->filter + offset);
+        op->no = control->filter_len - offset + 4;
+        offset += op->yes;
+    }
+}
+
+static bool control_start_scan(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_control *control = ctx->control;
+
+    if (ctx->exclude) {
+        tcp_closer_exclude_dump_start(ctx);
+    }
+
+    if (send_diag_msg_filter(ctx, control->family ? control->family :
+                                                    ctx->socket_family,
+                             control->filter, control->filter_len) < 0) {
+        control_reply_scan(ctx, "ERR failed to send dump request: %s\n",
+                           strerror(errno));
+        return false;
+    }
+
+    ctx->control_scan = true;
+    ctx->dump_in_progress = true;
+    ctx->dump_matched = 0;
+    tcp_closer_netlink_select_parser(ctx);
+    tcp_closer_worker_watch_dump(ctx);
+
+    return true;
+}
+
+static void control_handle_scan(struct tcp_closer_ctx *ctx, char *args)
+{
+    struct tcp_closer_control *control = ctx->control;
+    const char *src = NULL, *dst = NULL;
+    int32_t sport = -1, dport = -1;
+    char *key, *value, *saveptr = NULL;
+
+    if (control->scan_pending || ctx->control_scan) {
+        control_reply(ctx, "ERR scan already in progress\n");
+        return;
+    }
+
+    while ((key = strtok_r(args, " \t\n", &saveptr))) {
+        args = NULL;
+        value = strtok_r(NULL, " \t\n", &saveptr);
+
+        if (!value) {
+            control_reply(ctx, "ERR missing value for %s\n", key);
+            return;
+        }
+
+        if (!strcmp(key, "src")) {
+            src = value;
+        } else if (!strcmp(key, "dst")) {
+            dst = value;
+        } else if (!strcmp(key, "sport") && atoi(value) > 0 &&
+                   atoi(value) <= 0xFFFF) {
+            sport = atoi(value);
+        } else if (!strcmp(key, "dport") && atoi(value) > 0 &&
+                   atoi(value) <= 0xFFFF) {
+            dport = atoi(value);
+        } else {
+            control_reply(ctx, "ERR invalid argument %s %s\n", key, value);
+            return;
+        }
+    }
+
+    //Killing every socket on the host is not something we want to do by
+    //accident
+    if (!src && !dst && sport < 0 && dport < 0) {
+        control_reply(ctx, "ERR scan requires a filter\n");
+        return;
+    }
+
+    control->filter_len = 0;
+    control->family = 0;
+
+    if (((src || sport >= 0) &&
+         !control_add_cond(control, INET_DIAG_BC_S_COND, src, sport)) ||
+        ((dst || dport >= 0) &&
+         !control_add_cond(control, INET_DIAG_BC_D_COND, dst, dport))) {
+        control_reply(ctx, "ERR invalid address\n");
+        return;
+    }
+
+    control_finish_filter(control);
+
+    if (!tcp_closer_lib_filter_audit(control->filter, control->filter_len)) {
+        control_reply(ctx, "ERR invalid filter\n");
+        return;
+    }
+
+    memcpy(&(control->scan_client), &(control->client), control->client_len);
+    control->scan_client_len = control->client_len;
+
+    //The netlink socket can only handle one dump at a time. The scan is
+    //started as soon as the current dump is done
+    if (ctx->dump_in_progress) {
+        control->scan_pending = true;
+        return;
+    }
+
+    control_start_scan(ctx);
+}
+
+static void control_recv(void *ptr, int32_t fd, uint32_t events)
+{
+    struct tcp_closer_ctx *ctx = ptr;
+    struct tcp_closer_control *control = ctx->control;
+    char request[CONTROL_MSG_SIZE];
+    ssize_t numbytes;
+
+    control->client_len = sizeof(control->client);
+    numbytes = recvfrom(fd, request, sizeof(request) - 1, 0,
+                        (struct sockaddr*) &(control->client),
+                        &(control->client_len));
+
+    if (numbytes <= 0) {
+        return;
+    }
+
+    request[numbytes] = '\0';
+
+    if (ctx->verbose_mode) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Control request: %s\n",
+                                request);
+    }
+
+    if (!strncmp(request, "stats", strlen("stats"))) {
+        control_reply_stats(ctx);
+    } else if (!strncmp(request, "pause", strlen("pause"))) {
+        control_set_paused(ctx, true);
+        control_reply(ctx, "OK\n");
+    } else if (!strncmp(request, "resume", strlen("resume"))) {
+        control_set_paused(ctx, false);
+        control_reply(ctx, "OK\n");
+    } else if (!strncmp(request, "scan", strlen("scan"))) {
+        control_handle_scan(ctx, request + strlen("scan"));
+    } else {
+        control_reply(ctx, "ERR unknown command\n");
+    }
+}
+
+void tcp_closer_control_dump_done(struct tcp_closer_ctx *ctx)
+{
+    if (!ctx->control || !ctx->control->scan_pending) {
+        return;
+    }
+
+    ctx->control->scan_pending = false;
+    control_start_scan(ctx);
+}
+
+void tcp_closer_control_scan_done(struct tcp_closer_ctx *ctx, int32_t error)
+{
+    ctx->control_scan = false;
+    ctx->dump_in_progress = false;
+    tcp_closer_netlink_select_parser(ctx);
+
+    if (error) {
+        control_reply_scan(ctx, "ERR scan failed: %s\n", strerror(error));
+        return;
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Control scan matched %u "
+                            "socket(s)\n", ctx->dump_matched);
+    control_reply_scan(ctx, "OK matched=%u\n", ctx->dump_matched);
+}
+
+bool tcp_closer_control_init(struct tcp_closer_ctx *ctx, const char *path)
+{
+    struct tcp_closer_control *control;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Control socket path too long\n");
+        return false;
+    }
+
+    control = calloc(sizeof(struct tcp_closer_control), 1);
+
+    if (!control) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "control socket\n");
+        return false;
+    }
+
+    ctx->control = control;
+    control->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+
+    if (control->fd < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create control "
+                                "socket. Error: %s (%u)\n", strerror(errno),
+                                errno);
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    //Remove socket left behind by a previous instance
+    unlink(path);
+
+    if (bind(control->fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+        chmod(path, S_IRUSR | S_IWUSR)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to bind control socket "
+                                "to %s. Error: %s (%u)\n", path,
+                                strerror(errno), errno);
+        return false;
+    }
+
+    if (!(control->handle = backend_create_epoll_handle(ctx, control->fd,
+                                                        control_recv))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create control "
+                                "epoll handle\n");
+        return false;
+    }
+
+    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                              control->fd, control->handle);
+
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_CONTROL_H
+#define TCP_CLOSER_CONTROL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Max size of a request or a reply
+#define CONTROL_MSG_SIZE        512
+
+//A scan filter contains at most one source and one destination condition. Each
+//condition is an op, a hostcond and an IPv6 address
+#define CONTROL_MAX_FILTER_LEN  (2 * (4 + 8 + 16))
+
+//The control socket is a Unix datagram socket. A request is one datagram
+//containing one of the following commands, the reply is sent back to the
+//address of the client (so the client must bind its socket):
+//
+//stats                                     Current statistics
+//pause                                     Pause periodic dumps
+//resume                                    Resume periodic dumps
+//scan [src A[/P]] [dst A[/P]] [sport N] [dport N]
+//                                          Dump and destroy all sockets
+//                                          matching the filter right away
+//
+//Replies start with OK or ERR
+struct tcp_closer_control {
+    struct backend_epoll_handle *handle;
+    struct sockaddr_un client;
+    //Client of the pending or running scan, replied to when it is done
+    struct sockaddr_un scan_client;
+    socklen_t client_len;
+    socklen_t scan_client_len;
+    uint32_t filter_len;
+    int32_t fd;
+    uint8_t filter[CONTROL_MAX_FILTER_LEN];
+    uint8_t family;
+    bool scan_pending;
+};
+
+struct tcp_closer_ctx;
+
+//Create the control socket and add it to the event loop of ctx
+bool tcp_closer_control_init(struct tcp_closer_ctx *ctx, const char *path);
+
+//Start a scan that was requested while a dump was in progress (if any)
+void tcp_closer_control_dump_done(struct tcp_closer_ctx *ctx);
+
+//Called when a scan requested through the control socket is done, error is 0
+//on success
+void tcp_closer_control_scan_done(struct tcp_closer_ctx *ctx, int32_t error);
+
+#endif
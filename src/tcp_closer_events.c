@@ -0,0 +1,245 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_events.h"
+#include "tcp_closer.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+//Records are NDJSON, formatted by hand. All keys and string values are known
+//not to need escaping
+static inline uint8_t *events_put_str(uint8_t *pos, const char *str)
+{
+    size_t len = strlen(str);
+
+    memcpy(pos, str, len);
+    return pos + len;
+}
+
+static uint8_t *events_put_u64(uint8_t *pos, uint64_t value)
+{
+    uint8_t digits[20];
+    uint8_t num_digits = 0;
+
+    do {
+        digits[num_digits++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    while (num_digits) {
+        *pos++ = digits[--num_digits];
+    }
+
+    return pos;
+}
+
+static uint8_t *events_put_addr(uint8_t *pos, uint8_t family,
+                                const uint32_t *addr)
+{
+    *pos++ = '"';
+    inet_ntop(family, addr, (char*) pos, INET6_ADDRSTRLEN);
+    pos += strlen((char*) pos);
+    *pos++ = '"';
+
+    return pos;
+}
+
+//Returns where the next record should be written, flushing first if needed
+static uint8_t *events_reserve(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_events *events = ctx->events;
+
+    if (EVENTS_BUF_SIZE - events->buf_len < EVENTS_MAX_RECORD_LEN) {
+        tcp_closer_events_flush(ctx);
+    }
+
+    return events->buf + events->buf_len;
+}
+
+static inline void events_commit(struct tcp_closer_ctx *ctx, uint8_t *pos)
+{
+    *pos++ = '\n';
+    ctx->events->buf_len = pos - ctx->events->buf;
+}
+
+void tcp_closer_events_destroy(struct tcp_closer_ctx *ctx,
+                               struct inet_diag_msg *diag_msg,
+                               uint32_t last_data_recv)
+{
+    uint8_t *pos = events_reserve(ctx);
+
+    pos = events_put_str(pos, "{\"event\":\"destroy\",\"time\":");
+    pos = events_put_u64(pos, backend_get_time_ms());
+    pos = events_put_str(pos, ",\"src\":");
+    pos = events_put_addr(pos, diag_msg->idiag_family, diag_msg->id.idiag_src);
+    pos = events_put_str(pos, ",\"sport\":");
+    pos = events_put_u64(pos, ntohs(diag_msg->id.idiag_sport));
+    pos = events_put_str(pos, ",\"dst\":");
+    pos = events_put_addr(pos, diag_msg->idiag_family, diag_msg->id.idiag_dst);
+    pos = events_put_str(pos, ",\"dport\":");
+    pos = events_put_u64(pos, ntohs(diag_msg->id.idiag_dport));
+    pos = events_put_str(pos, ",\"inode\":");
+    pos = events_put_u64(pos, diag_msg->idiag_inode);
+    pos = events_put_str(pos, ",\"uid\":");
+    pos = events_put_u64(pos, diag_msg->idiag_uid);
+    pos = events_put_str(pos, ",\"last_data_recv\":");
+    pos = events_put_u64(pos, last_data_recv);
+    pos = events_put_str(pos, ctx->dry_run ? ",\"dry_run\":true}" :
+                                             ",\"dry_run\":false}");
+
+    events_commit(ctx, pos);
+}
+
+void tcp_closer_events_dump(struct tcp_closer_ctx *ctx)
+{
+    uint8_t *pos = events_reserve(ctx);
+
+    pos = events_put_str(pos, "{\"event\":\"dump\",\"time\":");
+    pos = events_put_u64(pos, backend_get_time_ms());
+    pos = events_put_str(pos, ",\"duration_ms\":");
+    pos = events_put_u64(pos, ctx->last_dump_duration);
+    pos = events_put_str(pos, ",\"cpu_us\":");
+    pos = events_put_u64(pos, ctx->last_dump_cpu_us);
+    pos = events_put_str(pos, ",\"matched\":");
+    pos = events_put_u64(pos, ctx->dump_matched);
+    pos = events_put_str(pos, ",\"shard_lo\":");
+    pos = events_put_u64(pos, ctx->shard_port_lo);
+    pos = events_put_str(pos, ",\"shard_hi\":");
+    pos = events_put_u64(pos, ctx->shard_port_hi);
+    pos = events_put_str(pos, "}");
+
+    events_commit(ctx, pos);
+    tcp_closer_events_flush(ctx);
+}
+
+void tcp_closer_events_flush(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_events *events = ctx->events;
+
+    if (!events->buf_len) {
+        return;
+    }
+
+    //A full FIFO or socket buffer must not block the dumps, so records are
+    //dropped instead
+    if (write(events->fd, events->buf, events->buf_len) < 0 &&
+        ctx->verbose_mode) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Failed to write events. "
+                                "Error: %s (%u)\n", strerror(errno), errno);
+    }
+
+    events->buf_len = 0;
+}
+
+static int events_open_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static struct tcp_closer_events *events_create(int fd)
+{
+    struct tcp_closer_events *events = calloc(sizeof(struct tcp_closer_events),
+                                              1);
+
+    if (!events) {
+        return NULL;
+    }
+
+    if (!(events->buf = malloc(EVENTS_BUF_SIZE))) {
+        free(events);
+        return NULL;
+    }
+
+    events->fd = fd;
+    return events;
+}
+
+bool tcp_closer_events_init(struct tcp_closer_ctx *ctx, const char *path)
+{
+    size_t prefix_len = strlen(EVENTS_UNIX_PREFIX);
+    int fd;
+
+    if (!strncmp(path, EVENTS_UNIX_PREFIX, prefix_len)) {
+        fd = events_open_unix(path + prefix_len);
+    } else {
+        //O_RDWR, so that opening a FIFO does not block until there is a reader
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC,
+                  0644);
+    }
+
+    if (fd < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open event output "
+                                "%s. Error: %s (%u)\n", path, strerror(errno),
+                                errno);
+        return false;
+    }
+
+    if (!(ctx->events = events_create(fd))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "events\n");
+        close(fd);
+        return false;
+    }
+
+    return true;
+}
+
+bool tcp_closer_events_clone(struct tcp_closer_ctx *worker,
+                             struct tcp_closer_ctx *ctx)
+{
+    if (!(worker->events = events_create(ctx->events->fd))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "events\n");
+        return false;
+    }
+
+    return true;
+}
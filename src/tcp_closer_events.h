@@ -0,0 +1,59 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_EVENTS_H
+#define TCP_CLOSER_EVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Records are appended to the buffer and written when there is less than
+//EVENTS_MAX_RECORD_LEN bytes left, or when a dump is done
+#define EVENTS_BUF_SIZE         65536
+#define EVENTS_MAX_RECORD_LEN   512
+#define EVENTS_UNIX_PREFIX      "unix:"
+
+//Every worker has its own buffer, the file descriptor is shared. Each buffer
+//is written with a single write(), so records from different workers are
+//never interleaved
+struct tcp_closer_events {
+    uint8_t *buf;
+    uint32_t buf_len;
+    int fd;
+};
+
+struct tcp_closer_ctx;
+struct inet_diag_msg;
+
+//Open the event output. path is a file or FIFO, or a Unix datagram socket if
+//prefixed with unix:
+bool tcp_closer_events_init(struct tcp_closer_ctx *ctx, const char *path);
+
+//Create the buffer of a worker, sharing the output of ctx
+bool tcp_closer_events_clone(struct tcp_closer_ctx *worker,
+                             struct tcp_closer_ctx *ctx);
+
+//One record per destroy decision
+void tcp_closer_events_destroy(struct tcp_closer_ctx *ctx,
+                               struct inet_diag_msg *diag_msg,
+                               uint32_t last_data_recv);
+
+//Summary of the last dump. Flushes the buffer
+void tcp_closer_events_dump(struct tcp_closer_ctx *ctx);
+
+void tcp_closer_events_flush(struct tcp_closer_ctx *ctx);
+
+#endif
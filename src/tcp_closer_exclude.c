@@ -0,0 +1,550 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_exclude.h"
+#include "tcp_closer.h"
+#include "tcp_closer_lib.h"
+#include "tcp_closer_log.h"
+
+static inline uint8_t exclude_get_bit(const uint32_t *key, uint8_t bit)
+{
+    return (key[bit >> 5] >> (31 - (bit & 0x1f))) & 1;
+}
+
+//Number of leading bits (at most max_len) that a and b have in common
+static uint8_t exclude_common_len(const uint32_t *a, const uint32_t *b,
+                                  uint8_t max_len)
+{
+    uint8_t len = 0, i;
+    uint32_t diff;
+
+    for (i = 0; len < max_len; i++) {
+        diff = a[i] ^ b[i];
+
+        if (diff) {
+            len += __builtin_clz(diff);
+            break;
+        }
+
+        len += 32;
+    }
+
+    return len < max_len ? len : max_len;
+}
+
+static int32_t exclude_new_node(struct tcp_closer_exclude_trie *trie,
+                                const uint32_t *key, uint8_t len,
+                                bool terminal)
+{
+    struct tcp_closer_exclude_node *nodes, *node;
+    uint8_t i;
+
+    if (trie->num_nodes == trie->size) {
+        nodes = realloc(trie->nodes, trie->size * 2 *
+                        sizeof(struct tcp_closer_exclude_node));
+
+        if (!nodes) {
+            return -1;
+        }
+
+        trie->nodes = nodes;
+        trie->size *= 2;
+    }
+
+    node = &(trie->nodes[trie->num_nodes]);
+    memset(node, 0, sizeof(struct tcp_closer_exclude_node));
+    node->len = len;
+    node->terminal = terminal;
+    node->child[0] = node->child[1] = -1;
+
+    //Only keep the bits covered by the node, so that keys can be compared
+    for (i = 0; i < 4; i++) {
+        if (len >= (i + 1) * 32) {
+            node->key[i] = key[i];
+        } else if (len > i * 32) {
+            node->key[i] = key[i] & (0xFFFFFFFFU << (32 - (len - i * 32)));
+        }
+    }
+
+    return trie->num_nodes++;
+}
+
+static bool exclude_trie_init(struct tcp_closer_exclude_trie *trie)
+{
+    const uint32_t root_key[4] = {0};
+
+    trie->nodes = calloc(EXCLUDE_INITIAL_NODES,
+                         sizeof(struct tcp_closer_exclude_node));
+
+    if (!trie->nodes) {
+        return false;
+    }
+
+    trie->size = EXCLUDE_INITIAL_NODES;
+
+    //The root covers zero bits
+    return exclude_new_node(trie, root_key, 0, false) == 0;
+}
+
+static bool exclude_trie_insert(struct tcp_closer_exclude_trie *trie,
+                                const uint32_t *key, uint8_t len)
+{
+    int32_t idx = 0, child_idx, mid_idx, leaf_idx;
+    uint8_t bit, common;
+
+    while (true) {
+        if (len == trie->nodes[idx].len) {
+            trie->nodes[idx].terminal = true;
+            return true;
+        }
+
+        bit = exclude_get_bit(key, trie->nodes[idx].len);
+        child_idx = trie->nodes[idx].child[bit];
+
+        if (child_idx < 0) {
+            if ((leaf_idx = exclude_new_node(trie, key, len, true)) < 0) {
+                return false;
+            }
+
+            trie->nodes[idx].child[bit] = leaf_idx;
+            return true;
+        }
+
+        common = exclude_common_len(key, trie->nodes[child_idx].key,
+                                    len < trie->nodes[child_idx].len ?
+                                    len : trie->nodes[child_idx].len);
+
+        if (common == trie->nodes[child_idx].len) {
+            idx = child_idx;
+            continue;
+        }
+
+        //Split the edge to the child at the first differing bit (or at the end
+        //of the new prefix)
+        if ((mid_idx = exclude_new_node(trie, key, common, common == len)) < 0) {
+            return false;
+        }
+
+        trie->nodes[mid_idx].child[exclude_get_bit(trie->nodes[child_idx].key,
+                                                   common)] = child_idx;
+
+        if (common < len) {
+            if ((leaf_idx = exclude_new_node(trie, key, len, true)) < 0) {
+                return false;
+            }
+
+            trie->nodes[mid_idx].child[exclude_get_bit(key, common)] = leaf_idx;
+        }
+
+        trie->nodes[idx].child[bit] = mid_idx;
+        return true;
+    }
+}
+
+//Returns true if any prefix in the trie covers key. The cost is bounded by the
+//number of address bits, not by the number of prefixes
+static bool exclude_trie_lookup(const struct tcp_closer_exclude_trie *trie,
+                                const uint32_t *key, uint8_t bits)
+{
+    const struct tcp_closer_exclude_node *node;
+    int32_t idx = 0;
+
+    while (idx >= 0) {
+        node = &(trie->nodes[idx]);
+
+        if (exclude_common_len(key, node->key, node->len) != node->len) {
+            return false;
+        }
+
+        if (node->terminal) {
+            return true;
+        }
+
+        if (node->len == bits) {
+            return false;
+        }
+
+        idx = node->child[exclude_get_bit(key, node->len)];
+    }
+
+    return false;
+}
+
+static int exclude_cmp_inode(const void *a, const void *b)
+{
+    uint32_t inode_a = *((const uint32_t*) a), inode_b = *((const uint32_t*) b);
+
+    return inode_a < inode_b ? -1 : inode_a > inode_b;
+}
+
+bool tcp_closer_exclude_match(struct tcp_closer_ctx *ctx,
+                              struct inet_diag_msg *diag_msg)
+{
+    struct tcp_closer_exclude *exclude = ctx->exclude;
+    const uint32_t *addr = diag_msg->id.idiag_dst;
+    uint32_t key[4] = {0};
+    uint8_t i;
+
+    if (exclude->uid_bitmap && diag_msg->idiag_uid <= EXCLUDE_MAX_UID &&
+        (exclude->uid_bitmap[diag_msg->idiag_uid >> 6] &
+         (1ULL << (diag_msg->idiag_uid & 0x3f)))) {
+        return true;
+    }
+
+    if (ctx->exclude_num_inodes &&
+        bsearch(&(diag_msg->idiag_inode), ctx->exclude_inodes,
+                ctx->exclude_num_inodes, sizeof(uint32_t), exclude_cmp_inode)) {
+        return true;
+    }
+
+    if (diag_msg->idiag_family == AF_INET) {
+        key[0] = ntohl(addr[0]);
+        return exclude_trie_lookup(&(exclude->trie4), key, 32);
+    }
+
+    //IPv4 networks also cover IPv4-mapped IPv6 addresses
+    if (!addr[0] && !addr[1] && addr[2] == htonl(0xFFFF)) {
+        key[0] = ntohl(addr[3]);
+
+        if (exclude_trie_lookup(&(exclude->trie4), key, 32)) {
+            return true;
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        key[i] = ntohl(addr[i]);
+    }
+
+    return exclude_trie_lookup(&(exclude->trie6), key, 128);
+}
+
+static bool exclude_add_inode(struct tcp_closer_ctx *ctx, uint32_t inode)
+{
+    uint32_t *inodes;
+    uint32_t size;
+
+    if (ctx->exclude_num_inodes == ctx->exclude_inodes_size) {
+        size = ctx->exclude_inodes_size ? ctx->exclude_inodes_size * 2 :
+                                          EXCLUDE_INITIAL_INODES;
+        inodes = realloc(ctx->exclude_inodes, size * sizeof(uint32_t));
+
+        if (!inodes) {
+            return false;
+        }
+
+        ctx->exclude_inodes = inodes;
+        ctx->exclude_inodes_size = size;
+    }
+
+    ctx->exclude_inodes[ctx->exclude_num_inodes++] = inode;
+    return true;
+}
+
+void tcp_closer_exclude_dump_start(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_exclude *exclude = ctx->exclude;
+    char fd_dir[64], fd_path[320], link[64];
+    struct dirent *entry;
+    unsigned int inode;
+    ssize_t link_len;
+    DIR *dir;
+    uint16_t i;
+
+    ctx->exclude_num_inodes = 0;
+
+    for (i = 0; i < exclude->num_pids; i++) {
+        snprintf(fd_dir, sizeof(fd_dir), "/proc/%d/fd", exclude->pids[i]);
+
+        //The process might not be running (yet)
+        if (!(dir = opendir(fd_dir))) {
+            continue;
+        }
+
+        while ((entry = readdir(dir))) {
+            snprintf(fd_path, sizeof(fd_path), "%s/%s", fd_dir, entry->d_name);
+            link_len = readlink(fd_path, link, sizeof(link) - 1);
+
+            if (link_len <= 0) {
+                continue;
+            }
+
+            link[link_len] = '\0';
+
+            if (sscanf(link, "socket:[%u]", &inode) == 1 &&
+                !exclude_add_inode(ctx, inode)) {
+                break;
+            }
+        }
+
+        closedir(dir);
+    }
+
+    qsort(ctx->exclude_inodes, ctx->exclude_num_inodes, sizeof(uint32_t),
+          exclude_cmp_inode);
+}
+
+static bool exclude_add_net(struct tcp_closer_ctx *ctx, char *value)
+{
+    struct tcp_closer_exclude *exclude = ctx->exclude;
+    struct tcp_closer_exclude_net *net, *nets;
+    uint32_t key[4];
+    char *prefix_str;
+    int prefix_len = -1;
+    uint8_t max_prefix, i;
+
+    if (exclude->num_nets == exclude->nets_size) {
+        nets = realloc(exclude->nets, (exclude->nets_size * 2 + 1) *
+                       sizeof(struct tcp_closer_exclude_net));
+
+        if (!nets) {
+            return false;
+        }
+
+        exclude->nets = nets;
+        exclude->nets_size = exclude->nets_size * 2 + 1;
+    }
+
+    net = &(exclude->nets[exclude->num_nets]);
+    memset(net, 0, sizeof(struct tcp_closer_exclude_net));
+
+    if ((prefix_str = strchr(value, '/'))) {
+        *prefix_str++ = '\0';
+        prefix_len = atoi(prefix_str);
+    }
+
+    if (inet_pton(AF_INET, value, net->addr) == 1) {
+        net->family = AF_INET;
+        max_prefix = 32;
+    } else if (inet_pton(AF_INET6, value, net->addr) == 1) {
+        net->family = AF_INET6;
+        max_prefix = 128;
+    } else {
+        return false;
+    }
+
+    if (prefix_len > max_prefix) {
+        return false;
+    }
+
+    net->prefix_len = prefix_len < 0 ? max_prefix : prefix_len;
+
+    for (i = 0; i < 4; i++) {
+        key[i] = ntohl(net->addr[i]);
+    }
+
+    if (!exclude_trie_insert(net->family == AF_INET ? &(exclude->trie4) :
+                                                      &(exclude->trie6),
+                             key, net->prefix_len)) {
+        return false;
+    }
+
+    exclude->num_nets++;
+    return true;
+}
+
+static bool exclude_add_uid(struct tcp_closer_ctx *ctx, const char *value)
+{
+    struct tcp_closer_exclude *exclude = ctx->exclude;
+    char *end;
+    unsigned long uid = strtoul(value, &end, 10);
+
+    if (*end || uid > EXCLUDE_MAX_UID) {
+        return false;
+    }
+
+    //The bitmap is allocated on first use, large enough for all UIDs
+    if (!exclude->uid_bitmap &&
+        !(exclude->uid_bitmap = calloc((EXCLUDE_MAX_UID >> 6) + 1,
+                                       sizeof(uint64_t)))) {
+        return false;
+    }
+
+    exclude->uid_bitmap[uid >> 6] |= 1ULL << (uid & 0x3f);
+    return true;
+}
+
+static bool exclude_add_pid(struct tcp_closer_ctx *ctx, const char *value)
+{
+    struct tcp_closer_exclude *exclude = ctx->exclude;
+    pid_t *pids;
+
+    if (atoi(value) <= 0) {
+        return false;
+    }
+
+    pids = realloc(exclude->pids, (exclude->num_pids + 1) * sizeof(pid_t));
+
+    if (!pids) {
+        return false;
+    }
+
+    exclude->pids = pids;
+    exclude->pids[exclude->num_pids++] = atoi(value);
+    return true;
+}
+
+static bool exclude_parse_line(struct tcp_closer_ctx *ctx, char *line)
+{
+    char *key, *value, *saveptr = NULL;
+
+    if (!(key = strtok_r(line, " \t\r\n", &saveptr)) || key[0] == '#') {
+        return true;
+    }
+
+    if (!(value = strtok_r(NULL, " \t\r\n", &saveptr))) {
+        return false;
+    }
+
+    if (!strcmp(key, "net")) {
+        return exclude_add_net(ctx, value);
+    } else if (!strcmp(key, "uid")) {
+        return exclude_add_uid(ctx, value);
+    } else if (!strcmp(key, "pid")) {
+        return exclude_add_pid(ctx, value);
+    }
+
+    return false;
+}
+
+bool tcp_closer_exclude_init(struct tcp_closer_ctx *ctx, const char *path)
+{
+    char line[EXCLUDE_MAX_LINE_LEN];
+    uint32_t line_num = 0;
+    FILE *exclude_file;
+
+    ctx->exclude = calloc(sizeof(struct tcp_closer_exclude), 1);
+
+    if (!ctx->exclude || !exclude_trie_init(&(ctx->exclude->trie4)) ||
+        !exclude_trie_init(&(ctx->exclude->trie6))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "exclusions\n");
+        return false;
+    }
+
+    if (!(exclude_file = fopen(path, "r"))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open %s. Error: %s "
+                                "(%u)\n", path, strerror(errno), errno);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), exclude_file)) {
+        line_num++;
+
+        if (!exclude_parse_line(ctx, line)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Invalid exclusion on line "
+                                    "%u of %s\n", line_num, path);
+            fclose(exclude_file);
+            return false;
+        }
+    }
+
+    fclose(exclude_file);
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Loaded %u network(s), %u pid(s) "
+                            "and %s from %s\n", ctx->exclude->num_nets,
+                            ctx->exclude->num_pids,
+                            ctx->exclude->uid_bitmap ? "UIDs" : "no UIDs",
+                            path);
+
+    return true;
+}
+
+//A negated condition is the condition followed by a JMP. If the condition
+//matches, we continue to the JMP, which rejects the socket. Otherwise the JMP
+//is skipped. The kernel audit does not allow jumping out of the filter from
+//yes, so the JMP is needed
+bool tcp_closer_exclude_compile(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_exclude *exclude = ctx->exclude;
+    struct tcp_closer_exclude_net *net;
+    struct inet_diag_bc_op *op, *jmp;
+    struct inet_diag_hostcond *cond;
+    uint32_t prefix_len = 0, filter_len, offset = 0, i, addr_len;
+    uint8_t *filter;
+
+    if (!exclude->num_nets || exclude->num_nets > EXCLUDE_MAX_KERNEL_CONDS) {
+        return true;
+    }
+
+    for (i = 0; i < exclude->num_nets; i++) {
+        prefix_len += sizeof(struct inet_diag_bc_op) * 2 +
+                      sizeof(struct inet_diag_hostcond) +
+                      (exclude->nets[i].family == AF_INET ? 4 : 16);
+    }
+
+    filter_len = prefix_len + ctx->diag_filter_len;
+
+    if (!(filter = calloc(filter_len, 1))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "filter\n");
+        return false;
+    }
+
+    for (i = 0; i < exclude->num_nets; i++) {
+        net = &(exclude->nets[i]);
+        addr_len = net->family == AF_INET ? 4 : 16;
+
+        op = (struct inet_diag_bc_op*) (filter + offset);
+        cond = (struct inet_diag_hostcond*) (op + 1);
+        jmp = (struct inet_diag_bc_op*) (((uint8_t*) (cond + 1)) + addr_len);
+
+        op->code = INET_DIAG_BC_D_COND;
+        op->yes = sizeof(*op) + sizeof(*cond) + addr_len;
+        op->no = op->yes + sizeof(*jmp);
+        cond->family = net->family;
+        cond->prefix_len = net->prefix_len;
+        cond->port = -1;
+        memcpy(cond->addr, net->addr, addr_len);
+
+        offset += op->yes;
+
+        jmp->code = INET_DIAG_BC_JMP;
+        jmp->yes = sizeof(*jmp);
+        jmp->no = filter_len - offset + 4;
+
+        offset += sizeof(*jmp);
+    }
+
+    memcpy(filter + prefix_len, ctx->diag_filter, ctx->diag_filter_len);
+
+    if (!tcp_closer_lib_filter_audit(filter, filter_len)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Filter with exclusions is "
+                                "invalid\n");
+        free(filter);
+        return false;
+    }
+
+    free(ctx->diag_filter);
+    ctx->diag_filter = (struct inet_diag_bc_op*) filter;
+    ctx->diag_filter_len = filter_len;
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Compiled %u excluded network(s) "
+                            "into the kernel filter\n", exclude->num_nets);
+
+    return true;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_EXCLUDE_H
+#define TCP_CLOSER_EXCLUDE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+//Address exclusions are compiled into the kernel filter when there are at
+//most this many of them, every condition is evaluated for every socket
+#define EXCLUDE_MAX_KERNEL_CONDS    32
+
+//Largest UID that can be excluded (size of the UID bitmap)
+#define EXCLUDE_MAX_UID             ((1 << 24) - 1)
+
+#define EXCLUDE_INITIAL_NODES       64
+#define EXCLUDE_INITIAL_INODES      64
+#define EXCLUDE_MAX_LINE_LEN        256
+
+//Node in a path-compressed binary trie. The node covers the first len bits of
+//key (host byte order). terminal is set if the prefix itself was added
+struct tcp_closer_exclude_node {
+    uint32_t key[4];
+    int32_t child[2];
+    uint8_t len;
+    bool terminal;
+};
+
+struct tcp_closer_exclude_trie {
+    struct tcp_closer_exclude_node *nodes;
+    uint32_t num_nodes;
+    uint32_t size;
+};
+
+//An address from the file, kept for compiling the kernel filter
+struct tcp_closer_exclude_net {
+    uint32_t addr[4];
+    uint8_t family;
+    uint8_t prefix_len;
+};
+
+//Sockets are excluded if the remote address is in one of the tries, the UID
+//is set in uid_bitmap or the inode belongs to one of the pids. The exclusions
+//are shared by all workers and never changed after loading. The inodes of the
+//pids are collected by every worker before every dump
+struct tcp_closer_exclude {
+    struct tcp_closer_exclude_trie trie4;
+    struct tcp_closer_exclude_trie trie6;
+    struct tcp_closer_exclude_net *nets;
+    uint64_t *uid_bitmap;
+    pid_t *pids;
+    uint32_t num_nets;
+    uint32_t nets_size;
+    uint16_t num_pids;
+};
+
+struct tcp_closer_ctx;
+struct inet_diag_msg;
+
+//Load the exclusions from file. See README for the format
+bool tcp_closer_exclude_init(struct tcp_closer_ctx *ctx, const char *path);
+
+//Prepend negated address conditions to the filter of ctx, if there are few
+//enough addresses. Must be called after the port filter is created
+bool tcp_closer_exclude_compile(struct tcp_closer_ctx *ctx);
+
+//Collect the inodes owned by the excluded pids. Called before every dump
+void tcp_closer_exclude_dump_start(struct tcp_closer_ctx *ctx);
+
+bool tcp_closer_exclude_match(struct tcp_closer_ctx *ctx,
+                              struct inet_diag_msg *diag_msg);
+
+#endif
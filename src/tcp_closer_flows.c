@@ -0,0 +1,355 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_flows.h"
+#include "tcp_closer.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+static inline uint32_t flows_hash(uint32_t inode)
+{
+    //Inodes are mostly sequential, so spread them out (Knuth)
+    return inode * 2654435761U;
+}
+
+static struct tcp_closer_flow *flows_lookup(struct tcp_closer_flow *table,
+                                            uint32_t size, uint32_t inode)
+{
+    uint32_t idx = flows_hash(inode) & (size - 1);
+
+    while (table[idx].inode && table[idx].inode != inode) {
+        idx = (idx + 1) & (size - 1);
+    }
+
+    return &(table[idx]);
+}
+
+//Allocate table and spare of size slots
+static bool flows_alloc(struct tcp_closer_flows *flows, uint32_t size)
+{
+    struct tcp_closer_flow *table, *spare;
+
+    table = calloc(size, sizeof(struct tcp_closer_flow));
+    spare = calloc(size, sizeof(struct tcp_closer_flow));
+
+    if (!table || !spare) {
+        free(table);
+        free(spare);
+        return false;
+    }
+
+    free(flows->table);
+    free(flows->spare);
+    flows->table = table;
+    flows->spare = spare;
+    flows->size = size;
+
+    return true;
+}
+
+//Move all live flows (seen in generation min_generation or later) to the spare
+//table and swap. If grow is set, the tables are doubled first
+static bool flows_rebuild(struct tcp_closer_flows *flows,
+                          uint32_t min_generation, bool grow)
+{
+    struct tcp_closer_flow *old_table = flows->table, *new_table;
+    struct tcp_closer_flow *flow;
+    uint32_t old_size = flows->size, i;
+
+    if (grow) {
+        new_table = calloc(old_size * 2, sizeof(struct tcp_closer_flow));
+
+        if (!new_table) {
+            return false;
+        }
+
+        free(flows->spare);
+        flows->spare = NULL;
+        flows->size = old_size * 2;
+    } else {
+        new_table = flows->spare;
+        memset(new_table, 0, flows->size * sizeof(struct tcp_closer_flow));
+    }
+
+    flows->num_flows = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old_table[i].inode || old_table[i].generation < min_generation) {
+            continue;
+        }
+
+        flow = flows_lookup(new_table, flows->size, old_table[i].inode);
+        *flow = old_table[i];
+        flows->num_flows++;
+    }
+
+    flows->table = new_table;
+
+    if (!grow) {
+        flows->spare = old_table;
+        return true;
+    }
+
+    free(old_table);
+    flows->spare = calloc(flows->size, sizeof(struct tcp_closer_flow));
+
+    return flows->spare != NULL;
+}
+
+uint64_t tcp_closer_flows_update(struct tcp_closer_ctx *ctx,
+                                 struct inet_diag_msg *diag_msg)
+{
+    struct tcp_closer_flows *flows = ctx->flows;
+    struct tcp_closer_flow *flow;
+
+    //Keep load factor below 0.5, so that probe sequences stay short
+    if ((flows->num_flows + 1) * 2 > flows->size &&
+        !flows_rebuild(flows, 0, true)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to grow flow table\n");
+        return 0;
+    }
+
+    flow = flows_lookup(flows->table, flows->size, diag_msg->idiag_inode);
+
+    if (flow->inode && (flow->sport != diag_msg->id.idiag_sport ||
+                        flow->dport != diag_msg->id.idiag_dport)) {
+        //Inode has been reused by a different connection
+        flow->first_seen = ctx->dump_start;
+        flow->from_snapshot = 0;
+    } else if (!flow->inode) {
+        flow->inode = diag_msg->idiag_inode;
+        flow->first_seen = ctx->dump_start;
+        flow->from_snapshot = 0;
+        flows->num_flows++;
+    } else if (flow->from_snapshot && !flow->generation) {
+        //Count flows from the snapshot that are confirmed by the dump
+        flows->num_loaded++;
+    }
+
+    flow->sport = diag_msg->id.idiag_sport;
+    flow->dport = diag_msg->id.idiag_dport;
+    flow->generation = flows->generation;
+
+    return ctx->dump_start > flow->first_seen ?
+           ctx->dump_start - flow->first_seen : 0;
+}
+
+void tcp_closer_flows_dump_done(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_flows *flows = ctx->flows;
+    uint32_t num_before = flows->num_flows;
+
+    //With --dump_budget, a dump only covers the current shard of the port
+    //space. Flows can only be expired when every shard has been dumped since
+    //the cycle started, otherwise the flows of the other shards are dropped.
+    //A cycle starts over when the shards are split
+    if (!ctx->shard_idx) {
+        flows->cycle_generation = flows->generation;
+    }
+
+    if (ctx->shard_idx + 1 >= ctx->num_shards) {
+        flows_rebuild(flows, flows->cycle_generation, false);
+
+        //First full cycle validates the snapshot
+        if (!flows->snapshot_checked && flows->snapshot_path) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%u flow(s) from snapshot "
+                                    "still present after first dump (%u "
+                                    "flows tracked)\n", flows->num_loaded,
+                                    flows->num_flows);
+            flows->snapshot_checked = true;
+        } else if (ctx->verbose_mode) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Flow table: %u flows, %u "
+                                    "removed\n", flows->num_flows,
+                                    num_before - flows->num_flows);
+        }
+    }
+
+    flows->generation++;
+
+    if (flows->snapshot_path &&
+        !(++flows->num_dumps % FLOWS_SNAPSHOT_INTVL)) {
+        tcp_closer_flows_save(ctx);
+    }
+}
+
+bool tcp_closer_flows_save(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_flows *flows = ctx->flows;
+    struct tcp_closer_flows_hdr hdr;
+    char tmp_path[4096];
+    FILE *snapshot;
+    uint32_t i;
+
+    if (!flows || !flows->snapshot_path) {
+        return true;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", flows->snapshot_path);
+
+    if (!(snapshot = fopen(tmp_path, "w"))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open %s. Error: %s "
+                                "(%u)\n", tmp_path, strerror(errno), errno);
+        return false;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FLOWS_SNAPSHOT_MAGIC;
+    hdr.version = FLOWS_SNAPSHOT_VERSION;
+    hdr.record_size = sizeof(struct tcp_closer_flow);
+    hdr.num_records = flows->num_flows;
+    hdr.created = backend_get_time_ms();
+
+    fwrite(&hdr, sizeof(hdr), 1, snapshot);
+
+    for (i = 0; i < flows->size; i++) {
+        if (flows->table[i].inode) {
+            fwrite(&(flows->table[i]), sizeof(struct tcp_closer_flow), 1,
+                   snapshot);
+        }
+    }
+
+    //Rename is atomic, so a reader never sees a partial snapshot. The data
+    //must reach the disk before the rename does, otherwise a crash can leave
+    //an empty or truncated file behind under the snapshot's name
+    if (fflush(snapshot) || fsync(fileno(snapshot))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to write snapshot %s. "
+                                "Error: %s (%u)\n", flows->snapshot_path,
+                                strerror(errno), errno);
+        fclose(snapshot);
+        unlink(tmp_path);
+        return false;
+    }
+
+    if (fclose(snapshot) || rename(tmp_path, flows->snapshot_path)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to write snapshot %s. "
+                                "Error: %s (%u)\n", flows->snapshot_path,
+                                strerror(errno), errno);
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+//Map the snapshot and insert every record into the table. Flows are marked as
+//belonging to generation 0, so that the ones not present in the first dump are
+//removed
+static void flows_load(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_flows *flows = ctx->flows;
+    const struct tcp_closer_flows_hdr *hdr;
+    const struct tcp_closer_flow *records;
+    struct tcp_closer_flow *flow;
+    struct stat st;
+    uint64_t i, start_time = backend_get_time_ms();
+    uint32_t size;
+    void *map;
+    int fd;
+
+    if ((fd = open(flows->snapshot_path, O_RDONLY)) < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) || st.st_size < sizeof(struct tcp_closer_flows_hdr)) {
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    hdr = map;
+    records = (const struct tcp_closer_flow*) (hdr + 1);
+
+    if (hdr->magic != FLOWS_SNAPSHOT_MAGIC ||
+        hdr->version != FLOWS_SNAPSHOT_VERSION ||
+        hdr->record_size != sizeof(struct tcp_closer_flow) ||
+        hdr->num_records > (st.st_size - sizeof(*hdr)) / hdr->record_size) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Ignoring invalid snapshot %s\n",
+                                flows->snapshot_path);
+        munmap(map, st.st_size);
+        return;
+    }
+
+    for (size = FLOWS_INITIAL_SIZE; size < hdr->num_records * 2; size *= 2);
+
+    if (size > flows->size && !flows_alloc(flows, size)) {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    for (i = 0; i < hdr->num_records; i++) {
+        if (!records[i].inode) {
+            continue;
+        }
+
+        flow = flows_lookup(flows->table, flows->size, records[i].inode);
+
+        if (!flow->inode) {
+            flows->num_flows++;
+        }
+
+        *flow = records[i];
+        flow->generation = 0;
+        flow->from_snapshot = 1;
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Loaded %u flow(s) from snapshot %s "
+                            "in %lums\n", flows->num_flows,
+                            flows->snapshot_path,
+                            backend_get_time_ms() - start_time);
+
+    munmap(map, st.st_size);
+}
+
+bool tcp_closer_flows_init(struct tcp_closer_ctx *ctx, const char *snapshot_path)
+{
+    struct tcp_closer_flows *flows = calloc(sizeof(struct tcp_closer_flows), 1);
+
+    if (!flows || !flows_alloc(flows, FLOWS_INITIAL_SIZE)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "flow table\n");
+        free(flows);
+        return false;
+    }
+
+    ctx->flows = flows;
+    flows->snapshot_path = snapshot_path;
+    flows->generation = 1;
+    flows->cycle_generation = 1;
+
+    if (snapshot_path) {
+        flows_load(ctx);
+    }
+
+    return true;
+}
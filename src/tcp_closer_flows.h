@@ -0,0 +1,90 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_FLOWS_H
+#define TCP_CLOSER_FLOWS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FLOWS_SNAPSHOT_MAGIC    0x46504354 //TCPF
+#define FLOWS_SNAPSHOT_VERSION  1
+#define FLOWS_INITIAL_SIZE      1024
+
+//How often (in dumps) the snapshot is written. It is also written on shutdown
+#define FLOWS_SNAPSHOT_INTVL    10
+
+//The flow table keeps track of when every socket that passed the port filter
+//was first seen. A flow is identified by the inode of the socket, ports are
+//stored so that a recycled inode is not mistaken for the same flow
+struct tcp_closer_flow {
+    uint64_t first_seen;
+    uint32_t inode;
+    uint32_t generation;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t from_snapshot;
+    uint8_t pad[3];
+};
+
+//On-disk format of the snapshot is this header followed by num_records
+//records of record_size bytes (struct tcp_closer_flow). All values are in host
+//byte order, the snapshot is not meant to be moved between machines
+struct tcp_closer_flows_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t num_records;
+    uint64_t created;
+};
+
+//Open addressing hash table with linear probing. Inode 0 marks an empty slot.
+//Stale flows are removed when every shard has been dumped (after every dump
+//without --dump_budget), by moving the live flows to the spare table
+struct tcp_closer_flows {
+    struct tcp_closer_flow *table;
+    struct tcp_closer_flow *spare;
+    const char *snapshot_path;
+    uint32_t size;
+    uint32_t num_flows;
+    uint32_t generation;
+    //Generation of the first dump of the current shard cycle
+    uint32_t cycle_generation;
+    uint32_t num_loaded;
+    uint32_t num_dumps;
+    bool snapshot_checked;
+};
+
+struct tcp_closer_ctx;
+struct inet_diag_msg;
+
+//Create the flow table of ctx. If snapshot_path is set, flows are loaded from
+//the snapshot (if it exists) and the snapshot is written periodically
+bool tcp_closer_flows_init(struct tcp_closer_ctx *ctx, const char *snapshot_path);
+
+//Record that the socket was seen in the current dump and return how long (in
+//ms) the flow has been known
+uint64_t tcp_closer_flows_update(struct tcp_closer_ctx *ctx,
+                                 struct inet_diag_msg *diag_msg);
+
+//Remove flows that were not seen since the first shard was dumped, if the
+//dump was of the last shard, and write snapshot when needed
+void tcp_closer_flows_dump_done(struct tcp_closer_ctx *ctx);
+
+//Write the snapshot
+bool tcp_closer_flows_save(struct tcp_closer_ctx *ctx);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_idle.h"
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+static inline uint32_t idle_bucket(uint32_t value)
+{
+    uint32_t exp;
+
+    if (value < IDLE_SUB_BUCKETS) {
+        return value;
+    }
+
+    //Position of the highest bit, which is at least IDLE_SUB_BITS
+    exp = 31 - __builtin_clz(value);
+
+    return ((exp - IDLE_SUB_BITS + 1) << IDLE_SUB_BITS) +
+           ((value >> (exp - IDLE_SUB_BITS)) & (IDLE_SUB_BUCKETS - 1));
+}
+
+//Largest value that is counted in bucket idx
+static uint32_t idle_bucket_max(uint32_t idx)
+{
+    uint32_t exp, low;
+
+    if (idx < IDLE_SUB_BUCKETS) {
+        return idx;
+    }
+
+    exp = (idx >> IDLE_SUB_BITS) + IDLE_SUB_BITS - 1;
+    low = (IDLE_SUB_BUCKETS + (idx & (IDLE_SUB_BUCKETS - 1))) <<
+          (exp - IDLE_SUB_BITS);
+
+    return low + ((1U << (exp - IDLE_SUB_BITS)) - 1);
+}
+
+static bool idle_alloc(struct tcp_closer_ctx *ctx,
+                       struct tcp_closer_idle_rules *rules)
+{
+    struct tcp_closer_idle *idle = calloc(sizeof(struct tcp_closer_idle), 1);
+
+    if (!idle || !(idle->hist = calloc(rules->num * IDLE_NUM_BUCKETS,
+                                       sizeof(uint32_t)))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "idle time histograms\n");
+        free(idle);
+        return false;
+    }
+
+    idle->rules = rules;
+    idle->window_start = backend_get_time_ms();
+    ctx->idle = idle;
+
+    return true;
+}
+
+static void idle_add_rules(struct tcp_closer_idle_rules *rules,
+                           uint16_t *ports, uint16_t num_ports, uint8_t side)
+{
+    uint16_t i;
+
+    for (i = 0; i < num_ports; i++) {
+        //Ports can be given more than once
+        if (rules->idx[side][ports[i]]) {
+            continue;
+        }
+
+        rules->port[rules->num] = ports[i];
+        rules->side[rules->num] = side;
+        rules->idx[side][ports[i]] = ++rules->num;
+    }
+}
+
+bool tcp_closer_idle_init(struct tcp_closer_ctx *ctx, uint16_t *sports,
+                          uint16_t num_sport, uint16_t *dports,
+                          uint16_t num_dport)
+{
+    struct tcp_closer_idle_rules *rules;
+
+    if (!(rules = calloc(sizeof(struct tcp_closer_idle_rules), 1))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "idle time rules\n");
+        return false;
+    }
+
+    idle_add_rules(rules, sports, num_sport, IDLE_RULE_SPORT);
+    idle_add_rules(rules, dports, num_dport, IDLE_RULE_DPORT);
+
+    if (!idle_alloc(ctx, rules)) {
+        free(rules);
+        return false;
+    }
+
+    return true;
+}
+
+bool tcp_closer_idle_clone(struct tcp_closer_ctx *worker,
+                           struct tcp_closer_ctx *ctx)
+{
+    return idle_alloc(worker, ctx->idle->rules);
+}
+
+static inline void idle_top_swap(struct tcp_closer_idle_sock *a,
+                                 struct tcp_closer_idle_sock *b)
+{
+    struct tcp_closer_idle_sock tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+static void idle_top_sift_down(struct tcp_closer_idle_sock *top, uint32_t len,
+                               uint32_t i)
+{
+    uint32_t child;
+
+    while ((child = (i * 2) + 1) < len) {
+        if (child + 1 < len &&
+            top[child + 1].last_data_recv < top[child].last_data_recv) {
+            child++;
+        }
+
+        if (top[i].last_data_recv <= top[child].last_data_recv) {
+            break;
+        }
+
+        idle_top_swap(&(top[i]), &(top[child]));
+        i = child;
+    }
+}
+
+//Only called when the socket is more idle than the root, or the heap is not
+//full. A new socket is added as a leaf, otherwise the root is replaced
+static void idle_top_add(struct tcp_closer_idle *idle,
+                         struct inet_diag_msg *diag_msg,
+                         uint32_t last_data_recv)
+{
+    struct tcp_closer_idle_sock *top = idle->top;
+    uint32_t i = idle->top_len < IDLE_TOP_K ? idle->top_len++ : 0;
+
+    top[i].id = diag_msg->id;
+    top[i].family = diag_msg->idiag_family;
+    top[i].last_data_recv = last_data_recv;
+
+    if (!i) {
+        idle_top_sift_down(top, idle->top_len, 0);
+        return;
+    }
+
+    while (i && top[(i - 1) / 2].last_data_recv > top[i].last_data_recv) {
+        idle_top_swap(&(top[i]), &(top[(i - 1) / 2]));
+        i = (i - 1) / 2;
+    }
+}
+
+//Called for every socket, so it is kept to two table lookups and a histogram
+//increment for most sockets. A socket is only copied to the heap if it is
+//more idle than the least idle socket in it
+void tcp_closer_idle_add_batch(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_idle *idle = ctx->idle;
+    struct tcp_closer_idle_rules *rules = idle->rules;
+    struct tcp_closer_batch *batch = ctx->batch;
+    struct inet_diag_msg *diag_msg;
+    uint32_t i, bucket, last_data_recv;
+    uint16_t sport, dport;
+    uint8_t idx;
+
+    for (i = 0; i < batch->num; i++) {
+        diag_msg = batch->msgs[i];
+        last_data_recv = batch->last_data_recv[i];
+        bucket = idle_bucket(last_data_recv);
+        sport = ntohs(diag_msg->id.idiag_sport);
+        dport = ntohs(diag_msg->id.idiag_dport);
+
+        if ((idx = rules->idx[IDLE_RULE_SPORT][sport])) {
+            idle->hist[((idx - 1) * IDLE_NUM_BUCKETS) + bucket]++;
+        }
+
+        if ((idx = rules->idx[IDLE_RULE_DPORT][dport])) {
+            idle->hist[((idx - 1) * IDLE_NUM_BUCKETS) + bucket]++;
+        }
+
+        if (idle->top_len < IDLE_TOP_K ||
+            last_data_recv > idle->top[0].last_data_recv) {
+            idle_top_add(idle, diag_msg, last_data_recv);
+        }
+    }
+}
+
+static void idle_log_rule(struct tcp_closer_ctx *ctx, const char *prefix,
+                          uint16_t rule, uint64_t window)
+{
+    static const uint16_t percentiles[] = {500, 900, 990, 999};
+    uint32_t values[sizeof(percentiles) / sizeof(percentiles[0])] = {0};
+    uint32_t *hist = ctx->idle->hist + (rule * IDLE_NUM_BUCKETS);
+    struct tcp_closer_idle_rules *rules = ctx->idle->rules;
+    uint64_t total = 0, count = 0;
+    uint32_t i, max = 0;
+    uint8_t pct_idx = 0;
+
+    for (i = 0; i < IDLE_NUM_BUCKETS; i++) {
+        total += hist[i];
+    }
+
+    if (!total) {
+        return;
+    }
+
+    //Percentiles are in 1/1000
+    for (i = 0; i < IDLE_NUM_BUCKETS; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+
+        count += hist[i];
+        max = idle_bucket_max(i);
+
+        while (pct_idx < sizeof(values) / sizeof(values[0]) &&
+               count * 1000 >= total * percentiles[pct_idx]) {
+            values[pct_idx++] = max;
+        }
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%sIdle time (last_data_recv) of "
+                            "%s %u over %lus, %lu sample(s): p50 %ums p90 %ums "
+                            "p99 %ums p99.9 %ums max %ums\n", prefix,
+                            rules->side[rule] == IDLE_RULE_SPORT ? "sport" :
+                                                                   "dport",
+                            rules->port[rule], window / 1000, total,
+                            values[0], values[1], values[2], values[3], max);
+}
+
+static void idle_log_top(struct tcp_closer_ctx *ctx, const char *prefix)
+{
+    struct tcp_closer_idle *idle = ctx->idle;
+    char local_addr_buf[INET6_ADDRSTRLEN], remote_addr_buf[INET6_ADDRSTRLEN];
+    struct tcp_closer_idle_sock *sock;
+    uint32_t len;
+
+    //Heap sort, moving the least idle socket to the end every time, so that
+    //the most idle socket ends up first
+    for (len = idle->top_len; len > 1; len--) {
+        idle_top_swap(&(idle->top[0]), &(idle->top[len - 1]));
+        idle_top_sift_down(idle->top, len - 1, 0);
+    }
+
+    for (len = 0; len < idle->top_len; len++) {
+        sock = &(idle->top[len]);
+        inet_ntop(sock->family, sock->id.idiag_src, local_addr_buf,
+                  INET6_ADDRSTRLEN);
+        inet_ntop(sock->family, sock->id.idiag_dst, remote_addr_buf,
+                  INET6_ADDRSTRLEN);
+
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%sMost idle #%u src: %s:%d "
+                                "dst: %s:%d last_data_recv: %ums\n", prefix,
+                                len + 1, local_addr_buf,
+                                ntohs(sock->id.idiag_sport), remote_addr_buf,
+                                ntohs(sock->id.idiag_dport),
+                                sock->last_data_recv);
+    }
+}
+
+void tcp_closer_idle_dump_done(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_idle *idle = ctx->idle;
+    uint64_t cur_time = backend_get_time_ms();
+    char prefix[32] = "";
+    uint16_t i;
+
+    if (ctx->dump_interval &&
+        cur_time - idle->window_start < ctx->idle_stats_intvl) {
+        idle->top_len = 0;
+        return;
+    }
+
+    //Every worker reports on its own part of the port space
+    if (ctx->shard_port_lo || ctx->shard_port_hi != 0xFFFF) {
+        snprintf(prefix, sizeof(prefix), "Ports %u-%u: ", ctx->shard_port_lo,
+                 ctx->shard_port_hi);
+    }
+
+    for (i = 0; i < idle->rules->num; i++) {
+        idle_log_rule(ctx, prefix, i, cur_time - idle->window_start);
+    }
+
+    idle_log_top(ctx, prefix);
+
+    memset(idle->hist, 0,
+           idle->rules->num * IDLE_NUM_BUCKETS * sizeof(uint32_t));
+    idle->top_len = 0;
+    idle->window_start = cur_time;
+}
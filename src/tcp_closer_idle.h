@@ -0,0 +1,82 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_IDLE_H
+#define TCP_CLOSER_IDLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer.h"
+
+//Log-linear histogram of last_data_recv (ms), like HdrHistogram. Values below
+//IDLE_SUB_BUCKETS have their own bucket, every power of two above is split
+//into IDLE_SUB_BUCKETS buckets. The error is at most 1/16 (6.25%)
+#define IDLE_SUB_BITS       4
+#define IDLE_SUB_BUCKETS    (1 << IDLE_SUB_BITS)
+#define IDLE_NUM_BUCKETS    ((32 - IDLE_SUB_BITS + 1) * IDLE_SUB_BUCKETS)
+
+//Number of most idle connections that are reported
+#define IDLE_TOP_K          10
+
+enum {
+    IDLE_RULE_SPORT = 0,
+    IDLE_RULE_DPORT
+};
+
+//The ports given on the command line, shared by all workers. idx is the rule
+//index + 1 of every source and destination port, 0 if not a rule
+struct tcp_closer_idle_rules {
+    uint8_t idx[2][65536];
+    uint16_t port[MAX_NUM_PORTS];
+    uint8_t side[MAX_NUM_PORTS];
+    uint16_t num;
+};
+
+struct tcp_closer_idle_sock {
+    struct inet_diag_sockid id;
+    uint32_t last_data_recv;
+    uint8_t family;
+};
+
+//--idle_stats. Every worker keeps one histogram per rule for the current
+//report interval, and a min-heap of the most idle sockets of the current dump
+//(the root is the least idle of them, and is replaced by a more idle socket)
+struct tcp_closer_idle {
+    struct tcp_closer_idle_rules *rules;
+    uint32_t *hist;
+    struct tcp_closer_idle_sock top[IDLE_TOP_K];
+    uint32_t top_len;
+    uint64_t window_start;
+};
+
+bool tcp_closer_idle_init(struct tcp_closer_ctx *ctx, uint16_t *sports,
+                          uint16_t num_sport, uint16_t *dports,
+                          uint16_t num_dport);
+
+//Create the histograms of a worker, sharing the rules of ctx
+bool tcp_closer_idle_clone(struct tcp_closer_ctx *worker,
+                           struct tcp_closer_ctx *ctx);
+
+//Add all sockets of the current batch
+void tcp_closer_idle_add_batch(struct tcp_closer_ctx *ctx);
+
+//Log the histograms and most idle sockets when the report interval has passed
+//(or when there is only one dump), and start over
+void tcp_closer_idle_dump_done(struct tcp_closer_ctx *ctx);
+
+#endif
@@ -0,0 +1,793 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <libmnl/libmnl.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tcp_closer_lib.h"
+
+#define LIB_RECV_BUF_SIZE    32768
+
+struct tcp_closer_lib {
+    struct tcp_closer_lib_ops ops;
+    struct mnl_socket *dump_socket;
+    struct mnl_socket *destroy_socket;
+    uint8_t *recv_buf;
+    uint8_t *destroy_buf;
+    uint32_t destroy_len;
+    uint32_t seq;
+};
+
+static void *lib_default_alloc(size_t size, void *user_data)
+{
+    return calloc(size, 1);
+}
+
+static void lib_default_free(void *ptr, void *user_data)
+{
+    free(ptr);
+}
+
+static void lib_log(struct tcp_closer_lib *lib, int priority, const char *fmt,
+                    ...) __attribute__((format(printf, 3, 4)));
+
+static void lib_log(struct tcp_closer_lib *lib, int priority, const char *fmt,
+                    ...)
+{
+    char msg[256];
+    va_list args;
+
+    if (!lib->ops.log) {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    lib->ops.log(priority, msg, lib->ops.user_data);
+}
+
+uint32_t tcp_closer_lib_filter_len(uint16_t num_sport, uint16_t num_dport)
+{
+    uint32_t filter_len = 0;
+
+    //Since there is no equal operator, a port comparison will requires five
+    //bc_op-structs. Two for LE (since ports is kept in a second struct), two
+    //for GE and one for JMP. The last comparison does not need the JMP
+    if (num_sport) {
+        filter_len += sizeof(struct inet_diag_bc_op) * 5 * (num_sport - 1) +
+                      sizeof(struct inet_diag_bc_op) * 4;
+    }
+
+    if (num_dport) {
+        filter_len += sizeof(struct inet_diag_bc_op) * 5 * (num_dport - 1) +
+                      sizeof(struct inet_diag_bc_op) * 4;
+    }
+
+    return filter_len;
+}
+
+//Write the comparisons for one type of port. left_of_filter is the length of
+//the filter after these comparisons
+static void lib_filter_write_ports(struct inet_diag_bc_op *ops,
+                                   const uint16_t *ports, uint16_t num_ports,
+                                   uint8_t code_ge, uint8_t code_le,
+                                   uint32_t left_of_filter)
+{
+    uint16_t idx = 0, num;
+
+    for (num = 1; num <= num_ports; num++) {
+        //Create the greater than operation. The only interesting thing going
+        //on is the value of no. If this is the last port and we don't match,
+        //we should abort loop. The value is fixed up after the loop, to
+        //ensure that len will be negative
+        ops[idx].code = code_ge;
+        ops[idx].yes = sizeof(struct inet_diag_bc_op) * 2;
+        ops[idx].no = num == num_ports ? 0 : sizeof(struct inet_diag_bc_op) * 5;
+        ops[idx + 1].code = INET_DIAG_BC_NOP;
+        ops[idx + 1].yes = sizeof(struct inet_diag_bc_op);
+        ops[idx + 1].no = ports[num - 1];
+
+        //Same as above. Here, yes is interesting. We can jump straight to the
+        //next type of ports. This means offset is sizeof() * 2 to pass this
+        //block, and then the JMP op passes the rest of the comparisons
+        ops[idx + 2].code = code_le;
+        ops[idx + 2].yes = sizeof(struct inet_diag_bc_op) * 2;
+        ops[idx + 2].no = num == num_ports ? 0 :
+                                             sizeof(struct inet_diag_bc_op) * 3;
+        ops[idx + 3].code = INET_DIAG_BC_NOP;
+        ops[idx + 3].yes = sizeof(struct inet_diag_bc_op);
+        ops[idx + 3].no = ports[num - 1];
+
+        if (num == num_ports) {
+            idx += 4;
+            break;
+        }
+
+        ops[idx + 4].code = INET_DIAG_BC_JMP;
+        ops[idx + 4].yes = sizeof(struct inet_diag_bc_op);
+
+        //Logic behind this calculation is as follows. If we hit a JMP, we want
+        //to skip all the remaining operations of this type. All comparisons
+        //block, except the last one, contains a JMP op. The last block does
+        //not need a JMP op, since we will either fail and jump to the end (no
+        //can have any offset) or continue with comparisons/finish if we match.
+        //
+        //The offset for any jump block is sizeof() * (num_left - 1) * 5 +
+        //sizeof() * 4 + sizeof(). First part all all normal blocks, second is
+        //the size of the last block and third is this struct
+        ops[idx + 4].no = sizeof(struct inet_diag_bc_op) +
+                          ((num_ports - num - 1) * sizeof(struct inet_diag_bc_op) * 5) +
+                          sizeof(struct inet_diag_bc_op) * 4;
+        idx += 5;
+    }
+
+    //If the last comparison fails, jump past the end of the filter (+ 4) so
+    //that len becomes negative and the socket is rejected
+    idx -= 4;
+    ops[idx].no = left_of_filter + sizeof(struct inet_diag_bc_op) * 4 + 4;
+    ops[idx + 2].no = left_of_filter + sizeof(struct inet_diag_bc_op) * 2 + 4;
+}
+
+void tcp_closer_lib_filter_write(struct inet_diag_bc_op *filter,
+                                 const uint16_t *sports, uint16_t num_sport,
+                                 const uint16_t *dports, uint16_t num_dport)
+{
+    //Destination ports are always stored after source ports in our buffer
+    uint32_t sport_len = tcp_closer_lib_filter_len(num_sport, 0);
+    uint32_t dport_len = tcp_closer_lib_filter_len(0, num_dport);
+
+    if (num_sport) {
+        lib_filter_write_ports(filter, sports, num_sport, INET_DIAG_BC_S_GE,
+                               INET_DIAG_BC_S_LE, dport_len);
+    }
+
+    if (num_dport) {
+        lib_filter_write_ports(filter + (sport_len /
+                                         sizeof(struct inet_diag_bc_op)),
+                               dports, num_dport, INET_DIAG_BC_D_GE,
+                               INET_DIAG_BC_D_LE, 0);
+    }
+}
+
+struct inet_diag_bc_op *tcp_closer_lib_filter_compile(struct tcp_closer_lib *lib,
+                                                      const uint16_t *sports,
+                                                      uint16_t num_sport,
+                                                      const uint16_t *dports,
+                                                      uint16_t num_dport,
+                                                      uint32_t *filter_len)
+{
+    struct inet_diag_bc_op *filter;
+
+    *filter_len = tcp_closer_lib_filter_len(num_sport, num_dport);
+
+    if (!*filter_len) {
+        return NULL;
+    }
+
+    filter = lib->ops.alloc(*filter_len, lib->ops.user_data);
+
+    if (!filter) {
+        lib_log(lib, LOG_ERR, "Failed to allocate memory for filter\n");
+        return NULL;
+    }
+
+    memset(filter, 0, *filter_len);
+    tcp_closer_lib_filter_write(filter, sports, num_sport, dports, num_dport);
+
+    return filter;
+}
+
+//The sockets are non-blocking, so that a spurious wakeup in the event loop of
+//the application does not block in recv
+static struct mnl_socket *lib_open_socket(struct tcp_closer_lib *lib)
+{
+    struct mnl_socket *nl = mnl_socket_open2(NETLINK_INET_DIAG,
+                                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (!nl) {
+        lib_log(lib, LOG_ERR, "Failed to create inet_diag socket. Error: %s "
+                "(%u)\n", strerror(errno), errno);
+        return NULL;
+    }
+
+    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID)) {
+        lib_log(lib, LOG_ERR, "Failed to bind inet_diag socket. Error: %s "
+                "(%u)\n", strerror(errno), errno);
+        mnl_socket_close(nl);
+        return NULL;
+    }
+
+    return nl;
+}
+
+//Check that cc is the offset of an operation reachable through the yes-chain
+//from the start of the filter (valid_cc() in the kernel)
+static bool lib_audit_valid_cc(const uint8_t *bc, int32_t len, int32_t cc)
+{
+    const struct inet_diag_bc_op *op;
+
+    while (len > 0) {
+        op = (const struct inet_diag_bc_op*) bc;
+
+        if (cc > len) {
+            return false;
+        }
+
+        if (cc == len) {
+            return true;
+        }
+
+        if (op->yes < 4 || op->yes & 3) {
+            return false;
+        }
+
+        len -= op->yes;
+        bc += op->yes;
+    }
+
+    return false;
+}
+
+static bool lib_audit_hostcond(const struct inet_diag_bc_op *op, int32_t len,
+                               int32_t *min_len)
+{
+    const struct inet_diag_hostcond *cond;
+    int32_t addr_len;
+
+    *min_len += sizeof(struct inet_diag_hostcond);
+
+    if (len < *min_len) {
+        return false;
+    }
+
+    cond = (const struct inet_diag_hostcond*) (op + 1);
+
+    switch (cond->family) {
+    case AF_UNSPEC:
+        addr_len = 0;
+        break;
+    case AF_INET:
+        addr_len = sizeof(struct in_addr);
+        break;
+    case AF_INET6:
+        addr_len = sizeof(struct in6_addr);
+        break;
+    default:
+        return false;
+    }
+
+    *min_len += addr_len;
+
+    return len >= *min_len && cond->prefix_len <= 8 * addr_len;
+}
+
+bool tcp_closer_lib_filter_audit(const void *filter, uint32_t filter_len)
+{
+    const uint8_t *bc = filter;
+    const struct inet_diag_bc_op *op;
+    int32_t len = filter_len, min_len;
+
+    while (len > 0) {
+        op = (const struct inet_diag_bc_op*) bc;
+        min_len = sizeof(struct inet_diag_bc_op);
+
+        if (len < min_len) {
+            return false;
+        }
+
+        switch (op->code) {
+        case INET_DIAG_BC_S_COND:
+        case INET_DIAG_BC_D_COND:
+            if (!lib_audit_hostcond(op, len, &min_len)) {
+                return false;
+            }
+            break;
+        case INET_DIAG_BC_S_GE:
+        case INET_DIAG_BC_S_LE:
+        case INET_DIAG_BC_D_GE:
+        case INET_DIAG_BC_D_LE:
+            //The port is stored in the next op
+            min_len += sizeof(struct inet_diag_bc_op);
+
+            if (len < min_len) {
+                return false;
+            }
+            break;
+        case INET_DIAG_BC_JMP:
+        case INET_DIAG_BC_NOP:
+            break;
+        default:
+            return false;
+        }
+
+        if (op->code != INET_DIAG_BC_NOP) {
+            if (op->no < min_len || op->no > len + 4 || op->no & 3) {
+                return false;
+            }
+
+            if (op->no < len &&
+                !lib_audit_valid_cc(filter, filter_len, len - op->no)) {
+                return false;
+            }
+        }
+
+        if (op->yes < min_len || op->yes > len + 4 || op->yes & 3) {
+            return false;
+        }
+
+        bc += op->yes;
+        len -= op->yes;
+    }
+
+    return len == 0;
+}
+
+static bool lib_bitstring_match(const uint32_t *a1, const uint32_t *a2,
+                                uint8_t bits)
+{
+    uint8_t words = bits >> 5;
+    uint32_t mask;
+
+    bits &= 0x1f;
+
+    if (words && memcmp(a1, a2, words << 2)) {
+        return false;
+    }
+
+    if (bits) {
+        mask = htonl(0xFFFFFFFFU << (32 - bits));
+
+        if ((a1[words] ^ a2[words]) & mask) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool lib_run_hostcond(const struct inet_diag_bc_op *op,
+                             const struct tcp_closer_lib_sock *sock)
+{
+    const struct inet_diag_hostcond *cond =
+        (const struct inet_diag_hostcond*) (op + 1);
+    const uint32_t *addr;
+    uint16_t port;
+
+    if (op->code == INET_DIAG_BC_S_COND) {
+        addr = sock->saddr;
+        port = sock->sport;
+    } else {
+        addr = sock->daddr;
+        port = sock->dport;
+    }
+
+    if (cond->port != -1 && cond->port != port) {
+        return false;
+    }
+
+    //IPv4 conditions match IPv4-mapped IPv6 addresses
+    if (cond->family != AF_UNSPEC && cond->family != sock->family) {
+        return sock->family == AF_INET6 && cond->family == AF_INET &&
+               !addr[0] && !addr[1] && addr[2] == htonl(0xFFFF) &&
+               lib_bitstring_match(addr + 3, cond->addr, cond->prefix_len);
+    }
+
+    return !cond->prefix_len ||
+           lib_bitstring_match(addr, cond->addr, cond->prefix_len);
+}
+
+bool tcp_closer_lib_filter_run(const void *filter, uint32_t filter_len,
+                               const struct tcp_closer_lib_sock *sock)
+{
+    const uint8_t *bc = filter;
+    const struct inet_diag_bc_op *op;
+    int32_t len = filter_len;
+    bool yes;
+
+    while (len > 0) {
+        op = (const struct inet_diag_bc_op*) bc;
+
+        switch (op->code) {
+        case INET_DIAG_BC_NOP:
+            yes = true;
+            break;
+        case INET_DIAG_BC_JMP:
+            yes = false;
+            break;
+        case INET_DIAG_BC_S_GE:
+            yes = sock->sport >= op[1].no;
+            break;
+        case INET_DIAG_BC_S_LE:
+            yes = sock->sport <= op[1].no;
+            break;
+        case INET_DIAG_BC_D_GE:
+            yes = sock->dport >= op[1].no;
+            break;
+        case INET_DIAG_BC_D_LE:
+            yes = sock->dport <= op[1].no;
+            break;
+        case INET_DIAG_BC_S_COND:
+        case INET_DIAG_BC_D_COND:
+            yes = lib_run_hostcond(op, sock);
+            break;
+        default:
+            return false;
+        }
+
+        if (yes) {
+            len -= op->yes;
+            bc += op->yes;
+        } else {
+            len -= op->no;
+            bc += op->no;
+        }
+    }
+
+    return len == 0;
+}
+
+uint32_t tcp_closer_lib_dump_req_len(uint32_t filter_len)
+{
+    return MNL_ALIGN(sizeof(struct nlmsghdr)) +
+           MNL_ALIGN(sizeof(struct inet_diag_req_v2)) +
+           MNL_ATTR_HDRLEN + MNL_ALIGN(filter_len);
+}
+
+struct inet_diag_bc_op *tcp_closer_lib_dump_req_write(void *buf, uint32_t portid,
+                                                      uint32_t seq,
+                                                      uint8_t family,
+                                                      const void *filter,
+                                                      uint32_t filter_len)
+{
+    struct nlmsghdr *nlh;
+    struct inet_diag_req_v2 *diag_req;
+    struct nlattr *attr = NULL;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    nlh->nlmsg_pid = portid;
+    nlh->nlmsg_seq = seq;
+
+    diag_req = mnl_nlmsg_put_extra_header(nlh, sizeof(struct inet_diag_req_v2));
+    diag_req->sdiag_family = family;
+    diag_req->sdiag_protocol = IPPROTO_TCP;
+
+    //We are only interested in established connections and need the tcp-info
+    //struct
+    diag_req->idiag_ext |= (1 << (INET_DIAG_INFO - 1));
+    diag_req->idiag_states = 1 << TCP_ESTABLISHED;
+
+    if (filter && filter_len) {
+        attr = mnl_nlmsg_get_payload_tail(nlh);
+        mnl_attr_put(nlh, INET_DIAG_REQ_BYTECODE, filter_len, filter);
+    }
+
+    return attr ? mnl_attr_get_payload(attr) : NULL;
+}
+
+uint32_t tcp_closer_lib_destroy_req_init(void *buf, uint32_t portid)
+{
+    struct nlmsghdr *nlh;
+    struct inet_diag_req_v2 *destroy_req;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_pid = portid;
+    nlh->nlmsg_type = SOCK_DESTROY;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+    destroy_req = mnl_nlmsg_put_extra_header(nlh,
+                                             sizeof(struct inet_diag_req_v2));
+    destroy_req->sdiag_protocol = IPPROTO_TCP;
+
+    return nlh->nlmsg_len;
+}
+
+void tcp_closer_lib_destroy_req_set(void *buf,
+                                    const struct inet_diag_msg *diag_msg,
+                                    uint32_t seq)
+{
+    struct nlmsghdr *nlh = buf;
+    struct inet_diag_req_v2 *destroy_req = mnl_nlmsg_get_payload(nlh);
+
+    nlh->nlmsg_seq = seq;
+    destroy_req->sdiag_family = diag_msg->idiag_family;
+
+    //Copy ID from diag_msg returned by kernel
+    destroy_req->id = diag_msg->id;
+}
+
+struct tcp_info *tcp_closer_lib_diag_info(const struct inet_diag_msg *diag_msg,
+                                          uint32_t payload_len)
+{
+    struct nlattr *attr = (struct nlattr*) (diag_msg + 1);
+    int len = payload_len - sizeof(struct inet_diag_msg);
+
+    while (mnl_attr_ok(attr, len)) {
+        if (mnl_attr_get_type(attr) == INET_DIAG_INFO) {
+            return mnl_attr_get_payload(attr);
+        }
+
+        len -= MNL_ALIGN(attr->nla_len);
+        attr = mnl_attr_next(attr);
+    }
+
+    return NULL;
+}
+
+struct tcp_closer_lib *tcp_closer_lib_create(const struct tcp_closer_lib_ops *ops)
+{
+    struct tcp_closer_lib_ops lib_ops;
+    struct tcp_closer_lib *lib;
+    uint32_t portid;
+    uint16_t i;
+
+    memset(&lib_ops, 0, sizeof(lib_ops));
+
+    if (ops) {
+        lib_ops = *ops;
+    }
+
+    if (!lib_ops.alloc || !lib_ops.free) {
+        lib_ops.alloc = lib_default_alloc;
+        lib_ops.free = lib_default_free;
+    }
+
+    lib = lib_ops.alloc(sizeof(struct tcp_closer_lib), lib_ops.user_data);
+
+    if (!lib) {
+        return NULL;
+    }
+
+    memset(lib, 0, sizeof(struct tcp_closer_lib));
+    lib->ops = lib_ops;
+
+    lib->recv_buf = lib->ops.alloc(LIB_RECV_BUF_SIZE, lib->ops.user_data);
+    lib->destroy_buf = lib->ops.alloc(TCP_CLOSER_LIB_DESTROY_MSG_SIZE *
+                                      TCP_CLOSER_LIB_DESTROY_BATCH,
+                                      lib->ops.user_data);
+
+    if (!lib->recv_buf || !lib->destroy_buf ||
+        !(lib->dump_socket = lib_open_socket(lib)) ||
+        !(lib->destroy_socket = lib_open_socket(lib))) {
+        tcp_closer_lib_destroy(lib);
+        return NULL;
+    }
+
+    //Only the socket and sequence number are written when queueing
+    portid = mnl_socket_get_portid(lib->destroy_socket);
+
+    for (i = 0; i < TCP_CLOSER_LIB_DESTROY_BATCH; i++) {
+        tcp_closer_lib_destroy_req_init(lib->destroy_buf +
+                                        (i * TCP_CLOSER_LIB_DESTROY_MSG_SIZE),
+                                        portid);
+    }
+
+    return lib;
+}
+
+void tcp_closer_lib_destroy(struct tcp_closer_lib *lib)
+{
+    if (lib->dump_socket) {
+        mnl_socket_close(lib->dump_socket);
+    }
+
+    if (lib->destroy_socket) {
+        mnl_socket_close(lib->destroy_socket);
+    }
+
+    if (lib->recv_buf) {
+        lib->ops.free(lib->recv_buf, lib->ops.user_data);
+    }
+
+    if (lib->destroy_buf) {
+        lib->ops.free(lib->destroy_buf, lib->ops.user_data);
+    }
+
+    lib->ops.free(lib, lib->ops.user_data);
+}
+
+void tcp_closer_lib_free(struct tcp_closer_lib *lib, void *ptr)
+{
+    lib->ops.free(ptr, lib->ops.user_data);
+}
+
+int tcp_closer_lib_dump_fd(struct tcp_closer_lib *lib)
+{
+    return mnl_socket_get_fd(lib->dump_socket);
+}
+
+int tcp_closer_lib_destroy_fd(struct tcp_closer_lib *lib)
+{
+    return mnl_socket_get_fd(lib->destroy_socket);
+}
+
+int tcp_closer_lib_dump_start(struct tcp_closer_lib *lib, uint8_t family,
+                              const struct inet_diag_bc_op *filter,
+                              uint32_t filter_len)
+{
+    uint8_t diag_buf[MNL_SOCKET_BUFFER_SIZE];
+
+    if (tcp_closer_lib_dump_req_len(filter_len) > sizeof(diag_buf)) {
+        lib_log(lib, LOG_ERR, "Filter is too large (%u bytes)\n", filter_len);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memset(diag_buf, 0, sizeof(diag_buf));
+    tcp_closer_lib_dump_req_write(diag_buf,
+                                  mnl_socket_get_portid(lib->dump_socket),
+                                  ++lib->seq, family, filter, filter_len);
+
+    if (mnl_socket_sendto(lib->dump_socket, diag_buf,
+                          ((struct nlmsghdr*) diag_buf)->nlmsg_len) < 0) {
+        lib_log(lib, LOG_ERR, "Sending dump request failed. Error: %s (%u)\n",
+                strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int tcp_closer_lib_destroy_flush(struct tcp_closer_lib *lib)
+{
+    int retval = 0;
+
+    if (!lib->destroy_len) {
+        return 0;
+    }
+
+    //The kernel handles every message in the datagram, so a batch costs one
+    //system call
+    if (mnl_socket_sendto(lib->destroy_socket, lib->destroy_buf,
+                          lib->destroy_len) < 0) {
+        lib_log(lib, LOG_ERR, "Sending destroy requests failed. Error: %s "
+                "(%u)\n", strerror(errno), errno);
+        retval = -1;
+    }
+
+    lib->destroy_len = 0;
+    return retval;
+}
+
+int tcp_closer_lib_destroy_queue(struct tcp_closer_lib *lib,
+                                 const struct inet_diag_msg *diag_msg)
+{
+    tcp_closer_lib_destroy_req_set(lib->destroy_buf + lib->destroy_len,
+                                   diag_msg, ++lib->seq);
+    lib->destroy_len += TCP_CLOSER_LIB_DESTROY_MSG_SIZE;
+
+    if (lib->destroy_len == TCP_CLOSER_LIB_DESTROY_MSG_SIZE *
+                            TCP_CLOSER_LIB_DESTROY_BATCH) {
+        return tcp_closer_lib_destroy_flush(lib);
+    }
+
+    return 0;
+}
+
+static int lib_parse_msg(struct tcp_closer_lib *lib, struct nlmsghdr *nlh,
+                         tcp_closer_lib_socket_cb cb, void *user_data)
+{
+    struct inet_diag_msg *diag_msg = mnl_nlmsg_get_payload(nlh);
+    struct tcp_info *tcpi;
+
+    tcpi = tcp_closer_lib_diag_info(diag_msg, mnl_nlmsg_get_payload_len(nlh));
+
+    if (cb(diag_msg, tcpi, user_data) == TCP_CLOSER_LIB_DESTROY) {
+        return tcp_closer_lib_destroy_queue(lib, diag_msg);
+    }
+
+    return 0;
+}
+
+int tcp_closer_lib_dump_process(struct tcp_closer_lib *lib,
+                                tcp_closer_lib_socket_cb cb, void *user_data)
+{
+    struct nlmsghdr *nlh;
+    struct nlmsgerr *err;
+    int numbytes, retval = 0;
+
+    numbytes = mnl_socket_recvfrom(lib->dump_socket, lib->recv_buf,
+                                   LIB_RECV_BUF_SIZE);
+
+    if (numbytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+
+        lib_log(lib, LOG_ERR, "Receiving dump failed. Error: %s (%u)\n",
+                strerror(errno), errno);
+        return -1;
+    }
+
+    nlh = (struct nlmsghdr*) lib->recv_buf;
+
+    while (mnl_nlmsg_ok(nlh, numbytes)) {
+        if (nlh->nlmsg_type == NLMSG_DONE) {
+            retval = 1;
+            break;
+        }
+
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            err = mnl_nlmsg_get_payload(nlh);
+
+            if (err->error) {
+                lib_log(lib, LOG_ERR, "Error in netlink message (on dump): %s "
+                        "(%u)\n", strerror(-err->error), -err->error);
+                retval = -1;
+                break;
+            }
+        } else if (lib_parse_msg(lib, nlh, cb, user_data) < 0) {
+            retval = -1;
+            break;
+        }
+
+        nlh = mnl_nlmsg_next(nlh, &numbytes);
+    }
+
+    //Send the destroy requests of this part of the dump right away
+    if (tcp_closer_lib_destroy_flush(lib) < 0) {
+        return -1;
+    }
+
+    return retval;
+}
+
+int tcp_closer_lib_destroy_process(struct tcp_closer_lib *lib)
+{
+    struct nlmsghdr *nlh;
+    struct nlmsgerr *err;
+    int numbytes, num_failed = 0;
+
+    numbytes = mnl_socket_recvfrom(lib->destroy_socket, lib->recv_buf,
+                                   LIB_RECV_BUF_SIZE);
+
+    if (numbytes < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ?
+               0 : -1;
+    }
+
+    nlh = (struct nlmsghdr*) lib->recv_buf;
+
+    while (mnl_nlmsg_ok(nlh, numbytes)) {
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            err = mnl_nlmsg_get_payload(nlh);
+
+            if (err->error) {
+                lib_log(lib, LOG_ERR, "Destroying socket failed. Reason: %s "
+                        "(%u)\n", strerror(-err->error), -err->error);
+                num_failed++;
+            }
+        }
+
+        nlh = mnl_nlmsg_next(nlh, &numbytes);
+    }
+
+    return num_failed;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_LIB_H
+#define TCP_CLOSER_LIB_H
+
+//libtcpcloser contains the engine of tcp_closer, so that it can be embedded in
+//other applications. The library never blocks and never creates threads. An
+//application adds the file descriptors returned by tcp_closer_lib_dump_fd()
+//and tcp_closer_lib_destroy_fd() to its own event loop and calls
+//tcp_closer_lib_dump_process()/tcp_closer_lib_destroy_process() when they are
+//readable.
+//
+//All memory is allocated through the allocator in tcp_closer_lib_ops and all
+//log messages go to the log callback (if any).
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/netlink.h>
+#include <linux/inet_diag.h>
+
+//Max number of destroy requests sent in one datagram
+#define TCP_CLOSER_LIB_DESTROY_BATCH 64
+
+//Size of one destroy request (header + request)
+#define TCP_CLOSER_LIB_DESTROY_MSG_SIZE \
+    (NLMSG_ALIGN(sizeof(struct nlmsghdr)) + \
+     NLMSG_ALIGN(sizeof(struct inet_diag_req_v2)))
+
+struct tcp_closer_lib;
+struct inet_diag_bc_op;
+struct inet_diag_msg;
+struct tcp_info;
+
+enum tcp_closer_lib_verdict {
+    TCP_CLOSER_LIB_KEEP = 0,
+    TCP_CLOSER_LIB_DESTROY
+};
+
+typedef void *(*tcp_closer_lib_alloc_cb)(size_t size, void *user_data);
+typedef void (*tcp_closer_lib_free_cb)(void *ptr, void *user_data);
+typedef void (*tcp_closer_lib_log_cb)(int priority, const char *msg,
+                                      void *user_data);
+
+//Called for every socket in a dump. tcpi can be NULL if the kernel did not
+//attach the tcp_info struct. Return TCP_CLOSER_LIB_DESTROY to destroy socket
+typedef int (*tcp_closer_lib_socket_cb)(const struct inet_diag_msg *diag_msg,
+                                        const struct tcp_info *tcpi,
+                                        void *user_data);
+
+//Any callback can be NULL. The default allocator is calloc/free, default is
+//not to log
+struct tcp_closer_lib_ops {
+    tcp_closer_lib_alloc_cb alloc;
+    tcp_closer_lib_free_cb free;
+    tcp_closer_lib_log_cb log;
+    void *user_data;
+};
+
+//Number of bytes needed for a filter matching the given number of ports
+uint32_t tcp_closer_lib_filter_len(uint16_t num_sport, uint16_t num_dport);
+
+//Write a filter that matches sockets with a source port in sports (if any)
+//and a destination port in dports (if any) to filter. filter must be at least
+//tcp_closer_lib_filter_len() bytes
+void tcp_closer_lib_filter_write(struct inet_diag_bc_op *filter,
+                                 const uint16_t *sports, uint16_t num_sport,
+                                 const uint16_t *dports, uint16_t num_dport);
+
+//Allocate and write a filter, the length is stored in filter_len. Free with
+//tcp_closer_lib_free()
+struct inet_diag_bc_op *tcp_closer_lib_filter_compile(struct tcp_closer_lib *lib,
+                                                      const uint16_t *sports,
+                                                      uint16_t num_sport,
+                                                      const uint16_t *dports,
+                                                      uint16_t num_dport,
+                                                      uint32_t *filter_len);
+
+//A socket as seen by the filter. Ports are in host byte order, addresses in
+//network byte order (as in inet_diag_sockid)
+struct tcp_closer_lib_sock {
+    uint32_t saddr[4];
+    uint32_t daddr[4];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t family;
+};
+
+//Check filter with the same rules as the kernel (inet_diag_bc_audit()), so
+//that a broken filter is caught before it is sent. Only the operations used by
+//tcp_closer are supported (port comparisons, host conditions, JMP and NOP)
+bool tcp_closer_lib_filter_audit(const void *filter, uint32_t filter_len);
+
+//Run filter on sock like the kernel does (inet_diag_bc_run()). filter must
+//have passed tcp_closer_lib_filter_audit(). Returns true if sock matches
+bool tcp_closer_lib_filter_run(const void *filter, uint32_t filter_len,
+                               const struct tcp_closer_lib_sock *sock);
+
+//The functions below build and parse the netlink messages of dumps and
+//destroy requests without a library context. tcp_closer uses them with its
+//own sockets and buffers.
+
+//Number of bytes needed for a dump request with a filter of filter_len bytes
+uint32_t tcp_closer_lib_dump_req_len(uint32_t filter_len);
+
+//Write a request for a dump of established TCP sockets of family matching
+//filter (can be NULL) to buf, which must be tcp_closer_lib_dump_req_len()
+//bytes. portid is the port id of the dump socket. Returns the copy of the
+//filter in buf, so that it can be updated without writing the request again
+struct inet_diag_bc_op *tcp_closer_lib_dump_req_write(void *buf, uint32_t portid,
+                                                      uint32_t seq,
+                                                      uint8_t family,
+                                                      const void *filter,
+                                                      uint32_t filter_len);
+
+//Write the parts of a destroy request that are the same for every socket to
+//buf, which must have room for TCP_CLOSER_LIB_DESTROY_MSG_SIZE bytes. portid
+//is the port id of the destroy socket. Returns the length of the request
+uint32_t tcp_closer_lib_destroy_req_init(void *buf, uint32_t portid);
+
+//Set the socket and sequence number of a request written by
+//tcp_closer_lib_destroy_req_init()
+void tcp_closer_lib_destroy_req_set(void *buf,
+                                    const struct inet_diag_msg *diag_msg,
+                                    uint32_t seq);
+
+//Return the tcp_info attached to diag_msg, or NULL if there is none.
+//payload_len is the length of the netlink message payload (diag_msg and
+//attributes)
+struct tcp_info *tcp_closer_lib_diag_info(const struct inet_diag_msg *diag_msg,
+                                          uint32_t payload_len);
+
+//Create/destroy a library context. Opens one netlink socket for dumps and one
+//for destroying sockets. ops is copied and can be NULL
+struct tcp_closer_lib *tcp_closer_lib_create(const struct tcp_closer_lib_ops *ops);
+void tcp_closer_lib_destroy(struct tcp_closer_lib *lib);
+void tcp_closer_lib_free(struct tcp_closer_lib *lib, void *ptr);
+
+int tcp_closer_lib_dump_fd(struct tcp_closer_lib *lib);
+int tcp_closer_lib_destroy_fd(struct tcp_closer_lib *lib);
+
+//Request a dump of established TCP sockets of family matching filter (can be
+//NULL)
+int tcp_closer_lib_dump_start(struct tcp_closer_lib *lib, uint8_t family,
+                              const struct inet_diag_bc_op *filter,
+                              uint32_t filter_len);
+
+//Read and parse the available part of the dump, calling cb for every socket.
+//Sockets cb returns TCP_CLOSER_LIB_DESTROY for are destroyed in batches.
+//Returns 1 when the dump is done, 0 if more data is expected and -1 on error
+int tcp_closer_lib_dump_process(struct tcp_closer_lib *lib,
+                                tcp_closer_lib_socket_cb cb, void *user_data);
+
+//Queue socket for destruction. The queue is sent when it is full, or when
+//tcp_closer_lib_destroy_flush() is called. Returns -1 on error
+int tcp_closer_lib_destroy_queue(struct tcp_closer_lib *lib,
+                                 const struct inet_diag_msg *diag_msg);
+int tcp_closer_lib_destroy_flush(struct tcp_closer_lib *lib);
+
+//Read replies to destroy requests. Returns number of failed requests or -1 on
+//error
+int tcp_closer_lib_destroy_process(struct tcp_closer_lib *lib);
+
+#endif
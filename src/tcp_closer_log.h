@@ -28,25 +28,25 @@
 #define TCP_CLOSER_PRINT(fd, _fmt, ...) \
     do { \
     time_t rawtime; \
-    struct tm *curtime; \
+    struct tm curtime; \
     time(&rawtime); \
-    curtime = gmtime(&rawtime); \
-    TCP_CLOSER_PRINT2(fd, TCP_CLOSER_PREFIX _fmt, curtime->tm_hour, \
-        curtime->tm_min, curtime->tm_sec, curtime->tm_mday, \
-        curtime->tm_mon + 1, 1900 + curtime->tm_year, \
+    gmtime_r(&rawtime, &curtime); \
+    TCP_CLOSER_PRINT2(fd, TCP_CLOSER_PREFIX _fmt, curtime.tm_hour, \
+        curtime.tm_min, curtime.tm_sec, curtime.tm_mday, \
+        curtime.tm_mon + 1, 1900 + curtime.tm_year, \
         ##__VA_ARGS__);} while(0)
 
 #define TCP_CLOSER_PRINT_SYSLOG(ctx, priority, _fmt, ...) \
     do { \
     time_t rawtime; \
-    struct tm *curtime; \
+    struct tm curtime; \
     time(&rawtime); \
-    curtime = gmtime(&rawtime); \
+    gmtime_r(&rawtime, &curtime); \
     if (ctx->use_syslog) \
         TCP_CLOSER_SYSLOG(priority, _fmt, ##__VA_ARGS__); \
     TCP_CLOSER_PRINT2(ctx->logfile, TCP_CLOSER_PREFIX _fmt, \
-        curtime->tm_hour, \
-        curtime->tm_min, curtime->tm_sec, curtime->tm_mday, \
-        curtime->tm_mon + 1, 1900 + curtime->tm_year, \
+        curtime.tm_hour, \
+        curtime.tm_min, curtime.tm_sec, curtime.tm_mday, \
+        curtime.tm_mon + 1, 1900 + curtime.tm_year, \
         ##__VA_ARGS__);} while(0)
 #endif
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+#define MATCH_HAVE_X86 1
+#endif
+
+#include "tcp_closer_match.h"
+
+//All implementations use the same trick: min <= v <= max is the same as
+//(v - min) <= (max - min) with unsigned wrap-around, i.e., one comparison.
+//SSE2/AVX2 only compare signed integers, so both sides are biased by 2^31
+static void match_range_scalar(const uint32_t *values, uint32_t num,
+                               uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    uint32_t range = max - min;
+    uint32_t i;
+
+    memset(bitmap, 0, ((num + 63) / 64) * sizeof(uint64_t));
+
+    for (i = 0; i < num; i++) {
+        bitmap[i / 64] |= (uint64_t) (values[i] - min <= range) << (i % 64);
+    }
+}
+
+#ifdef MATCH_HAVE_X86
+static void match_range_sse2(const uint32_t *values, uint32_t num,
+                             uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    const __m128i bias = _mm_set1_epi32(0x80000000);
+    const __m128i vmin = _mm_set1_epi32(min);
+    const __m128i vrange = _mm_set1_epi32((max - min) ^ 0x80000000);
+    __m128i v, out;
+    uint64_t word = 0;
+    uint32_t i;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        v = _mm_loadu_si128((const __m128i*) (values + i));
+        v = _mm_xor_si128(_mm_sub_epi32(v, vmin), bias);
+        out = _mm_cmpgt_epi32(v, vrange);
+        word |= (uint64_t) (~_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xF) <<
+                (i % 64);
+
+        if (i % 64 == 60) {
+            bitmap[i / 64] = word;
+            word = 0;
+        }
+    }
+
+    for (; i < num; i++) {
+        word |= (uint64_t) (values[i] - min <= max - min) << (i % 64);
+    }
+
+    if (num % 64) {
+        bitmap[num / 64] = word;
+    }
+}
+
+__attribute__((target("avx2")))
+static void match_range_avx2(const uint32_t *values, uint32_t num,
+                             uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    const __m256i bias = _mm256_set1_epi32(0x80000000);
+    const __m256i vmin = _mm256_set1_epi32(min);
+    const __m256i vrange = _mm256_set1_epi32((max - min) ^ 0x80000000);
+    __m256i v, out;
+    uint64_t word = 0;
+    uint32_t i;
+
+    for (i = 0; i + 8 <= num; i += 8) {
+        v = _mm256_loadu_si256((const __m256i*) (values + i));
+        v = _mm256_xor_si256(_mm256_sub_epi32(v, vmin), bias);
+        out = _mm256_cmpgt_epi32(v, vrange);
+        word |= (uint64_t) (~_mm256_movemask_ps(_mm256_castsi256_ps(out)) &
+                            0xFF) << (i % 64);
+
+        if (i % 64 == 56) {
+            bitmap[i / 64] = word;
+            word = 0;
+        }
+    }
+
+    for (; i < num; i++) {
+        word |= (uint64_t) (values[i] - min <= max - min) << (i % 64);
+    }
+
+    if (num % 64) {
+        bitmap[num / 64] = word;
+    }
+}
+#endif
+
+tcp_closer_match_range_cb tcp_closer_match_select_range(void)
+{
+#ifdef MATCH_HAVE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return match_range_avx2;
+    }
+
+    return match_range_sse2;
+#else
+    return match_range_scalar;
+#endif
+}
+
+const char *tcp_closer_match_range_name(tcp_closer_match_range_cb cb)
+{
+#ifdef MATCH_HAVE_X86
+    if (cb == match_range_avx2) {
+        return "AVX2";
+    } else if (cb == match_range_sse2) {
+        return "SSE2";
+    }
+#endif
+
+    return cb == match_range_scalar ? "scalar" : "unknown";
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_MATCH_H
+#define TCP_CLOSER_MATCH_H
+
+#include <stdint.h>
+
+//Set bit i of bitmap if min <= values[i] <= max, and clear it otherwise. The
+//bitmap must have room for num bits rounded up to a multiple of 64
+typedef void (*tcp_closer_match_range_cb)(const uint32_t *values, uint32_t num,
+                                          uint32_t min, uint32_t max,
+                                          uint64_t *bitmap);
+
+//Return the fastest implementation supported by the CPU (AVX2, SSE2 or
+//scalar)
+tcp_closer_match_range_cb tcp_closer_match_select_range(void);
+
+//Name of the implementation, for logging
+const char *tcp_closer_match_range_name(tcp_closer_match_range_cb cb);
+
+#endif
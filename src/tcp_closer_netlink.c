@@ -14,6 +14,7 @@
  * TCP closer. If not, see http://www.gnu.org/licenses/.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -25,9 +26,29 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <linux/tcp.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/capability.h>
 
 #include "tcp_closer_netlink.h"
 #include "tcp_closer_proc.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_control.h"
+#include "tcp_closer_flows.h"
+#include "tcp_closer_peers.h"
+#include "tcp_closer_events.h"
+#include "tcp_closer_exclude.h"
+#include "tcp_closer_arena.h"
+#include "tcp_closer_shm.h"
+#include "tcp_closer_profile.h"
+#include "tcp_closer_idle.h"
+#include "tcp_closer_probes.h"
+#include "tcp_closer_record.h"
+#include "tcp_closer_match.h"
 #include "tcp_closer.h"
 #include "backend_event_loop.h"
 #include "tcp_closer_log.h"
@@ -46,79 +67,167 @@ static const char* tcp_states_map[] = {
     [TCP_CLOSING] = "CLOSING"
 };
 
-int send_diag_msg(struct tcp_closer_ctx *ctx)
+int send_diag_msg_filter(struct tcp_closer_ctx *ctx, uint8_t family,
+                         const void *filter, uint32_t filter_len)
 {
     uint8_t diag_buf[MNL_SOCKET_BUFFER_SIZE];
-    struct nlmsghdr *nlh;
-    struct inet_diag_req_v2 *diag_req;
 
     memset(diag_buf, 0, sizeof(diag_buf));
+    tcp_closer_lib_dump_req_write(diag_buf,
+                                  mnl_socket_get_portid(ctx->diag_dump_socket),
+                                  0, family, filter, filter_len);
+
+    return mnl_socket_sendto(ctx->diag_dump_socket, diag_buf,
+                             ((struct nlmsghdr*) diag_buf)->nlmsg_len);
+}
+
+//The request is built before the first dump, since the filter is not ready
+//when the worker is initialized
+static bool build_dump_req(struct tcp_closer_ctx *ctx)
+{
+    const void *filter = ctx->diag_filter;
+    uint32_t filter_len = ctx->diag_filter_len;
 
-    nlh = mnl_nlmsg_put_header(diag_buf);
-    nlh->nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST | NLM_F_ACK;
-    nlh->nlmsg_type = SOCK_DIAG_BY_FAMILY;
-    nlh->nlmsg_pid = mnl_socket_get_portid(ctx->diag_dump_socket);
+    free(ctx->dump_req);
+    ctx->dump_req_sharded = ctx->use_shard_filter;
 
-    diag_req = mnl_nlmsg_put_extra_header(nlh, sizeof(struct inet_diag_req_v2));
-    //TODO: Add a -4/-6 command line option
-    diag_req->sdiag_family = ctx->socket_family;
-    diag_req->sdiag_protocol = IPPROTO_TCP;
+    if (ctx->use_shard_filter) {
+        filter = ctx->shard_filter;
+        filter_len += sizeof(struct inet_diag_bc_op) * SCHED_SHARD_FILTER_OPS;
+    }
+
+    ctx->dump_req = calloc(tcp_closer_lib_dump_req_len(filter_len), 1);
 
-    //We are only interested in established connections and need the tcp-info
-    //struct
-    diag_req->idiag_ext |= (1 << (INET_DIAG_INFO - 1));
-    diag_req->idiag_states = 1 << TCP_ESTABLISHED;
+    if (!ctx->dump_req) {
+        return false;
+    }
 
-    mnl_attr_put(nlh, INET_DIAG_REQ_BYTECODE, ctx->diag_filter_len,
-                 ctx->diag_filter);
+    ctx->dump_req_filter = tcp_closer_lib_dump_req_write(ctx->dump_req,
+            mnl_socket_get_portid(ctx->diag_dump_socket), 0,
+            ctx->socket_family, filter, filter_len);
+    ctx->dump_req_len = ((struct nlmsghdr*) ctx->dump_req)->nlmsg_len;
 
-    return mnl_socket_sendto(ctx->diag_dump_socket, diag_buf, nlh->nlmsg_len);
+    return true;
 }
 
-static void destroy_socket(struct tcp_closer_ctx *ctx,
-                           struct inet_diag_msg *diag_msg)
+int send_diag_msg(struct tcp_closer_ctx *ctx)
 {
-#ifndef NO_SOCK_DESTROY
-    uint8_t destroy_buf[MNL_SOCKET_BUFFER_SIZE];
-    struct nlmsghdr *nlh;
-    struct inet_diag_req_v2 *destroy_req;
+    if ((!ctx->dump_req || ctx->dump_req_sharded != ctx->use_shard_filter) &&
+        !build_dump_req(ctx)) {
+        errno = ENOMEM;
+        return -1;
+    }
 
-    memset(destroy_buf, 0, sizeof(destroy_buf));
+    //The shard prefix is rewritten by the scheduler before every dump
+    if (ctx->use_shard_filter) {
+        memcpy(ctx->dump_req_filter, ctx->shard_filter,
+               sizeof(struct inet_diag_bc_op) * SCHED_SHARD_FILTER_OPS);
+    }
 
-    nlh = mnl_nlmsg_put_header(destroy_buf);
-    nlh->nlmsg_pid = mnl_socket_get_portid(ctx->diag_destroy_socket);
-    nlh->nlmsg_type = SOCK_DESTROY;
-    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    return mnl_socket_sendto(ctx->diag_dump_socket, ctx->dump_req,
+                             ctx->dump_req_len);
+}
 
-    destroy_req = mnl_nlmsg_put_extra_header(nlh,
-                                             sizeof(struct inet_diag_req_v2));
-    //TODO: Add 4/6 flag to command line
-    destroy_req->sdiag_family = diag_msg->idiag_family;
-    destroy_req->sdiag_protocol = IPPROTO_TCP;
+static inline uint8_t *destroy_slot_buf(struct tcp_closer_ctx *ctx)
+{
+    return ctx->destroy_buf + (ctx->destroy_slot * DESTROY_BATCH_SIZE *
+                               DESTROY_MSG_SIZE);
+}
 
-    //Copy ID from diag_msg returned by kernel
-    destroy_req->id = diag_msg->id;
+static void destroy_batch_done(struct tcp_closer_ctx *ctx, ssize_t numbytes)
+{
+    if (numbytes < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Sending destroy requests "
+                                "failed. Error: %s (%u)\n", strerror(errno),
+                                errno);
+    } else {
+        TCP_CLOSER_STATS_ADD(ctx, destroy_sent, numbytes / DESTROY_MSG_SIZE);
+    }
+}
 
-    mnl_socket_sendto(ctx->diag_destroy_socket, destroy_buf, nlh->nlmsg_len);
-#endif
+//Send the queued destroy requests in one datagram. The kernel acks each
+//request separately.
+//
+//With io_uring, the batch is sent together with the next wait for events and
+//the following batch is written to the next slot. The kernel handles netlink
+//requests while they are sent, so the sends complete in order and the oldest
+//slot is free again when a send completes. If the next slot is still queued,
+//the batch is sent right away instead
+static void flush_destroy_batch(struct tcp_closer_ctx *ctx)
+{
+    uint32_t len = ctx->destroy_batch_len * DESTROY_MSG_SIZE;
+
+    TCP_CLOSER_PROFILE_ENTER(ctx, PROFILE_DESTROY);
+    TCP_CLOSER_PROBE1(destroy__send, ctx->destroy_batch_len);
+
+    if (ctx->destroy_sends < DESTROY_SEND_SLOTS - 1 &&
+        !backend_event_loop_send(ctx->event_loop, ctx->destroy_handle,
+                                 destroy_slot_buf(ctx), len)) {
+        ctx->destroy_sends++;
+        ctx->destroy_slot = (ctx->destroy_slot + 1) % DESTROY_SEND_SLOTS;
+    } else {
+        destroy_batch_done(ctx, mnl_socket_sendto(ctx->diag_destroy_socket,
+                                                  destroy_slot_buf(ctx), len));
+    }
+
+    ctx->destroy_batch_len = 0;
+    TCP_CLOSER_PROFILE_LEAVE(ctx);
+}
+
+void destroy_batch_sent(void *data, int32_t res)
+{
+    struct tcp_closer_ctx *ctx = data;
+
+    ctx->destroy_sends--;
+
+    if (res < 0) {
+        errno = -res;
+    }
+
+    destroy_batch_done(ctx, res);
 }
 
-static void parse_diag_msg(struct tcp_closer_ctx *ctx,
+//The requests in destroy_buf are preformatted by tcp_closer_netlink_init_recv(),
+//so only the family, socket id and sequence number are written here
+static void destroy_socket(struct tcp_closer_ctx *ctx,
                            struct inet_diag_msg *diag_msg,
-                           int payload_len)
+                           uint32_t last_data_recv)
 {
-    struct nlattr *attr;
-    struct tcp_info *tcpi = NULL;
-    char local_addr_buf[INET6_ADDRSTRLEN];
-    char remote_addr_buf[INET6_ADDRSTRLEN];
-    struct passwd *uid_info = NULL;
+#ifndef NO_SOCK_DESTROY
+    struct tcp_closer_destroy_pending *pending;
+    uint64_t idle_start = 0;
+
+    //last_data_recv is sampled by the kernel when the datagram is generated,
+    //which is right before we receive it. The idle-to-destroy latency is
+    //recorded when the request is acked
+    if (last_data_recv >= ctx->idle_time &&
+        last_data_recv <= ctx->match_max_idle && !ctx->control_scan) {
+        idle_start = ctx->dump_last_recv - (last_data_recv - ctx->idle_time);
+    }
+
+    tcp_closer_lib_destroy_req_set(destroy_slot_buf(ctx) +
+                                   ctx->destroy_batch_len * DESTROY_MSG_SIZE,
+                                   diag_msg, ++ctx->destroy_seq);
 
-    memset(local_addr_buf, 0, sizeof(local_addr_buf));
-    memset(remote_addr_buf, 0, sizeof(remote_addr_buf));
+    pending = &(ctx->destroy_pending[ctx->destroy_seq &
+                                     (DESTROY_PENDING_SIZE - 1)]);
+    pending->seq = ctx->destroy_seq;
+    pending->inode = diag_msg->idiag_inode;
+    pending->idle_start = idle_start;
 
-    //(Try to) Get user info
-    uid_info = getpwuid(diag_msg->idiag_uid);
+    if (__builtin_expect(ctx->profile != NULL, 0)) {
+        ctx->profile->dump.destroys++;
+    }
+
+    if (++ctx->destroy_batch_len == DESTROY_BATCH_SIZE) {
+        flush_destroy_batch(ctx);
+    }
+#endif
+}
 
+static void format_diag_addrs(struct inet_diag_msg *diag_msg,
+                              char *local_addr_buf, char *remote_addr_buf)
+{
     if(diag_msg->idiag_family == AF_INET){
         inet_ntop(AF_INET, (struct in_addr*) &(diag_msg->id.idiag_src), 
             local_addr_buf, INET_ADDRSTRLEN);
@@ -130,97 +239,425 @@ static void parse_diag_msg(struct tcp_closer_ctx *ctx,
         inet_ntop(AF_INET6, (struct in_addr6*) &(diag_msg->id.idiag_dst),
                 remote_addr_buf, INET6_ADDRSTRLEN);
     }
+}
 
-    attr = (struct nlattr*) (diag_msg+1);
-    payload_len -= sizeof(struct inet_diag_msg);
+static void output_diag_msg(struct tcp_closer_ctx *ctx,
+                            struct inet_diag_msg *diag_msg,
+                            struct tcp_info *tcpi)
+{
+    char local_addr_buf[INET6_ADDRSTRLEN] = {0};
+    char remote_addr_buf[INET6_ADDRSTRLEN] = {0};
+    struct passwd uid_buf, *uid_info = NULL;
+    char uid_str_buf[1024];
 
-    while(mnl_attr_ok(attr, payload_len)){
-        if (attr->nla_type != INET_DIAG_INFO) {
-            payload_len -= attr->nla_len;
-            attr = mnl_attr_next(attr);
-            continue;
-        }
+    //(Try to) Get user info. Use the reentrant version, since several workers
+    //might parse messages at the same time
+    getpwuid_r(diag_msg->idiag_uid, &uid_buf, uid_str_buf, sizeof(uid_str_buf),
+               &uid_info);
+    format_diag_addrs(diag_msg, local_addr_buf, remote_addr_buf);
 
-        tcpi = (struct tcp_info*) mnl_attr_get_payload(attr);
-        break;
-    }
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Found connection:\n");
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "User: %s (UID: %u) Src: %s:%d "
+                            "Dst: %s:%d\n",
+                            uid_info == NULL ? "Not found" : 
+                                                uid_info->pw_name,
+                            diag_msg->idiag_uid, local_addr_buf,
+                            ntohs(diag_msg->id.idiag_sport),
+                            remote_addr_buf,
+                            ntohs(diag_msg->id.idiag_dport));
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "\tState: %s RTT: %gms "
+                            "(var. %gms) Recv. RTT: %gms Snd_cwnd: %u/%u "
+                            "Last_data_recv: %ums ago\n",
+                            tcp_states_map[tcpi->tcpi_state],
+                            (double) tcpi->tcpi_rtt/1000,
+                            (double) tcpi->tcpi_rttvar/1000,
+                            (double) tcpi->tcpi_rcv_rtt/1000,
+                            tcpi->tcpi_unacked,
+                            tcpi->tcpi_snd_cwnd,
+                            tcpi->tcpi_last_data_recv);
+}
 
-    //No need to check for tcpi, if it could not be attached then message would
-    //not be send from kernel
+//Handle a socket that matched. Inlined into every PARSE_BATCH_VARIANT(), where
+//log and action are constants, so each variant only contains the code for its
+//log level and action. The addresses are only formatted when the match is
+//logged
+static inline __attribute__((always_inline)) void handle_match(
+        struct tcp_closer_ctx *ctx, struct inet_diag_msg *diag_msg,
+        uint32_t last_data_recv, const bool log, const uint8_t action)
+{
+    char local_addr_buf[INET6_ADDRSTRLEN] = {0};
+    char remote_addr_buf[INET6_ADDRSTRLEN] = {0};
 
-    if (ctx->verbose_mode) {
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Found connection:\n");
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "User: %s (UID: %u) Src: %s:%d "
-                                "Dst: %s:%d\n",
-                                uid_info == NULL ? "Not found" : 
-                                                    uid_info->pw_name,
-                                diag_msg->idiag_uid, local_addr_buf,
+    TCP_CLOSER_PROBE4(socket__match, ntohs(diag_msg->id.idiag_sport),
+                      ntohs(diag_msg->id.idiag_dport), last_data_recv, action);
+
+    if (log) {
+        TCP_CLOSER_PROFILE_ENTER(ctx, PROFILE_LOG);
+        format_diag_addrs(diag_msg, local_addr_buf, remote_addr_buf);
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%s src: %s:%d dst: %s:%d "
+                                "last_data_recv: %ums\n",
+                                action == PARSE_ACTION_DRY_RUN ?
+                                    "Would destroy" : "Will destroy",
+                                local_addr_buf,
                                 ntohs(diag_msg->id.idiag_sport),
                                 remote_addr_buf,
-                                ntohs(diag_msg->id.idiag_dport));
-        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "\tState: %s RTT: %gms "
-                                "(var. %gms) Recv. RTT: %gms Snd_cwnd: %u/%u "
-                                "Last_data_recv: %ums ago\n",
-                                tcp_states_map[tcpi->tcpi_state],
-                                (double) tcpi->tcpi_rtt/1000,
-                                (double) tcpi->tcpi_rttvar/1000,
-                                (double) tcpi->tcpi_rcv_rtt/1000,
-                                tcpi->tcpi_unacked,
-                                tcpi->tcpi_snd_cwnd,
-                                tcpi->tcpi_last_data_recv);
-    }
-
-    //tcp_last_ack_recv can be updated by for example a proxy replying to TCP
-    //keep-alives, so we only check tcpi_last_data_recv. This timer keeps track
-    //of actual data going through the connection
-    if (ctx->idle_time && tcpi->tcpi_last_data_recv < ctx->idle_time) {
+                                ntohs(diag_msg->id.idiag_dport),
+                                last_data_recv);
+        TCP_CLOSER_PROFILE_LEAVE(ctx);
+    }
+
+    if (ctx->events) {
+        tcp_closer_events_destroy(ctx, diag_msg, last_data_recv);
+    }
+
+    //SHM_ACTION_* has the same values as PARSE_ACTION_*
+    if (ctx->shm && !ctx->control_scan) {
+        tcp_closer_shm_match(ctx, diag_msg, last_data_recv, action);
+    }
+
+    ctx->dump_matched++;
+    TCP_CLOSER_STATS_ADD(ctx, sockets_matched, 1);
+
+    if (action == PARSE_ACTION_NETLINK) {
+        destroy_socket(ctx, diag_msg, last_data_recv);
+    } else if (action == PARSE_ACTION_PROC) {
+        tcp_closer_proc_queue(ctx, diag_msg->idiag_inode);
+    }
+}
+
+//Called by tcp_closer_peers_flush() for every socket to destroy
+static void handle_peer_match(struct tcp_closer_ctx *ctx,
+                              struct inet_diag_msg *diag_msg,
+                              uint32_t last_data_recv, bool log)
+{
+    uint8_t action;
+
+    if (ctx->dry_run) {
+        action = PARSE_ACTION_DRY_RUN;
+    } else if (ctx->use_netlink) {
+        action = PARSE_ACTION_NETLINK;
+    } else {
+        action = PARSE_ACTION_PROC;
+    }
+
+    handle_match(ctx, diag_msg, last_data_recv, log && !ctx->quiet_mode,
+                 action);
+}
+
+static void run_parse_batch(struct tcp_closer_ctx *ctx)
+{
+    if (__builtin_expect(ctx->profile != NULL, 0)) {
+        ctx->profile->dump.sockets += ctx->batch->num;
+    }
+
+    TCP_CLOSER_PROFILE_ENTER(ctx, PROFILE_PARSE);
+    ctx->parse_batch(ctx);
+    TCP_CLOSER_PROFILE_LEAVE(ctx);
+}
+
+void tcp_closer_netlink_add_socket(struct tcp_closer_ctx *ctx,
+                                   struct inet_diag_msg *diag_msg,
+                                   struct tcp_info *tcpi)
+{
+    struct tcp_closer_batch *batch = ctx->batch;
+
+    batch->msgs[batch->num] = diag_msg;
+    batch->tcpi[batch->num] = tcpi;
+    batch->last_data_recv[batch->num] = tcpi->tcpi_last_data_recv;
+
+    if (++batch->num == BATCH_MAX_SOCKETS) {
+        run_parse_batch(ctx);
+    }
+}
+
+//Stage one of parsing a datagram: decode the socket messages into the columns
+//of the batch. The rules are evaluated for all sockets of the datagram at once
+//by parse_batch_tmpl()
+static void batch_add(struct tcp_closer_ctx *ctx,
+                      struct inet_diag_msg *diag_msg, int payload_len)
+{
+    struct tcp_info *tcpi = tcp_closer_lib_diag_info(diag_msg, payload_len);
+
+    //We always request INET_DIAG_INFO, if it could not be attached then message
+    //would not be send from kernel. Check anyway, so that a malformed message
+    //can't crash us
+    if (!tcpi) {
         return;
     }
 
-    if (ctx->last_data_recv_limit && tcpi->tcpi_last_data_recv >=
-        ctx->last_data_recv_limit) {
+    tcp_closer_netlink_add_socket(ctx, diag_msg, tcpi);
+}
+
+//Socket i of the batch, when exclusions, flows, peers or verbose output are
+//enabled
+static inline __attribute__((always_inline)) void parse_batch_socket(
+        struct tcp_closer_ctx *ctx, struct tcp_closer_batch *batch, uint32_t i,
+        const uint8_t log_level, const uint8_t action)
+{
+    struct inet_diag_msg *diag_msg = batch->msgs[i];
+    uint32_t last_data_recv = batch->last_data_recv[i];
+    uint64_t flow_age;
+    bool idle = (batch->idle[i / 64] >> (i % 64)) & 1;
+
+    if (log_level == PARSE_LOG_VERBOSE) {
+        output_diag_msg(ctx, diag_msg, batch->tcpi[i]);
+    }
+
+    if (ctx->exclude && tcp_closer_exclude_match(ctx, diag_msg)) {
         return;
     }
 
-    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Will destroy src: %s:%d dst: %s:%d "
-                            "last_data_recv: %ums\n", local_addr_buf,
-                            ntohs(diag_msg->id.idiag_sport), remote_addr_buf,
-                            ntohs(diag_msg->id.idiag_dport),
-                            tcpi->tcpi_last_data_recv);
+    //tcpi_last_data_recv is bogus until the first data has been received
+    //(--last_recv_limit). If the flow table has known the socket for longer
+    //than idle_time, then no data has been received during that time either
+    if (ctx->flows && !ctx->control_scan) {
+        flow_age = tcp_closer_flows_update(ctx, diag_msg);
 
-    if (ctx->use_netlink) {
-        destroy_socket(ctx, diag_msg);
+        if (!idle && ctx->idle_time && last_data_recv >= ctx->match_min_idle &&
+            flow_age >= ctx->idle_time) {
+            idle = true;
+        }
+    }
+
+    //With peer aggregation, the decision is made when the dump is done
+    if (ctx->peers && !ctx->control_scan) {
+        tcp_closer_peers_add(ctx, diag_msg, last_data_recv, idle);
+        return;
+    }
+
+    if (!idle) {
+        return;
+    }
+
+    handle_match(ctx, diag_msg, last_data_recv, log_level != PARSE_LOG_QUIET,
+                 action);
+}
+
+//Stage two: evaluate the idle limits for the whole batch with a vectorized
+//kernel (see tcp_closer_match.c), which produces a bitmap of idle sockets.
+//
+//tcp_last_ack_recv can be updated by for example a proxy replying to TCP
+//keep-alives, so we only check tcpi_last_data_recv. This timer keeps track
+//of actual data going through the connection. The limits are computed by
+//tcp_closer_netlink_select_parser(), so that no check is needed for
+//whether they are set.
+//
+//log_level and action are always constants, so every variant generated by
+//PARSE_BATCH_VARIANT() below only contains the code it needs. The variant
+//is selected once by tcp_closer_netlink_select_parser()
+static inline __attribute__((always_inline)) void parse_batch_tmpl(
+        struct tcp_closer_ctx *ctx, const uint8_t log_level,
+        const uint8_t action)
+{
+    struct tcp_closer_batch *batch = ctx->batch;
+    uint64_t word;
+    uint32_t i, w;
+
+    ctx->match_range(batch->last_data_recv, batch->num, ctx->match_min_idle,
+                     ctx->match_max_idle, batch->idle);
+
+    if (ctx->idle && !ctx->control_scan) {
+        tcp_closer_idle_add_batch(ctx);
+    }
+
+    if (log_level == PARSE_LOG_VERBOSE || ctx->exclude || ctx->flows ||
+        ctx->peers) {
+        for (i = 0; i < batch->num; i++) {
+            parse_batch_socket(ctx, batch, i, log_level, action);
+        }
     } else {
-        destroy_socket_proc(ctx, diag_msg->idiag_inode);
+        //Only the idle sockets are visited
+        for (w = 0; w < (batch->num + 63) / 64; w++) {
+            for (word = batch->idle[w]; word; word &= word - 1) {
+                i = (w * 64) + __builtin_ctzll(word);
+                handle_match(ctx, batch->msgs[i], batch->last_data_recv[i],
+                             log_level != PARSE_LOG_QUIET, action);
+            }
+        }
     }
+
+    batch->num = 0;
 }
 
-void recv_diag_msg(void *data, int32_t fd, uint32_t events)
+#define PARSE_BATCH_VARIANT(name, log_level, action) \
+    static void name(struct tcp_closer_ctx *ctx) \
+    { \
+        parse_batch_tmpl(ctx, log_level, action); \
+    }
+
+PARSE_BATCH_VARIANT(parse_quiet_netlink, PARSE_LOG_QUIET, PARSE_ACTION_NETLINK)
+PARSE_BATCH_VARIANT(parse_quiet_proc, PARSE_LOG_QUIET, PARSE_ACTION_PROC)
+PARSE_BATCH_VARIANT(parse_quiet_dry_run, PARSE_LOG_QUIET, PARSE_ACTION_DRY_RUN)
+PARSE_BATCH_VARIANT(parse_match_netlink, PARSE_LOG_MATCH, PARSE_ACTION_NETLINK)
+PARSE_BATCH_VARIANT(parse_match_proc, PARSE_LOG_MATCH, PARSE_ACTION_PROC)
+PARSE_BATCH_VARIANT(parse_match_dry_run, PARSE_LOG_MATCH, PARSE_ACTION_DRY_RUN)
+PARSE_BATCH_VARIANT(parse_verbose_netlink, PARSE_LOG_VERBOSE, PARSE_ACTION_NETLINK)
+PARSE_BATCH_VARIANT(parse_verbose_proc, PARSE_LOG_VERBOSE, PARSE_ACTION_PROC)
+PARSE_BATCH_VARIANT(parse_verbose_dry_run, PARSE_LOG_VERBOSE, PARSE_ACTION_DRY_RUN)
+
+static const parse_batch_cb parse_batch_variants[PARSE_LOG_MAX][PARSE_ACTION_MAX] = {
+    [PARSE_LOG_QUIET] = {
+        [PARSE_ACTION_NETLINK] = parse_quiet_netlink,
+        [PARSE_ACTION_PROC] = parse_quiet_proc,
+        [PARSE_ACTION_DRY_RUN] = parse_quiet_dry_run
+    },
+    [PARSE_LOG_MATCH] = {
+        [PARSE_ACTION_NETLINK] = parse_match_netlink,
+        [PARSE_ACTION_PROC] = parse_match_proc,
+        [PARSE_ACTION_DRY_RUN] = parse_match_dry_run
+    },
+    [PARSE_LOG_VERBOSE] = {
+        [PARSE_ACTION_NETLINK] = parse_verbose_netlink,
+        [PARSE_ACTION_PROC] = parse_verbose_proc,
+        [PARSE_ACTION_DRY_RUN] = parse_verbose_dry_run
+    }
+};
+
+void tcp_closer_netlink_select_parser(struct tcp_closer_ctx *ctx)
 {
-    struct tcp_closer_ctx *ctx = data;
-    struct nlmsghdr *nlh;
+    uint8_t log_level, action;
+
+    if (ctx->verbose_mode) {
+        log_level = PARSE_LOG_VERBOSE;
+    } else if (ctx->quiet_mode) {
+        log_level = PARSE_LOG_QUIET;
+    } else {
+        log_level = PARSE_LOG_MATCH;
+    }
+
+    if (ctx->dry_run) {
+        action = PARSE_ACTION_DRY_RUN;
+    } else if (ctx->use_netlink) {
+        action = PARSE_ACTION_NETLINK;
+    } else {
+        action = PARSE_ACTION_PROC;
+    }
+
+    ctx->parse_batch = parse_batch_variants[log_level][action];
+    ctx->match_range = tcp_closer_match_select_range();
+
+    //Scans requested through the control socket destroy every socket matching
+    //the filter. last_data_recv_limit is validated to be non-zero when set
+    if (ctx->control_scan) {
+        ctx->match_min_idle = 0;
+        ctx->match_max_idle = UINT32_MAX;
+    } else {
+        ctx->match_min_idle = ctx->idle_time;
+        ctx->match_max_idle = ctx->last_data_recv_limit ?
+                              ctx->last_data_recv_limit - 1 : UINT32_MAX;
+    }
+}
+
+//Close the sockets queued for /proc and free what was allocated for the dump.
+//Done at the end of every dump, also when the kernel ended it with an error
+static void dump_release(struct tcp_closer_ctx *ctx)
+{
+    tcp_closer_proc_flush(ctx);
+
+    //Nothing allocated for the dump is used after this point
+    tcp_closer_arena_reset(ctx->arena);
+}
+
+static void dump_done(struct tcp_closer_ctx *ctx)
+{
+    if (ctx->peers && !ctx->control_scan) {
+        tcp_closer_peers_flush(ctx, handle_peer_match);
+    }
+
+    dump_release(ctx);
+
+    if (ctx->control_scan) {
+        tcp_closer_control_scan_done(ctx, 0);
+        return;
+    }
+
+    if (ctx->flows) {
+        tcp_closer_flows_dump_done(ctx);
+    }
+
+    tcp_closer_sched_dump_done(ctx);
+
+    if (ctx->events) {
+        tcp_closer_events_dump(ctx);
+    }
+
+    if (ctx->record) {
+        tcp_closer_record_flush(ctx);
+    }
+
+    if (ctx->shm) {
+        tcp_closer_shm_dump_done(ctx);
+    }
+
+    if (ctx->idle) {
+        tcp_closer_idle_dump_done(ctx);
+    }
+
+    if (ctx->profile) {
+        tcp_closer_profile_dump_done(ctx);
+    }
+
+    tcp_closer_control_dump_done(ctx);
+    if (!ctx->dump_interval) {
+        backend_event_loop_stop(ctx->event_loop);
+    }
+}
+
+void tcp_closer_netlink_end_dump(struct tcp_closer_ctx *ctx)
+{
+    if (ctx->batch->num) {
+        run_parse_batch(ctx);
+    }
+
+    dump_done(ctx);
+
+    if (ctx->destroy_batch_len) {
+        flush_destroy_batch(ctx);
+    }
+}
+
+//Returns true when the dump is finished
+static bool parse_dump_datagram(struct tcp_closer_ctx *ctx, uint8_t *buf,
+                                int32_t numbytes)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr*) buf;
     struct nlmsgerr *err;
-    uint8_t recv_buf[MNL_SOCKET_BUFFER_SIZE];
     struct inet_diag_msg *diag_msg;
-    int32_t numbytes, payload_len;
-
-    numbytes = mnl_socket_recvfrom(ctx->diag_dump_socket, recv_buf,
-                                   sizeof(recv_buf));
-    nlh = (struct nlmsghdr*) recv_buf;
+    int32_t payload_len;
 
     while(mnl_nlmsg_ok(nlh, numbytes)){
+        //DONE and ERROR are the last message of a dump, so the sockets before
+        //them are handled first
+        if ((nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR) &&
+            ctx->batch->num) {
+            run_parse_batch(ctx);
+        }
+
         if(nlh->nlmsg_type == NLMSG_DONE) {
-            ctx->dump_in_progress = false;
-            if (!ctx->dump_interval) {
-                backend_event_loop_stop(ctx->event_loop);
-            }
-            break;
+            dump_done(ctx);
+            return true;
         }
 
         if(nlh->nlmsg_type == NLMSG_ERROR){
-            ctx->dump_in_progress = false;
             err = mnl_nlmsg_get_payload(nlh);
 
+            if (ctx->control_scan) {
+                dump_release(ctx);
+                tcp_closer_control_scan_done(ctx, -err->error);
+                nlh = mnl_nlmsg_next(nlh, &numbytes);
+                continue;
+            }
+
+            //The dump is incomplete, so the peer counts can't be trusted
+            if (ctx->peers) {
+                tcp_closer_peers_reset(ctx);
+            }
+
+            dump_release(ctx);
+
+            tcp_closer_sched_dump_done(ctx);
+            tcp_closer_control_dump_done(ctx);
+
             if (err->error) {
                 TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Error in netlink "
                                         "message (on dump): %s (%u)\n",
@@ -238,46 +675,482 @@ void recv_diag_msg(void *data, int32_t fd, uint32_t events)
             continue;
         }
 
-        //TODO: Switch these to mnl too
         diag_msg = mnl_nlmsg_get_payload(nlh);
         payload_len = mnl_nlmsg_get_payload_len(nlh);
-        parse_diag_msg(ctx, diag_msg, payload_len);
+        batch_add(ctx, diag_msg, payload_len);
 
         nlh = mnl_nlmsg_next(nlh, &numbytes);
     }
+
+    if (ctx->batch->num) {
+        run_parse_batch(ctx);
+    }
+
+    return false;
 }
 
-void recv_destroy_msg(void *data, int32_t fd, uint32_t events)
+bool tcp_closer_netlink_parse_datagram(struct tcp_closer_ctx *ctx,
+                                       uint8_t *buf, int32_t numbytes)
+{
+    return parse_dump_datagram(ctx, buf, numbytes);
+}
+
+//Everything except family, socket id and sequence number is the same for all
+//destroy requests
+static bool init_destroy_batch(struct tcp_closer_ctx *ctx)
+{
+    uint32_t portid;
+    uint16_t i;
+
+    ctx->destroy_buf = calloc(DESTROY_SEND_SLOTS * DESTROY_BATCH_SIZE,
+                              DESTROY_MSG_SIZE);
+    ctx->destroy_pending = calloc(DESTROY_PENDING_SIZE,
+                                  sizeof(struct tcp_closer_destroy_pending));
+    ctx->destroy_ack_buf = calloc(DESTROY_ACK_NUM_SLOTS,
+                                  DESTROY_ACK_SLOT_SIZE);
+
+    if (!ctx->destroy_buf || !ctx->destroy_pending || !ctx->destroy_ack_buf) {
+        return false;
+    }
+
+    portid = mnl_socket_get_portid(ctx->diag_destroy_socket);
+
+    for (i = 0; i < DESTROY_SEND_SLOTS * DESTROY_BATCH_SIZE; i++) {
+        tcp_closer_lib_destroy_req_init(ctx->destroy_buf +
+                                        (i * DESTROY_MSG_SIZE), portid);
+    }
+
+    return true;
+}
+
+bool tcp_closer_netlink_init_recv(struct tcp_closer_ctx *ctx)
+{
+    uint16_t i;
+
+    ctx->recv_buf = mmap(NULL, RECV_SLOT_SIZE * RECV_NUM_SLOTS,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    if (ctx->recv_buf == MAP_FAILED) {
+        ctx->recv_buf = NULL;
+        return false;
+    }
+
+    ctx->recv_iovs = calloc(RECV_NUM_SLOTS, sizeof(struct iovec));
+    ctx->recv_msgs = calloc(RECV_NUM_SLOTS, sizeof(struct mmsghdr));
+
+    if (!ctx->recv_iovs || !ctx->recv_msgs) {
+        return false;
+    }
+
+    for (i = 0; i < RECV_NUM_SLOTS; i++) {
+        ctx->recv_iovs[i].iov_base = ctx->recv_buf + (i * RECV_SLOT_SIZE);
+        ctx->recv_iovs[i].iov_len = RECV_SLOT_SIZE;
+        ctx->recv_msgs[i].msg_hdr.msg_iov = &(ctx->recv_iovs[i]);
+        ctx->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    ctx->batch = calloc(sizeof(struct tcp_closer_batch), 1);
+
+    if (!ctx->batch) {
+        return false;
+    }
+
+    return init_destroy_batch(ctx);
+}
+
+//SO_RCVBUFFORCE ignores net.core.rmem_max, but requires CAP_NET_ADMIN
+static void set_rcvbuf(int fd, uint32_t size)
+{
+    int val = size;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val))) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+    }
+}
+
+void tcp_closer_netlink_set_rcvbuf(struct tcp_closer_ctx *ctx, int fd)
+{
+    if (ctx->rcvbuf_size) {
+        set_rcvbuf(fd, ctx->rcvbuf_size);
+    }
+}
+
+void tcp_closer_netlink_set_destroy_rcvbuf(struct tcp_closer_ctx *ctx)
+{
+    if (ctx->rcvbuf_size < DESTROY_RCVBUF) {
+        set_rcvbuf(mnl_socket_get_fd(ctx->diag_destroy_socket),
+                   DESTROY_RCVBUF);
+    }
+}
+
+//The receive buffer of one of the sockets overflowed. Double the buffer of
+//both sockets. The kernel reports twice the size we set (it includes the
+//overhead), and limits the size to rmem_max without SO_RCVBUFFORCE
+static void handle_overrun(struct tcp_closer_ctx *ctx, int fd)
+{
+    uint32_t old_size = ctx->rcvbuf_size;
+    int cur_size = 0;
+    socklen_t len = sizeof(cur_size);
+
+    TCP_CLOSER_STATS_ADD(ctx, overruns, 1);
+
+    if (!old_size) {
+        getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cur_size, &len);
+        old_size = cur_size / 2;
+    }
+
+    if (old_size >= NETLINK_MAX_RCVBUF) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Netlink receive buffer "
+                                "overrun, buffer is already %u bytes\n",
+                                old_size);
+        return;
+    }
+
+    set_rcvbuf(mnl_socket_get_fd(ctx->diag_dump_socket), old_size * 2);
+    set_rcvbuf(mnl_socket_get_fd(ctx->diag_destroy_socket),
+               old_size * 2 > DESTROY_RCVBUF ? old_size * 2 : DESTROY_RCVBUF);
+
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cur_size, &len);
+    ctx->rcvbuf_size = cur_size / 2;
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Netlink receive buffer overrun, "
+                            "buffer size %u -> %u bytes\n", old_size,
+                            ctx->rcvbuf_size);
+}
+
+//The kernel produces the next part of a dump every time we read from the
+//socket, so with recvmmsg() we get several datagrams per system call. The
+//datagrams are received straight into a buffer that is reused for every dump
+//and parsed in place
+void recv_diag_msg(void *data, int32_t fd, uint32_t events)
 {
     struct tcp_closer_ctx *ctx = data;
+    int32_t num_msgs, i;
+
+    TCP_CLOSER_PROFILE_ENTER(ctx, PROFILE_RECV);
+    num_msgs = recvmmsg(fd, ctx->recv_msgs, RECV_NUM_SLOTS, MSG_WAITFORONE,
+                        NULL);
+    TCP_CLOSER_PROFILE_LEAVE(ctx);
+
+    //The kernel keeps the position of the dump when it runs out of buffer
+    //space, so the dump continues on the next read. If it does not, the dump
+    //watchdog restarts it
+    if (num_msgs < 0 && errno == ENOBUFS) {
+        handle_overrun(ctx, fd);
+        return;
+    }
+
+    if (num_msgs <= 0) {
+        return;
+    }
+
+    ctx->dump_last_recv = backend_get_time_ms();
+
+    TCP_CLOSER_STATS_ADD(ctx, recv_calls, 1);
+    TCP_CLOSER_STATS_ADD(ctx, datagrams, num_msgs);
+
+    for (i = 0; i < num_msgs; i++) {
+        TCP_CLOSER_PROBE1(datagram__recv, ctx->recv_msgs[i].msg_len);
+
+        //A slot is as large as the largest datagram the kernel will create for
+        //a dump, so this should never happen
+        if (ctx->recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            TCP_CLOSER_STATS_ADD(ctx, datagrams_truncated, 1);
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Truncated dump datagram "
+                                    "(%u bytes)\n", ctx->recv_msgs[i].msg_len);
+        }
+
+        if (ctx->record) {
+            tcp_closer_record_add(ctx, RECORD_TYPE_DUMP,
+                                  ctx->recv_iovs[i].iov_base,
+                                  ctx->recv_msgs[i].msg_len);
+        }
+
+        if (parse_dump_datagram(ctx, ctx->recv_iovs[i].iov_base,
+                                ctx->recv_msgs[i].msg_len)) {
+            break;
+        }
+    }
+
+    //Don't hold back requests while waiting for the next part of the dump
+    if (ctx->destroy_batch_len) {
+        flush_destroy_batch(ctx);
+    }
+}
+
+//A datagram received by io_uring. The receive slots are as large as the
+//largest datagram the kernel creates for a dump, so it is never truncated
+void recv_diag_datagram(void *data, int32_t fd, uint8_t *buf, int32_t len)
+{
+    struct tcp_closer_ctx *ctx = data;
+
+    if (len < 0) {
+        if (len == -ENOBUFS) {
+            handle_overrun(ctx, fd);
+        }
+
+        return;
+    }
+
+    ctx->dump_last_recv = backend_get_time_ms();
+
+    TCP_CLOSER_STATS_ADD(ctx, datagrams, 1);
+    TCP_CLOSER_PROBE1(datagram__recv, len);
+
+    if (ctx->record) {
+        tcp_closer_record_add(ctx, RECORD_TYPE_DUMP, buf, len);
+    }
+
+    parse_dump_datagram(ctx, buf, len);
+
+    //Queueing the batch costs no system call, so it is not held back until
+    //the last datagram of this wakeup
+    if (ctx->destroy_batch_len) {
+        flush_destroy_batch(ctx);
+    }
+}
+
+#ifndef NO_SOCK_DESTROY
+//The kernel checks for CAP_NET_ADMIN only after the socket has been found, so
+//a missing capability is not reported when probing with a socket that does
+//not exist
+static bool netlink_has_net_admin()
+{
+    struct __user_cap_header_struct cap_hdr = {
+        .version = _LINUX_CAPABILITY_VERSION_3,
+        .pid = 0
+    };
+    struct __user_cap_data_struct cap_data[_LINUX_CAPABILITY_U32S_3];
+
+    //Let the destroy requests decide if we can't tell
+    if (syscall(SYS_capget, &cap_hdr, cap_data)) {
+        return true;
+    }
+
+    return cap_data[CAP_TO_INDEX(CAP_NET_ADMIN)].effective &
+           CAP_TO_MASK(CAP_NET_ADMIN);
+}
+#endif
+
+int tcp_closer_netlink_probe_destroy(struct tcp_closer_ctx *ctx)
+{
+#ifndef NO_SOCK_DESTROY
+    uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+    struct inet_diag_msg diag_msg;
     struct nlmsghdr *nlh;
     struct nlmsgerr *err;
-    uint8_t recv_buf[MNL_SOCKET_BUFFER_SIZE];
     int32_t numbytes;
+    uint32_t len;
+
+    //The kernel looks up the socket before destroying it, so an all-zero id
+    //fails with ENOENT when SOCK_DESTROY is supported
+    memset(&diag_msg, 0, sizeof(diag_msg));
+    diag_msg.idiag_family = AF_INET;
+    diag_msg.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    diag_msg.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    memset(buf, 0, DESTROY_MSG_SIZE);
+    len = tcp_closer_lib_destroy_req_init(buf, 0);
+    tcp_closer_lib_destroy_req_set(buf, &diag_msg, 0);
+
+    if (mnl_socket_sendto(ctx->diag_destroy_socket, buf, len) < 0) {
+        return errno;
+    }
+
+    //The request is handled while it is sent, so the ack is already queued
+    numbytes = recv(mnl_socket_get_fd(ctx->diag_destroy_socket), buf,
+                    sizeof(buf), MSG_DONTWAIT);
+
+    if (numbytes < 0) {
+        return errno;
+    }
+
+    nlh = (struct nlmsghdr*) buf;
+
+    if (!mnl_nlmsg_ok(nlh, numbytes) || nlh->nlmsg_type != NLMSG_ERROR) {
+        return EPROTO;
+    }
+
+    err = mnl_nlmsg_get_payload(nlh);
+
+    if (err->error != -ENOENT) {
+        return -err->error;
+    }
+
+    return netlink_has_net_admin() ? 0 : EPERM;
+#else
+    return EOPNOTSUPP;
+#endif
+}
+
+//Close the socket of a failed destroy request through /proc instead. The
+//inode is only known if the slot has not been reused by a later request
+static void destroy_fallback(struct tcp_closer_ctx *ctx, uint32_t seq)
+{
+    struct tcp_closer_destroy_pending *pending =
+        &(ctx->destroy_pending[seq & (DESTROY_PENDING_SIZE - 1)]);
 
-    numbytes = mnl_socket_recvfrom(ctx->diag_destroy_socket, recv_buf,
-                                   sizeof(recv_buf));
-    nlh = (struct nlmsghdr*) recv_buf;
+    if (pending->seq != seq || !pending->inode) {
+        return;
+    }
+
+    tcp_closer_proc_queue(ctx, pending->inode);
+    pending->inode = 0;
+    TCP_CLOSER_STATS_ADD(ctx, destroy_fallbacks, 1);
+}
+
+//Record the idle-to-destroy latency of a request that succeeded. The slot is
+//ignored if it has been reused by a later request
+static void destroy_acked(struct tcp_closer_ctx *ctx, uint32_t seq,
+                          uint64_t now)
+{
+    struct tcp_closer_destroy_pending *pending =
+        &(ctx->destroy_pending[seq & (DESTROY_PENDING_SIZE - 1)]);
+
+    if (pending->seq != seq || !pending->idle_start) {
+        return;
+    }
+
+    tcp_closer_sched_record_latency(ctx->latency_hist,
+                                    now > pending->idle_start ?
+                                    now - pending->idle_start : 0);
+    pending->idle_start = 0;
+}
+
+//The errors that mean that no destroy request will ever succeed
+static bool destroy_error_is_permanent(int error)
+{
+    return error == EOPNOTSUPP || error == EPERM;
+}
+
+static void handle_destroy_error(struct tcp_closer_ctx *ctx,
+                                 struct nlmsgerr *err)
+{
+    int error = -err->error;
+
+    TCP_CLOSER_STATS_ADD(ctx, destroy_failed, 1);
+    TCP_CLOSER_STATS_ADD(ctx, destroy_errno[error > 0 &&
+                                            error < TCP_CLOSER_MAX_ERRNO ?
+                                            error : 0], 1);
+
+    //The socket was closed before the request got to it
+    if (error == ENOENT) {
+        return;
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Destroying socket failed, closing "
+                            "it through /proc. Reason: %s (%u)\n",
+                            strerror(error), error);
+
+    destroy_fallback(ctx, err->msg.nlmsg_seq);
+
+    //The matches of the following dumps go straight to /proc. The requests
+    //that are already sent will fail and fall back as well
+    if (ctx->use_netlink && destroy_error_is_permanent(error)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "SOCK_DESTROY is not usable, "
+                                "switching to /proc\n");
+        ctx->use_netlink = false;
+        tcp_closer_netlink_select_parser(ctx);
+    }
+}
+
+//Handle the acks in a datagram received on the destroy socket
+static void parse_destroy_datagram(struct tcp_closer_ctx *ctx, uint8_t *buf,
+                                   int32_t numbytes)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr*) buf;
+    uint64_t now = backend_get_time_ms();
+    struct nlmsgerr *err;
+
+    if (ctx->record) {
+        tcp_closer_record_add(ctx, RECORD_TYPE_DESTROY_ACK, buf, numbytes);
+    }
 
     while(mnl_nlmsg_ok(nlh, numbytes)){
         if(nlh->nlmsg_type == NLMSG_DONE) {
             break;
         } else if (nlh->nlmsg_type != NLMSG_ERROR) {
-            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Received unexpected type "
-                                    "%u on destroy socket\n", nlh->nlmsg_type);
-            nlh = mnl_nlmsg_next(nlh, &numbytes);
-            continue;
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Received unexpected "
+                                    "type %u on destroy socket\n",
+                                    nlh->nlmsg_type);
+        } else {
+            err = mnl_nlmsg_get_payload(nlh);
+            TCP_CLOSER_PROBE2(destroy__ack, nlh->nlmsg_seq, -err->error);
+
+            if (err->error) {
+                handle_destroy_error(ctx, err);
+            } else {
+                destroy_acked(ctx, err->msg.nlmsg_seq, now);
+            }
         }
 
-        err = mnl_nlmsg_get_payload(nlh);
+        nlh = mnl_nlmsg_next(nlh, &numbytes);
+    }
+}
+
+//Every ack is a separate datagram, so read until the socket is empty and then
+//close the sockets of all failed requests in one pass over /proc
+void recv_destroy_msg(void *data, int32_t fd, uint32_t events)
+{
+    struct tcp_closer_ctx *ctx = data;
+    uint8_t recv_buf[MNL_SOCKET_BUFFER_SIZE];
+    int32_t numbytes;
 
-        if (err->error) {
-            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Destroying socket failed. "
-                                    "Reason: %s (%u)\n", strerror(-err->error),
-                                    -err->error);
+    TCP_CLOSER_PROFILE_ENTER(ctx, PROFILE_DESTROY);
+
+    for (;;) {
+        numbytes = recv(fd, recv_buf, sizeof(recv_buf), MSG_DONTWAIT);
+
+        //Acks were dropped, so failed requests might not fall back to /proc
+        //until the sockets are matched again
+        if (numbytes < 0 && errno == ENOBUFS) {
+            handle_overrun(ctx, fd);
+            continue;
+        }
+
+        if (numbytes <= 0) {
             break;
         }
 
-        nlh = mnl_nlmsg_next(nlh, &numbytes);
+        parse_destroy_datagram(ctx, recv_buf, numbytes);
+    }
+
+    //A dump might be in progress, in which case its matches are flushed
+    //together with these when it is done
+    if (!ctx->dump_in_progress) {
+        tcp_closer_proc_flush(ctx);
+    }
+
+    TCP_CLOSER_PROFILE_LEAVE(ctx);
+}
+
+void tcp_closer_netlink_drain_destroy(struct tcp_closer_ctx *ctx)
+{
+    if (ctx->diag_destroy_socket) {
+        recv_destroy_msg(ctx, mnl_socket_get_fd(ctx->diag_destroy_socket), 0);
     }
 }
+
+//An ack received by io_uring
+void recv_destroy_datagram(void *data, int32_t fd, uint8_t *buf, int32_t len)
+{
+    struct tcp_closer_ctx *ctx = data;
+
+    if (len < 0) {
+        if (len == -ENOBUFS) {
+            handle_overrun(ctx, fd);
+        }
+
+        return;
+    }
+
+    TCP_CLOSER_PROFILE_ENTER(ctx, PROFILE_DESTROY);
+    parse_destroy_datagram(ctx, buf, len);
+
+    if (!ctx->dump_in_progress) {
+        tcp_closer_proc_flush(ctx);
+    }
+
+    TCP_CLOSER_PROFILE_LEAVE(ctx);
+}
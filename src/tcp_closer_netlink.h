@@ -17,6 +17,11 @@
 #ifndef TCP_CLOSER_NETLINK_H
 #define TCP_CLOSER_NETLINK_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tcp_closer_lib.h"
+
 //There are currently 11 states, but the first state is stored in pos. 1.
 //Therefore, I need a 12 bit bitmask
 #define TCPF_ALL 0xFFF
@@ -36,11 +41,135 @@ enum{
     TCP_CLOSING
 };
 
+//The kernel will never create dump datagrams larger than 32KB, so this is the
+//size of one receive slot. RECV_NUM_SLOTS is the max number of datagrams read
+//per system call
+#define RECV_SLOT_SIZE 32768
+#define RECV_NUM_SLOTS 16
+
+//Destroy requests are written with the helpers of libtcpcloser
+#define DESTROY_BATCH_SIZE TCP_CLOSER_LIB_DESTROY_BATCH
+#define DESTROY_MSG_SIZE TCP_CLOSER_LIB_DESTROY_MSG_SIZE
+
+//With io_uring, a batch is sent together with the next wait for events, so
+//the next batch is written to another slot (see flush_destroy_batch())
+#define DESTROY_SEND_SLOTS 32
+
+//With io_uring, the acks of the destroy requests are received into their own
+//buffers, since they are a lot smaller than dump datagrams. An ack contains
+//the request, so it is less than 128 bytes
+#define DESTROY_ACK_SLOT_SIZE 1024
+#define DESTROY_ACK_NUM_SLOTS 64
+
+//Number of outstanding destroy requests we remember the inode of (power of
+//two). The kernel acks the requests when they are sent, so the acks are read
+//long before the slots are reused
+#define DESTROY_PENDING_SIZE 4096
+
+//idle_start is when the socket passed idle_time (in ms, estimated from
+//last_data_recv), so that the latency can be recorded when the request is
+//acked. 0 if the latency is not recorded (control scans)
+struct tcp_closer_destroy_pending {
+    uint64_t idle_start;
+    uint32_t seq;
+    uint32_t inode;
+};
+
+//Initial receive buffer of the destroy socket. Every ack is a separate
+//datagram that takes up about 1KB of the buffer, and the acks are only read
+//once the datagrams of the dump have been handled, so make room for the acks
+//of DESTROY_PENDING_SIZE requests
+#define DESTROY_RCVBUF (DESTROY_PENDING_SIZE * 1024)
+
+//Max size the receive buffers grow to on overruns
+#define NETLINK_MAX_RCVBUF (32 * 1024 * 1024)
+
+//Log levels and actions of the parse_batch variants
+enum {
+    PARSE_LOG_QUIET = 0,
+    PARSE_LOG_MATCH,
+    PARSE_LOG_VERBOSE,
+    PARSE_LOG_MAX
+};
+
+enum {
+    PARSE_ACTION_NETLINK = 0,
+    PARSE_ACTION_PROC,
+    PARSE_ACTION_DRY_RUN,
+    PARSE_ACTION_MAX
+};
+
 struct tcp_closer_ctx;
 struct inet_diag_msg;
+struct tcp_info;
+
+//Sockets of one datagram, decoded into columns so that the idle limits can be
+//evaluated for all of them at once. A datagram is at most RECV_SLOT_SIZE and
+//every socket message is larger than 64 bytes, so all sockets of a datagram
+//fit (a full batch is evaluated anyway)
+#define BATCH_MAX_SOCKETS (RECV_SLOT_SIZE / 64)
+
+struct tcp_closer_batch {
+    uint32_t num;
+    uint32_t last_data_recv[BATCH_MAX_SOCKETS];
+    uint64_t idle[BATCH_MAX_SOCKETS / 64];
+    struct inet_diag_msg *msgs[BATCH_MAX_SOCKETS];
+    struct tcp_info *tcpi[BATCH_MAX_SOCKETS];
+};
+
+typedef void (*parse_batch_cb)(struct tcp_closer_ctx *ctx);
+
+//Select the variant of parse_batch and compute the idle limits matching the
+//configuration of ctx. Must be called every time the configuration changes
+void tcp_closer_netlink_select_parser(struct tcp_closer_ctx *ctx);
+
+//Check if the kernel supports SOCK_DESTROY, by asking it to destroy a socket
+//that does not exist. Returns 0 if supported, otherwise the errno returned by
+//the kernel (EOPNOTSUPP when built without CONFIG_INET_DIAG_DESTROY). The
+//kernel only checks permissions for sockets that exist, so CAP_NET_ADMIN is
+//checked separately and EPERM returned if we lack it
+int tcp_closer_netlink_probe_destroy(struct tcp_closer_ctx *ctx);
 
+//Apply the (grown) receive buffer size of ctx to a new netlink socket
+void tcp_closer_netlink_set_rcvbuf(struct tcp_closer_ctx *ctx, int fd);
+
+//Give the destroy socket room for the acks of a large dump (DESTROY_RCVBUF)
+void tcp_closer_netlink_set_destroy_rcvbuf(struct tcp_closer_ctx *ctx);
+
+//Read the acks that are left when the event loop has stopped. Requests are
+//acked while they are sent, so this records the latencies of the last dump
+//and closes the sockets of failed requests through /proc before exiting
+void tcp_closer_netlink_drain_destroy(struct tcp_closer_ctx *ctx);
+
+//Allocate the receive buffer used for dumps
+bool tcp_closer_netlink_init_recv(struct tcp_closer_ctx *ctx);
+//Send a dump request for sockets of family, matching filter (can be NULL)
+int send_diag_msg_filter(struct tcp_closer_ctx *ctx, uint8_t family,
+                         const void *filter, uint32_t filter_len);
 int send_diag_msg(struct tcp_closer_ctx *ctx);
+
+//Add a socket that was not received from inet_diag (see tcp_closer_procnet.c)
+//to the batch. tcpi only needs tcpi_state and tcpi_last_data_recv. Both must
+//stay valid until the batch is evaluated, which happens when it is full or
+//when tcp_closer_netlink_end_dump() is called
+void tcp_closer_netlink_add_socket(struct tcp_closer_ctx *ctx,
+                                   struct inet_diag_msg *diag_msg,
+                                   struct tcp_info *tcpi);
+
+//Evaluate the remaining sockets and finish the dump, like NLMSG_DONE
+void tcp_closer_netlink_end_dump(struct tcp_closer_ctx *ctx);
+
+//Parse one dump datagram, as if it had been received on the dump socket. Used
+//for replaying captures. Returns true when the dump is done
+bool tcp_closer_netlink_parse_datagram(struct tcp_closer_ctx *ctx,
+                                       uint8_t *buf, int32_t numbytes);
 void recv_diag_msg(void *data, int32_t fd, uint32_t events);
 void recv_destroy_msg(void *data, int32_t fd, uint32_t events);
 
+//Callbacks for when the datagrams are received (and requests sent) by
+//io_uring
+void recv_diag_datagram(void *data, int32_t fd, uint8_t *buf, int32_t len);
+void recv_destroy_datagram(void *data, int32_t fd, uint8_t *buf, int32_t len);
+void destroy_batch_sent(void *data, int32_t res);
+
 #endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_peers.h"
+#include "tcp_closer.h"
+#include "tcp_closer_arena.h"
+#include "tcp_closer_log.h"
+
+static int peers_cmp(const void *a, const void *b)
+{
+    const struct tcp_closer_peer_sock *sock_a = a, *sock_b = b;
+
+    return memcmp(sock_a->key, sock_b->key, sizeof(sock_a->key));
+}
+
+//qsort() in glibc allocates a temporary buffer for large arrays, so sort with a
+//bottom-up merge sort that takes its buffer from the arena instead. The sorted
+//sockets end up in either of the two buffers
+static void peers_sort(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_peers *peers = ctx->peers;
+    struct tcp_closer_peer_sock *src = peers->socks, *dst, *tmp;
+    uint32_t n = peers->num_socks, width, lo, mid, hi, i, j, k;
+
+    dst = tcp_closer_arena_alloc(ctx->arena,
+                                 n * sizeof(struct tcp_closer_peer_sock));
+
+    if (!dst) {
+        qsort(peers->socks, n, sizeof(struct tcp_closer_peer_sock), peers_cmp);
+        return;
+    }
+
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = lo + width < n ? lo + width : n;
+            hi = lo + (2 * width) < n ? lo + (2 * width) : n;
+
+            for (i = lo, j = mid, k = lo; k < hi; k++) {
+                if (i < mid &&
+                    (j == hi || peers_cmp(&(src[i]), &(src[j])) <= 0)) {
+                    dst[k] = src[i++];
+                } else {
+                    dst[k] = src[j++];
+                }
+            }
+        }
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    peers->socks = src;
+}
+
+void tcp_closer_peers_add(struct tcp_closer_ctx *ctx,
+                          struct inet_diag_msg *diag_msg,
+                          uint32_t last_data_recv, bool idle)
+{
+    struct tcp_closer_peers *peers = ctx->peers;
+    struct tcp_closer_peer_sock *sock, *socks;
+    uint32_t size;
+    uint8_t i;
+
+    //The table only lives for the current dump, so it is kept in the arena
+    if (peers->num_socks == peers->size) {
+        size = peers->size ? peers->size * 2 : PEERS_INITIAL_SIZE;
+        socks = tcp_closer_arena_grow(ctx->arena, peers->socks,
+                                      peers->size *
+                                      sizeof(struct tcp_closer_peer_sock),
+                                      size *
+                                      sizeof(struct tcp_closer_peer_sock));
+
+        if (!socks) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to grow peer "
+                                    "table\n");
+            return;
+        }
+
+        peers->socks = socks;
+        peers->size = size;
+    }
+
+    sock = &(peers->socks[peers->num_socks++]);
+    memcpy(&(sock->diag_msg), diag_msg, sizeof(struct inet_diag_msg));
+    sock->last_data_recv = last_data_recv;
+    sock->idle = idle;
+
+    for (i = 0; i < 4; i++) {
+        sock->key[i] = diag_msg->id.idiag_dst[i] & peers->mask[i];
+    }
+}
+
+static void peers_log_summary(struct tcp_closer_ctx *ctx,
+                              struct tcp_closer_peer_sock *sock,
+                              uint32_t num_idle, uint32_t num_socks)
+{
+    char peer_buf[INET6_ADDRSTRLEN] = {0};
+
+    inet_ntop(sock->diag_msg.idiag_family, sock->key, peer_buf,
+              sizeof(peer_buf));
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%s all %u connection(s) to peer "
+                            "%s/%u, %u are idle\n",
+                            ctx->dry_run ? "Would destroy" : "Will destroy",
+                            num_socks, peer_buf, ctx->peers->prefix_len,
+                            num_idle);
+}
+
+void tcp_closer_peers_flush(struct tcp_closer_ctx *ctx,
+                            tcp_closer_peers_cb destroy_cb)
+{
+    struct tcp_closer_peers *peers = ctx->peers;
+    struct tcp_closer_peer_sock *first;
+    uint32_t i, j, num_idle;
+    bool destroy_all;
+
+    if (!peers->num_socks) {
+        return;
+    }
+
+    peers_sort(ctx);
+
+    for (i = 0; i < peers->num_socks; i = j) {
+        first = &(peers->socks[i]);
+        num_idle = 0;
+
+        for (j = i; j < peers->num_socks && !peers_cmp(first,
+                                                       &(peers->socks[j])); j++) {
+            num_idle += peers->socks[j].idle;
+        }
+
+        if (!num_idle) {
+            continue;
+        }
+
+        destroy_all = num_idle * 100 >= (j - i) * peers->idle_pct;
+
+        if (destroy_all && !ctx->quiet_mode) {
+            peers_log_summary(ctx, first, num_idle, j - i);
+        }
+
+        for (; first < &(peers->socks[j]); first++) {
+            if (destroy_all || first->idle) {
+                destroy_cb(ctx, &(first->diag_msg), first->last_data_recv,
+                           !destroy_all);
+            }
+        }
+    }
+
+    tcp_closer_peers_reset(ctx);
+}
+
+void tcp_closer_peers_reset(struct tcp_closer_ctx *ctx)
+{
+    ctx->peers->socks = NULL;
+    ctx->peers->num_socks = 0;
+    ctx->peers->size = 0;
+}
+
+bool tcp_closer_peers_init(struct tcp_closer_ctx *ctx, uint8_t prefix_len,
+                           uint8_t idle_pct)
+{
+    struct tcp_closer_peers *peers = calloc(sizeof(struct tcp_closer_peers), 1);
+    uint8_t i, bits;
+
+    if (!peers) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "peer table\n");
+        return false;
+    }
+
+    peers->prefix_len = prefix_len;
+    peers->idle_pct = idle_pct;
+
+    //Addresses are in network byte order, so the mask is too
+    for (i = 0; i < 4; i++) {
+        bits = prefix_len > i * 32 ? prefix_len - (i * 32) : 0;
+        bits = bits > 32 ? 32 : bits;
+        peers->mask[i] = bits ? htonl(0xFFFFFFFFU << (32 - bits)) : 0;
+    }
+
+    ctx->peers = peers;
+    return true;
+}
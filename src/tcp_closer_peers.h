@@ -0,0 +1,73 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_PEERS_H
+#define TCP_CLOSER_PEERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/inet_diag.h>
+
+#define PEERS_INITIAL_SIZE      256
+#define PEERS_DEFAULT_IDLE_PCT  50
+
+//A socket seen during the current dump. key is the remote address masked with
+//the peer prefix
+struct tcp_closer_peer_sock {
+    struct inet_diag_msg diag_msg;
+    uint32_t key[4];
+    uint32_t last_data_recv;
+    bool idle;
+};
+
+//When peer aggregation is enabled, the decision to destroy a socket is made
+//when the dump is done. If at least idle_pct percent of the connections to a
+//peer are idle, then all connections to the peer are destroyed
+struct tcp_closer_peers {
+    struct tcp_closer_peer_sock *socks;
+    uint32_t num_socks;
+    uint32_t size;
+    uint32_t mask[4];
+    uint8_t prefix_len;
+    uint8_t idle_pct;
+};
+
+struct tcp_closer_ctx;
+
+//Called for every socket that should be destroyed. log is false when the
+//socket is covered by a peer summary
+typedef void (*tcp_closer_peers_cb)(struct tcp_closer_ctx *ctx,
+                                    struct inet_diag_msg *diag_msg,
+                                    uint32_t last_data_recv, bool log);
+
+bool tcp_closer_peers_init(struct tcp_closer_ctx *ctx, uint8_t prefix_len,
+                           uint8_t idle_pct);
+
+//Add a socket matching the ports to the current dump
+void tcp_closer_peers_add(struct tcp_closer_ctx *ctx,
+                          struct inet_diag_msg *diag_msg,
+                          uint32_t last_data_recv, bool idle);
+
+//Group sockets per peer, call destroy_cb for the sockets that should be
+//destroyed and reset for the next dump
+void tcp_closer_peers_flush(struct tcp_closer_ctx *ctx,
+                            tcp_closer_peers_cb destroy_cb);
+
+//Forget the sockets of the current dump (used when a dump fails). The table is
+//allocated from the arena of the dump, and released with it
+void tcp_closer_peers_reset(struct tcp_closer_ctx *ctx);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_PROBES_H
+#define TCP_CLOSER_PROBES_H
+
+//USDT probes (provider tcp_closer), for example for bpftrace:
+//  bpftrace -e 'usdt:/usr/sbin/tcp-closer:tcp_closer:dump__end
+//      { @[arg0] = count(); }'
+//
+//  dump__start     port_lo, port_hi of the dump (or shard)
+//  dump__end       duration (ms), matched sockets
+//  datagram__recv  length of a received dump datagram
+//  socket__match   sport, dport, last_data_recv (ms), action
+//  destroy__send   number of destroy requests in the datagram
+//  destroy__ack    sequence number, error (0 on success)
+//
+//A probe is a single nop until it is attached to. Without <sys/sdt.h> (or
+//with TCP_CLOSER_NO_PROBES), the probes are not compiled in
+#if defined(__has_include) && !defined(TCP_CLOSER_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TCP_CLOSER_HAVE_PROBES
+#endif
+#endif
+
+#ifdef TCP_CLOSER_HAVE_PROBES
+#define TCP_CLOSER_PROBE1(name, a) DTRACE_PROBE1(tcp_closer, name, a)
+#define TCP_CLOSER_PROBE2(name, a, b) DTRACE_PROBE2(tcp_closer, name, a, b)
+#define TCP_CLOSER_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4(tcp_closer, name, a, b, c, d)
+#else
+#define TCP_CLOSER_PROBE1(name, a) do { } while (0)
+#define TCP_CLOSER_PROBE2(name, a, b) do { } while (0)
+#define TCP_CLOSER_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
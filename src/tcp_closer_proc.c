@@ -14,6 +14,7 @@
  * TCP closer. If not, see http://www.gnu.org/licenses/.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -21,12 +22,153 @@
 #include <dirent.h>
 #include <signal.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 
 #include "tcp_closer_proc.h"
 #include "tcp_closer.h"
+#include "backend_event_loop.h"
 #include "tcp_closer_log.h"
 
-void destroy_socket_proc(struct tcp_closer_ctx *ctx, uint32_t inode_org)
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifndef SYS_pidfd_getfd
+#define SYS_pidfd_getfd 438
+#endif
+
+static int inode_cmp(const void *a, const void *b)
+{
+    uint32_t inode_a = *((const uint32_t*) a);
+    uint32_t inode_b = *((const uint32_t*) b);
+
+    return inode_a < inode_b ? -1 : inode_a > inode_b;
+}
+
+static int proc_pidfd_open(pid_t pid)
+{
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int proc_pidfd_getfd(int pidfd, int fd)
+{
+    return syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+}
+
+static uint16_t proc_kill(struct tcp_closer_ctx *ctx, uint64_t pid,
+                          uint16_t num_fds)
+{
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Will kill PID %lu\n", pid);
+    kill(pid, SIGKILL);
+    TCP_CLOSER_STATS_ADD(ctx, proc_kills, 1);
+
+    //Killing the process closes all of the remaining sockets
+    return num_fds;
+}
+
+//Close the sockets in fds, all owned by pid. We get a copy of each socket from
+//the process and shut it down, which only affects that connection. The process
+//is only killed if the kernel lacks pidfd_open()/pidfd_getfd() (older than
+//5.6) or with --proc_kill. Sockets that can't be fetched for any other reason
+//(closed by the owner, the process has exited, EPERM from Yama, ...) are
+//skipped. Returns the number of sockets that were closed
+static uint16_t proc_close_sockets(struct tcp_closer_ctx *ctx, uint64_t pid,
+                                   int *fds, uint16_t num_fds)
+{
+    uint16_t i, num_closed = 0;
+    int pidfd, sock_fd;
+
+    if (ctx->proc_kill) {
+        return proc_kill(ctx, pid, num_fds);
+    }
+
+    if ((pidfd = proc_pidfd_open(pid)) < 0) {
+        if (errno == ENOSYS) {
+            return proc_kill(ctx, pid, num_fds);
+        }
+
+        //ESRCH means that the process has exited, and the PID might already
+        //have been reused
+        if (errno != ESRCH) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open PID %lu. "
+                                    "Error: %s (%d)\n", pid, strerror(errno),
+                                    errno);
+        }
+
+        return 0;
+    }
+
+    for (i = 0; i < num_fds; i++) {
+        sock_fd = proc_pidfd_getfd(pidfd, fds[i]);
+
+        if (sock_fd < 0) {
+            if (errno == ENOSYS) {
+                close(pidfd);
+                return num_closed + proc_kill(ctx, pid, num_fds - i);
+            } else if (errno == ESRCH) {
+                break;
+            } else if (errno != EBADF) {
+                //EBADF is a socket that the owner has closed since the walk
+                TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to get fd %d "
+                                        "from PID %lu. Error: %s (%d)\n",
+                                        fds[i], pid, strerror(errno), errno);
+            }
+
+            continue;
+        }
+
+        if (shutdown(sock_fd, SHUT_RDWR)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to shut down fd %d "
+                                    "of PID %lu. Error: %s (%d)\n", fds[i],
+                                    pid, strerror(errno), errno);
+        } else {
+            if (ctx->verbose_mode) {
+                TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Shut down fd %d of "
+                                        "PID %lu\n", fds[i], pid);
+            }
+
+            TCP_CLOSER_STATS_ADD(ctx, proc_shutdowns, 1);
+            num_closed++;
+        }
+
+        close(sock_fd);
+    }
+
+    close(pidfd);
+
+    return num_closed;
+}
+
+void tcp_closer_proc_queue(struct tcp_closer_ctx *ctx, uint32_t inode)
+{
+    uint32_t *inodes;
+    uint32_t new_size;
+
+    if (ctx->proc_inodes_len == ctx->proc_inodes_size) {
+        new_size = ctx->proc_inodes_size ? ctx->proc_inodes_size * 2 :
+                                           PROC_INITIAL_QUEUE_SIZE;
+        inodes = realloc(ctx->proc_inodes, new_size * sizeof(uint32_t));
+
+        if (!inodes) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to queue inode %u\n",
+                                    inode);
+            return;
+        }
+
+        ctx->proc_inodes = inodes;
+        ctx->proc_inodes_size = new_size;
+    }
+
+    ctx->proc_inodes[ctx->proc_inodes_len++] = inode;
+}
+
+//Walk /proc once for all queued inodes. The queued inodes are sorted, so that
+//each socket link can be looked up with a binary search, and all the sockets
+//belonging to one process are closed together
+void tcp_closer_proc_flush(struct tcp_closer_ctx *ctx)
 {
     //Length of /proc/strlen(uint64_max)/fd/d_name (d_name is 256, inc. \0)
     char dir_buf[286];
@@ -34,13 +176,23 @@ void destroy_socket_proc(struct tcp_closer_ctx *ctx, uint32_t inode_org)
     char *inode_str;
     struct dirent *lDirEnt;
     DIR *lProcDir, *lProcFdDir;
-    uint64_t pid;
+    uint64_t pid, start_time = backend_get_time_ms(), duration;
+    uint32_t num_closed = 0;
     uint32_t inode;
+    int fds[PROC_MAX_FDS_PER_BATCH];
+    uint16_t num_fds;
+
+    if (!ctx->proc_inodes_len) {
+        return;
+    }
+
+    qsort(ctx->proc_inodes, ctx->proc_inodes_len, sizeof(uint32_t), inode_cmp);
 
     lProcDir = opendir("/proc");
 
     if (!lProcDir) {
         TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open /proc\n");
+        ctx->proc_inodes_len = 0;
         return;
     }
 
@@ -62,6 +214,8 @@ void destroy_socket_proc(struct tcp_closer_ctx *ctx, uint32_t inode_org)
             continue;
         }
 
+        num_fds = 0;
+
         while ((lDirEnt = readdir(lProcFdDir))) {
             if (lDirEnt->d_type != DT_LNK) {
                 continue;
@@ -89,21 +243,35 @@ void destroy_socket_proc(struct tcp_closer_ctx *ctx, uint32_t inode_org)
 
             inode = atoi(inode_str);
 
-            if (inode != inode_org) {
+            if (!bsearch(&inode, ctx->proc_inodes, ctx->proc_inodes_len,
+                         sizeof(uint32_t), inode_cmp)) {
                 continue;
             }
 
-            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Will kill PID %lu\n", pid);
-            kill(pid, SIGKILL);
+            fds[num_fds++] = atoi(lDirEnt->d_name);
 
-            //No need to check any other link in this folder, we have killed
-            //the process
-            break;
+            if (num_fds == PROC_MAX_FDS_PER_BATCH) {
+                num_closed += proc_close_sockets(ctx, pid, fds, num_fds);
+                num_fds = 0;
+            }
+        }
+
+        if (num_fds) {
+            num_closed += proc_close_sockets(ctx, pid, fds, num_fds);
         }
 
         closedir(lProcFdDir);
     }
 
     closedir(lProcDir);
-}
 
+    duration = backend_get_time_ms() - start_time;
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Closed %u of %u socket(s) through "
+                            "/proc in %lums (%.0f/s)\n", num_closed,
+                            ctx->proc_inodes_len, duration,
+                            duration ? (num_closed * 1000.0) / duration :
+                                       (double) num_closed * 1000);
+
+    ctx->proc_inodes_len = 0;
+}
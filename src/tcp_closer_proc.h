@@ -19,8 +19,14 @@
 
 #include <stdint.h>
 
+#define PROC_INITIAL_QUEUE_SIZE 64
+#define PROC_MAX_FDS_PER_BATCH  64
+
 struct tcp_closer_ctx;
 
-void destroy_socket_proc(struct tcp_closer_ctx *ctx, uint32_t inode_org);
+//Queue socket with inode for closing. Sockets are closed in batches by
+//tcp_closer_proc_flush(), which is called when a dump is done
+void tcp_closer_proc_queue(struct tcp_closer_ctx *ctx, uint32_t inode);
+void tcp_closer_proc_flush(struct tcp_closer_ctx *ctx);
 
 #endif
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "tcp_closer_procnet.h"
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "tcp_closer_lib.h"
+#include "tcp_closer_log.h"
+
+//The lines of /proc/net/tcp[6] are generated with fixed-width hex fields
+//(addresses, ports, state, queues and timers), followed by uid, timeout and
+//inode in decimal:
+//
+//  sl: LOCAL_ADDR:PORT REMOTE_ADDR:PORT ST TX_QUEUE:RX_QUEUE TR:TM->WHEN
+//  RETRNSMT UID TIMEOUT INODE ...
+//
+//An address is one (IPv4) or four (IPv6) 32 bit words, printed in the byte
+//order they are stored in. Ports are in host byte order
+
+//Convert eight hex digits to a 32 bit value without branches, by working on
+//all digits at once in one 64 bit word (SWAR). '0'-'9' is 0x30-0x39 and
+//'A'-'F'/'a'-'f' is 0x41-0x46/0x61-0x66, so the low nibble is the value of
+//the digit, plus 9 for letters (bit 6 set)
+static inline uint32_t procnet_hex8(const char *p)
+{
+    uint64_t x;
+
+    memcpy(&x, p, sizeof(x));
+    x = (x & 0x0F0F0F0F0F0F0F0FULL) + (((x & 0x4040404040404040ULL) >> 6) * 9);
+
+    //The first digit is in the lowest byte (little endian) and is the most
+    //significant. Merge neighbouring digits into bytes, bytes into 16 bit and
+    //16 bit into 32 bit values
+    x = ((x & 0x000F000F000F000FULL) << 4) | ((x >> 8) & 0x000F000F000F000FULL);
+    x = ((x & 0x000000FF000000FFULL) << 8) | ((x >> 16) & 0x000000FF000000FFULL);
+    x = ((x & 0xFFFF) << 16) | ((x >> 32) & 0xFFFF);
+
+    return (uint32_t) x;
+}
+
+static inline uint16_t procnet_hex4(const char *p)
+{
+    uint32_t x;
+
+    memcpy(&x, p, sizeof(x));
+    x = (x & 0x0F0F0F0F) + (((x & 0x40404040) >> 6) * 9);
+    x = ((x & 0x000F000F) << 4) | ((x >> 8) & 0x000F000F);
+    x = ((x & 0xFF) << 8) | ((x >> 16) & 0xFF);
+
+    return (uint16_t) x;
+}
+
+static inline uint8_t procnet_hex_digit(char c)
+{
+    return (c & 0xF) + (((c & 0x40) >> 6) * 9);
+}
+
+static inline const char *procnet_dec(const char *p, const char *end,
+                                      uint64_t *value)
+{
+    *value = 0;
+
+    while (p < end && *p == ' ') {
+        p++;
+    }
+
+    //Timeout can be negative, the value is not used
+    if (p < end && *p == '-') {
+        p++;
+    }
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        *value = (*value * 10) + (*p++ - '0');
+    }
+
+    return p;
+}
+
+//Fixed part of a line after "sl: ", from local address to retrnsmt
+#define PROCNET_FIXED_LEN(num_words) ((num_words * 16) + 53)
+
+//Returns false if the line is malformed or the socket is not established
+static bool procnet_parse_line(const char *line, const char *end,
+                               uint8_t family, struct inet_diag_msg *msg,
+                               struct tcp_closer_lib_sock *sock)
+{
+    uint8_t num_words = family == AF_INET ? 1 : 4, i;
+    const char *p = memchr(line, ':', end - line);
+    uint64_t uid, timeout, inode;
+
+    if (!p || end - p < PROCNET_FIXED_LEN(num_words) + 2) {
+        return false;
+    }
+
+    p += 2;
+
+    //State is after both addresses, check it first since most lines on a busy
+    //host are not for established sockets
+    if (procnet_hex_digit(p[num_words * 16 + 12]) != 0 ||
+        procnet_hex_digit(p[num_words * 16 + 13]) != TCP_ESTABLISHED) {
+        return false;
+    }
+
+    for (i = 0; i < num_words; i++) {
+        sock->saddr[i] = procnet_hex8(p + (i * 8));
+        sock->daddr[i] = procnet_hex8(p + (num_words * 8) + 6 + (i * 8));
+    }
+
+    sock->sport = procnet_hex4(p + (num_words * 8) + 1);
+    sock->dport = procnet_hex4(p + (num_words * 16) + 7);
+    sock->family = family;
+
+    p = procnet_dec(p + PROCNET_FIXED_LEN(num_words), end, &uid);
+    p = procnet_dec(p, end, &timeout);
+    procnet_dec(p, end, &inode);
+
+    memset(msg, 0, sizeof(struct inet_diag_msg));
+    msg->idiag_family = family;
+    msg->idiag_state = TCP_ESTABLISHED;
+    msg->idiag_uid = uid;
+    msg->idiag_inode = inode;
+    msg->id.idiag_sport = htons(sock->sport);
+    msg->id.idiag_dport = htons(sock->dport);
+    memcpy(msg->id.idiag_src, sock->saddr, num_words * sizeof(uint32_t));
+    memcpy(msg->id.idiag_dst, sock->daddr, num_words * sizeof(uint32_t));
+
+    //The kernel skips the cookie check when destroying sockets
+    msg->id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    msg->id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    return true;
+}
+
+bool tcp_closer_procnet_init(struct tcp_closer_ctx *ctx)
+{
+    const char *path = ctx->socket_family == AF_INET ? "/proc/net/tcp" :
+                                                       "/proc/net/tcp6";
+    struct tcp_closer_procnet *procnet;
+
+    procnet = calloc(sizeof(struct tcp_closer_procnet), 1);
+
+    if (!procnet || !(procnet->buf = malloc(PROCNET_BUF_SIZE))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "/proc/net scanning\n");
+        free(procnet);
+        return false;
+    }
+
+    if ((procnet->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open %s. Error: %s "
+                                "(%u)\n", path, strerror(errno), errno);
+        free(procnet->buf);
+        free(procnet);
+        return false;
+    }
+
+    ctx->procnet = procnet;
+    return true;
+}
+
+void tcp_closer_procnet_scan(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_procnet *procnet = ctx->procnet;
+    struct tcp_closer_lib_sock sock;
+    char *buf = procnet->buf, *line, *nl;
+    uint32_t carry = 0, len, slot;
+    off_t offset = 0;
+    ssize_t numbytes;
+    bool header = true;
+
+    memset(&sock, 0, sizeof(sock));
+
+    //Reading from offset 0 makes the kernel generate the file again. Lines can
+    //be split between reads, the rest of the last line is moved to the start
+    //of the buffer
+    while ((numbytes = pread(procnet->fd, buf + carry,
+                             PROCNET_BUF_SIZE - carry, offset)) > 0) {
+        offset += numbytes;
+        len = carry + numbytes;
+        line = buf;
+
+        while ((nl = memchr(line, '\n', (buf + len) - line))) {
+            slot = ctx->batch->num;
+
+            if (!header &&
+                procnet_parse_line(line, nl, ctx->socket_family,
+                                   &(procnet->msgs[slot]), &sock) &&
+                tcp_closer_lib_filter_run(ctx->diag_filter,
+                                          ctx->diag_filter_len, &sock)) {
+                memset(&(procnet->infos[slot]), 0, sizeof(struct tcp_info));
+                procnet->infos[slot].tcpi_state = TCP_ESTABLISHED;
+                tcp_closer_netlink_add_socket(ctx, &(procnet->msgs[slot]),
+                                              &(procnet->infos[slot]));
+            }
+
+            header = false;
+            line = nl + 1;
+        }
+
+        carry = (buf + len) - line;
+
+        //A line longer than the buffer, can't happen with the current format
+        if (carry == PROCNET_BUF_SIZE) {
+            carry = 0;
+        }
+
+        memmove(buf, line, carry);
+    }
+
+    if (numbytes < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Reading /proc/net failed. "
+                                "Error: %s (%u)\n", strerror(errno), errno);
+    }
+
+    tcp_closer_netlink_end_dump(ctx);
+}
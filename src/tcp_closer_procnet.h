@@ -0,0 +1,49 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_PROCNET_H
+#define TCP_CLOSER_PROCNET_H
+
+#include <stdbool.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+
+#include "tcp_closer_netlink.h"
+
+//Size of the buffer /proc/net/tcp[6] is read into. A line is at most ~180
+//bytes, so one read covers thousands of sockets
+#define PROCNET_BUF_SIZE (1024 * 1024)
+
+//Sockets read from /proc are converted into inet_diag messages, so that they
+//go through the same batch evaluation and destroy path as the dumps. Slot i is
+//used by socket i of the current batch
+struct tcp_closer_procnet {
+    char *buf;
+    int fd;
+    struct inet_diag_msg msgs[BATCH_MAX_SOCKETS];
+    struct tcp_info infos[BATCH_MAX_SOCKETS];
+};
+
+struct tcp_closer_ctx;
+
+//Open /proc/net/tcp (or tcp6 for IPv6) and allocate the read buffer
+bool tcp_closer_procnet_init(struct tcp_closer_ctx *ctx);
+
+//Read all sockets, match them against the filter in user space and finish the
+//dump. Replaces the inet_diag dump when --proc_net is set
+void tcp_closer_procnet_scan(struct tcp_closer_ctx *ctx);
+
+#endif
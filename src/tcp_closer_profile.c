@@ -0,0 +1,233 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "tcp_closer_profile.h"
+#include "tcp_closer.h"
+#include "tcp_closer_log.h"
+
+static const char *profile_stage_str[PROFILE_MAX] = {
+    "other", "recv", "parse", "log", "destroy"
+};
+
+static int profile_open(uint32_t type, uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+
+    //Counts the calling thread on any CPU
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd,
+                   PERF_FLAG_FD_CLOEXEC);
+}
+
+static void profile_read(struct tcp_closer_profile *profile, uint64_t *values)
+{
+    //nr followed by one value per counter in the group
+    uint64_t buf[3] = {0};
+
+    if (read(profile->fd, buf, sizeof(buf)) < 0) {
+        buf[1] = profile->last[0];
+        buf[2] = profile->last[1];
+    }
+
+    values[0] = buf[1];
+    values[1] = buf[2];
+}
+
+void tcp_closer_profile_start(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_profile *profile;
+    int fd;
+
+    if (!(profile = calloc(sizeof(struct tcp_closer_profile), 1))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "profile\n");
+        return;
+    }
+
+    if ((profile->fd = profile_open(PERF_TYPE_HARDWARE,
+                                    PERF_COUNT_HW_CPU_CYCLES, -1)) >= 0) {
+        fd = profile_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+                          profile->fd);
+
+        //The cycles are still useful without instructions
+        if (fd < 0) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Counting instructions "
+                                    "failed. Error: %s (%u)\n",
+                                    strerror(errno), errno);
+        }
+    } else if ((profile->fd = profile_open(PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_TASK_CLOCK,
+                                           -1)) >= 0) {
+        profile->task_clock = true;
+    } else {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "perf_event_open() failed, "
+                                "profiling is disabled. Error: %s (%u)\n",
+                                strerror(errno), errno);
+        free(profile);
+        return;
+    }
+
+    profile_read(profile, profile->last);
+    ctx->profile = profile;
+}
+
+static void profile_account(struct tcp_closer_profile *profile)
+{
+    uint8_t stage = profile->depth ? profile->stack[profile->depth - 1] :
+                                     PROFILE_OTHER;
+    uint64_t values[2];
+
+    profile_read(profile, values);
+    profile->dump.cycles[stage] += values[0] - profile->last[0];
+    profile->dump.instructions[stage] += values[1] - profile->last[1];
+    profile->last[0] = values[0];
+    profile->last[1] = values[1];
+}
+
+void tcp_closer_profile_enter(struct tcp_closer_profile *profile,
+                              uint8_t stage)
+{
+    profile_account(profile);
+
+    //Deeper stages are counted as part of the current one
+    if (profile->depth < PROFILE_MAX_DEPTH) {
+        profile->stack[profile->depth] = stage;
+    }
+
+    profile->depth++;
+}
+
+void tcp_closer_profile_leave(struct tcp_closer_profile *profile)
+{
+    profile_account(profile);
+    profile->depth--;
+}
+
+static void profile_log_count(struct tcp_closer_ctx *ctx, const char *what,
+                              struct tcp_closer_profile_count *count,
+                              bool task_clock)
+{
+    uint64_t cycles = 0, instructions = 0, sockets = count->sockets;
+    char stages[256];
+    uint32_t len = 0;
+    uint8_t i;
+
+    for (i = 0; i < PROFILE_MAX; i++) {
+        cycles += count->cycles[i];
+        instructions += count->instructions[i];
+    }
+
+    for (i = 0; i < PROFILE_MAX; i++) {
+        len += snprintf(stages + len, sizeof(stages) - len, " %s %.1f%%",
+                        profile_stage_str[i],
+                        cycles ? count->cycles[i] * 100.0 / cycles : 0);
+    }
+
+    //The task clock has no instruction count
+    if (!task_clock && instructions) {
+        len += snprintf(stages + len, sizeof(stages) - len, ". IPC %.2f",
+                        (double) instructions / cycles);
+    }
+
+    //Sending the request and handling its ack
+    if (count->destroys) {
+        len += snprintf(stages + len, sizeof(stages) - len, ". %lu %s/destroy "
+                        "request", count->cycles[PROFILE_DESTROY] /
+                        count->destroys, task_clock ? "ns" : "cycles");
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%s: %lu %s/socket over %lu "
+                            "socket(s) in %lu dump(s). Stages:%s\n", what,
+                            sockets ? cycles / sockets : 0,
+                            task_clock ? "ns" : "cycles", sockets,
+                            count->dumps, stages);
+}
+
+void tcp_closer_profile_dump_done(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_profile *profile = ctx->profile;
+    uint8_t i;
+
+    profile_account(profile);
+    profile->dump.dumps = 1;
+
+    if (ctx->verbose_mode) {
+        profile_log_count(ctx, "Dump profile", &(profile->dump),
+                          profile->task_clock);
+    }
+
+    for (i = 0; i < PROFILE_MAX; i++) {
+        profile->total.cycles[i] += profile->dump.cycles[i];
+        profile->total.instructions[i] += profile->dump.instructions[i];
+    }
+
+    profile->total.sockets += profile->dump.sockets;
+    profile->total.destroys += profile->dump.destroys;
+    profile->total.dumps++;
+    memset(&(profile->dump), 0, sizeof(profile->dump));
+}
+
+void tcp_closer_profile_log(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_profile_count total;
+    struct tcp_closer_profile *profile;
+    uint16_t num_workers = ctx->workers ? ctx->num_threads : 1, i, j;
+    bool task_clock = false, found = false;
+
+    memset(&total, 0, sizeof(total));
+
+    for (i = 0; i < num_workers; i++) {
+        profile = ctx->workers ? ctx->workers[i]->profile : ctx->profile;
+
+        if (!profile) {
+            continue;
+        }
+
+        //Acks that arrived after the last dump are still in dump
+        for (j = 0; j < PROFILE_MAX; j++) {
+            total.cycles[j] += profile->total.cycles[j] +
+                               profile->dump.cycles[j];
+            total.instructions[j] += profile->total.instructions[j] +
+                                     profile->dump.instructions[j];
+        }
+
+        total.sockets += profile->total.sockets;
+        total.destroys += profile->total.destroys + profile->dump.destroys;
+        total.dumps += profile->total.dumps;
+        task_clock |= profile->task_clock;
+        found = true;
+    }
+
+    if (found) {
+        profile_log_count(ctx, "Profile", &total, task_clock);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_PROFILE_H
+#define TCP_CLOSER_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROFILE_MAX_DEPTH 8
+
+//Stages of the pipeline. The time the kernel spends generating the dump is
+//spent in recvmmsg(), so it is part of PROFILE_RECV. PROFILE_LOG is nested in
+//PROFILE_PARSE, and is only entered when a socket is logged
+enum {
+    PROFILE_OTHER = 0,
+    PROFILE_RECV,
+    PROFILE_PARSE,
+    PROFILE_LOG,
+    PROFILE_DESTROY,
+    PROFILE_MAX
+};
+
+struct tcp_closer_profile_count {
+    uint64_t cycles[PROFILE_MAX];
+    uint64_t instructions[PROFILE_MAX];
+    uint64_t sockets;
+    uint64_t destroys;
+    uint64_t dumps;
+};
+
+//--profile. The counters of the thread are read when a stage is entered or
+//left, and the difference is added to the stage on top of the stack. If the
+//CPU has no usable cycle counter (for example in many VMs), the task clock is
+//used instead and the "cycles" are nanoseconds
+struct tcp_closer_profile {
+    struct tcp_closer_profile_count dump;
+    struct tcp_closer_profile_count total;
+    uint64_t last[2];
+    int fd;
+    bool task_clock;
+    uint8_t stack[PROFILE_MAX_DEPTH];
+    uint8_t depth;
+};
+
+struct tcp_closer_ctx;
+
+//Open the counters for the calling thread, which must be the thread that runs
+//the event loop of ctx. Profiling is disabled for ctx if it fails
+void tcp_closer_profile_start(struct tcp_closer_ctx *ctx);
+
+void tcp_closer_profile_enter(struct tcp_closer_profile *profile,
+                              uint8_t stage);
+void tcp_closer_profile_leave(struct tcp_closer_profile *profile);
+
+//Log the current dump (in verbose mode) and add it to the total
+void tcp_closer_profile_dump_done(struct tcp_closer_ctx *ctx);
+
+//Log the total of all workers
+void tcp_closer_profile_log(struct tcp_closer_ctx *ctx);
+
+//Disabled profiling costs one predictable branch
+#define TCP_CLOSER_PROFILE_ENTER(ctx, stage) \
+    do { \
+    if (__builtin_expect((ctx)->profile != NULL, 0)) \
+        tcp_closer_profile_enter((ctx)->profile, stage); \
+    } while (0)
+
+#define TCP_CLOSER_PROFILE_LEAVE(ctx) \
+    do { \
+    if (__builtin_expect((ctx)->profile != NULL, 0)) \
+        tcp_closer_profile_leave((ctx)->profile); \
+    } while (0)
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libmnl/libmnl.h>
+
+#include "tcp_closer_record.h"
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_match.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+static uint64_t record_get_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static struct tcp_closer_record *record_create(int fd, uint16_t worker)
+{
+    struct tcp_closer_record *record = calloc(sizeof(struct tcp_closer_record),
+                                              1);
+
+    if (!record) {
+        return NULL;
+    }
+
+    if (!(record->buf = malloc(RECORD_BUF_SIZE))) {
+        free(record);
+        return NULL;
+    }
+
+    record->fd = fd;
+    record->worker = worker;
+
+    return record;
+}
+
+bool tcp_closer_record_init(struct tcp_closer_ctx *ctx, const char *path)
+{
+    struct tcp_closer_record_hdr hdr;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open capture file "
+                                "%s. Error: %s (%u)\n", path, strerror(errno),
+                                errno);
+        return false;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RECORD_MAGIC;
+    hdr.version = RECORD_VERSION;
+    hdr.created = backend_get_time_ms();
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to write capture "
+                                "header. Error: %s (%u)\n", strerror(errno),
+                                errno);
+        close(fd);
+        return false;
+    }
+
+    if (!(ctx->record = record_create(fd, 0))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "capture buffer\n");
+        close(fd);
+        return false;
+    }
+
+    return true;
+}
+
+bool tcp_closer_record_clone(struct tcp_closer_ctx *worker,
+                             struct tcp_closer_ctx *ctx, uint16_t idx)
+{
+    if (!(worker->record = record_create(ctx->record->fd, idx))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "capture buffer\n");
+        return false;
+    }
+
+    return true;
+}
+
+void tcp_closer_record_flush(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_record *record = ctx->record;
+    ssize_t numbytes;
+
+    if (!record->buf_len) {
+        return;
+    }
+
+    numbytes = write(record->fd, record->buf, record->buf_len);
+
+    if (numbytes != record->buf_len) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to write %u bytes of "
+                                "capture. Error: %s (%u)\n", record->buf_len,
+                                numbytes < 0 ? strerror(errno) : "short write",
+                                numbytes < 0 ? errno : 0);
+    }
+
+    record->buf_len = 0;
+}
+
+void tcp_closer_record_add(struct tcp_closer_ctx *ctx, uint16_t type,
+                           const void *buf, uint32_t len)
+{
+    struct tcp_closer_record *record = ctx->record;
+    struct tcp_closer_record_entry *entry;
+    uint32_t record_len = sizeof(struct tcp_closer_record_entry) +
+                          RECORD_ALIGN(len);
+
+    //A dump datagram is at most RECV_SLOT_SIZE, so a record always fits in
+    //an empty buffer
+    if (record_len > RECORD_BUF_SIZE) {
+        return;
+    }
+
+    if (RECORD_BUF_SIZE - record->buf_len < record_len) {
+        tcp_closer_record_flush(ctx);
+    }
+
+    entry = (struct tcp_closer_record_entry*) (record->buf + record->buf_len);
+    entry->len = len;
+    entry->type = type;
+    entry->worker = record->worker;
+    entry->time_ns = record_get_time_ns();
+    memcpy(entry + 1, buf, len);
+    memset(((uint8_t*) (entry + 1)) + len, 0, RECORD_ALIGN(len) - len);
+
+    record->buf_len += record_len;
+}
+
+//Returns the entry at offset, or NULL if the file ends or the entry is
+//truncated
+static struct tcp_closer_record_entry *record_entry_at(uint8_t *map,
+                                                       size_t map_len,
+                                                       size_t offset)
+{
+    struct tcp_closer_record_entry *entry;
+
+    if (map_len - offset < sizeof(struct tcp_closer_record_entry)) {
+        return NULL;
+    }
+
+    entry = (struct tcp_closer_record_entry*) (map + offset);
+
+    if (map_len - offset - sizeof(struct tcp_closer_record_entry) <
+            RECORD_ALIGN((size_t) entry->len)) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void record_sleep_until(uint64_t time_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = time_ns / 1000000000ULL;
+    ts.tv_nsec = time_ns % 1000000000ULL;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+//Only the message headers are touched, so counting is cheap compared to
+//parsing
+static uint32_t record_count_sockets(const void *buf, int32_t len)
+{
+    const struct nlmsghdr *nlh = buf;
+    uint32_t num_sockets = 0;
+
+    while (mnl_nlmsg_ok(nlh, len)) {
+        if (nlh->nlmsg_type != NLMSG_DONE && nlh->nlmsg_type != NLMSG_ERROR) {
+            num_sockets++;
+        }
+
+        nlh = mnl_nlmsg_next(nlh, &len);
+    }
+
+    return num_sockets;
+}
+
+//Replaying a worker at a time keeps the dumps intact, since a large dump from
+//one worker can be split across several writes
+static void record_replay_worker(struct tcp_closer_ctx *ctx, uint8_t *map,
+                                 size_t map_len, uint16_t worker, bool paced,
+                                 uint64_t *num_datagrams, uint64_t *num_sockets)
+{
+    struct tcp_closer_record_entry *entry;
+    size_t offset = sizeof(struct tcp_closer_record_hdr);
+    uint64_t first_ns = 0, start_ns = record_get_time_ns();
+
+    while ((entry = record_entry_at(map, map_len, offset))) {
+        offset += sizeof(struct tcp_closer_record_entry) +
+                  RECORD_ALIGN((size_t) entry->len);
+
+        if (entry->worker != worker || entry->type != RECORD_TYPE_DUMP) {
+            continue;
+        }
+
+        if (!first_ns) {
+            first_ns = entry->time_ns;
+        }
+
+        if (paced) {
+            record_sleep_until(start_ns + (entry->time_ns - first_ns));
+        }
+
+        if (!ctx->dump_in_progress) {
+            tcp_closer_sched_dump_start(ctx);
+        }
+
+        (*num_datagrams)++;
+        *num_sockets += record_count_sockets(entry + 1, entry->len);
+        tcp_closer_netlink_parse_datagram(ctx, (uint8_t*) (entry + 1),
+                                          entry->len);
+    }
+}
+
+bool tcp_closer_record_replay(struct tcp_closer_ctx *ctx, const char *path,
+                              bool paced)
+{
+    struct tcp_closer_record_hdr *hdr;
+    struct tcp_closer_record_entry *entry;
+    struct stat st;
+    uint8_t *map;
+    size_t offset;
+    uint64_t start_ns, duration_ns, num_datagrams = 0, num_sockets = 0;
+    uint16_t max_worker = 0, worker;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to open capture file "
+                                "%s. Error: %s (%u)\n", path, strerror(errno),
+                                errno);
+        return false;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct tcp_closer_record_hdr)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Capture file %s is too "
+                                "short\n", path);
+        close(fd);
+        return false;
+    }
+
+    //Private and writable, since datagrams are parsed in place like the
+    //receive buffer
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to map capture file %s. "
+                                "Error: %s (%u)\n", path, strerror(errno),
+                                errno);
+        return false;
+    }
+
+    hdr = (struct tcp_closer_record_hdr*) map;
+
+    if (hdr->magic != RECORD_MAGIC || hdr->version != RECORD_VERSION) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "%s is not a capture file (or "
+                                "an unsupported version)\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    offset = sizeof(struct tcp_closer_record_hdr);
+
+    while ((entry = record_entry_at(map, st.st_size, offset))) {
+        if (entry->worker > max_worker) {
+            max_worker = entry->worker;
+        }
+
+        offset += sizeof(struct tcp_closer_record_entry) +
+                  RECORD_ALIGN((size_t) entry->len);
+    }
+
+    if (offset != (size_t) st.st_size) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Capture file %s is truncated, "
+                                "replaying the complete records\n", path);
+    }
+
+    start_ns = record_get_time_ns();
+
+    for (worker = 0; worker <= max_worker; worker++) {
+        record_replay_worker(ctx, map, st.st_size, worker, paced,
+                             &num_datagrams, &num_sockets);
+
+        //An incomplete dump at the end of the capture
+        ctx->dump_in_progress = false;
+    }
+
+    duration_ns = record_get_time_ns() - start_ns;
+    munmap(map, st.st_size);
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Replayed %lu dumps (%lu datagrams, "
+                            "%lu sockets) in %lums, %lu sockets/s (%s). "
+                            "Matched %lu sockets\n", ctx->stats->dumps,
+                            num_datagrams,
+                            num_sockets, duration_ns / 1000000,
+                            duration_ns ? (num_sockets * (uint64_t) 1000000000) /
+                                          duration_ns : 0,
+                            tcp_closer_match_range_name(ctx->match_range),
+                            ctx->stats->sockets_matched);
+
+    return true;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_RECORD_H
+#define TCP_CLOSER_RECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Capture file: a header followed by records. Every record is an entry header
+//followed by the raw netlink datagram, padded so that the next record starts
+//on an 8 byte boundary. The file can be mmap()ed and walked in place
+#define RECORD_MAGIC    0x52504354 //"TCPR"
+#define RECORD_VERSION  1
+#define RECORD_BUF_SIZE (256 * 1024)
+#define RECORD_ALIGN(len) (((len) + 7) & ~7)
+
+enum {
+    RECORD_TYPE_DUMP = 1,
+    RECORD_TYPE_DESTROY_ACK
+};
+
+struct tcp_closer_record_hdr {
+    uint32_t magic;
+    uint32_t version;
+    //Wallclock (ms) when the capture was started
+    uint64_t created;
+};
+
+struct tcp_closer_record_entry {
+    //Length of the datagram, excluding this header and padding
+    uint32_t len;
+    uint16_t type;
+    uint16_t worker;
+    //CLOCK_MONOTONIC, ns
+    uint64_t time_ns;
+};
+
+//Every worker has its own buffer, the file descriptor is shared. A buffer only
+//contains complete records and is written with a single write() (the file is
+//opened with O_APPEND), so records from different workers are never mixed up
+struct tcp_closer_record {
+    uint8_t *buf;
+    uint32_t buf_len;
+    int fd;
+    uint16_t worker;
+};
+
+struct tcp_closer_ctx;
+
+//Create the capture file at path and start recording
+bool tcp_closer_record_init(struct tcp_closer_ctx *ctx, const char *path);
+
+//Create the buffer of worker number idx, sharing the file of ctx
+bool tcp_closer_record_clone(struct tcp_closer_ctx *worker,
+                             struct tcp_closer_ctx *ctx, uint16_t idx);
+
+//Append one datagram received on the dump (RECORD_TYPE_DUMP) or destroy
+//(RECORD_TYPE_DESTROY_ACK) socket
+void tcp_closer_record_add(struct tcp_closer_ctx *ctx, uint16_t type,
+                           const void *buf, uint32_t len);
+
+void tcp_closer_record_flush(struct tcp_closer_ctx *ctx);
+
+//Feed the dump datagrams of a capture through the parser, worker by worker.
+//If paced is set, the datagrams are fed at the recorded pace, otherwise as
+//fast as possible. The throughput is logged when done
+bool tcp_closer_record_replay(struct tcp_closer_ctx *ctx, const char *path,
+                              bool paced);
+
+#endif
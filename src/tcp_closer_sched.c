@@ -0,0 +1,425 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_sched.h"
+#include "tcp_closer.h"
+#include "tcp_closer_probes.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+static const char *sched_reason_map[] = {
+    [SCHED_REASON_BASE] = "base interval",
+    [SCHED_REASON_RETURN_TO_BASE] = "returning to base interval",
+    [SCHED_REASON_EXPENSIVE_NO_MATCH] = "expensive dump without matches",
+    [SCHED_REASON_MATCHES_INCREASING] = "number of matches increasing",
+    [SCHED_REASON_MIN_LIMIT] = "limited by min_interval",
+    [SCHED_REASON_MAX_LIMIT] = "limited by max_interval"
+};
+
+const char *tcp_closer_sched_reason_str(uint8_t reason)
+{
+    if (reason >= SCHED_REASON_MAX) {
+        return "unknown";
+    }
+
+    return sched_reason_map[reason];
+}
+
+//Compute the next interval based on the cost of the last dump and the number
+//of matches. The base interval is what the user configured with --interval and
+//we always move back towards it when there is nothing special going on
+static uint8_t sched_next_interval(struct tcp_closer_ctx *ctx,
+                                   uint32_t *next_interval)
+{
+    uint32_t base_interval = ctx->dump_interval;
+    uint32_t cur_interval = ctx->cur_interval;
+    uint8_t reason;
+
+    if (ctx->dump_matched > ctx->last_dump_matched) {
+        //More and more sockets are matched, so tighten interval in order to
+        //react faster
+        *next_interval = cur_interval / 2;
+        reason = SCHED_REASON_MATCHES_INCREASING;
+    } else if (!ctx->dump_matched &&
+               ctx->last_dump_duration * SCHED_COST_RATIO > base_interval) {
+        //Dumping is expensive and we do not find anything, back off
+        *next_interval = cur_interval * 2;
+        reason = SCHED_REASON_EXPENSIVE_NO_MATCH;
+    } else if (cur_interval < base_interval) {
+        *next_interval = cur_interval * 2 > base_interval ? base_interval :
+                                                            cur_interval * 2;
+        reason = SCHED_REASON_RETURN_TO_BASE;
+    } else if (cur_interval > base_interval) {
+        *next_interval = cur_interval / 2 < base_interval ? base_interval :
+                                                            cur_interval / 2;
+        reason = SCHED_REASON_RETURN_TO_BASE;
+    } else {
+        *next_interval = base_interval;
+        reason = SCHED_REASON_BASE;
+    }
+
+    if (*next_interval < ctx->min_interval) {
+        *next_interval = ctx->min_interval;
+        reason = SCHED_REASON_MIN_LIMIT;
+    } else if (*next_interval > ctx->max_interval) {
+        *next_interval = ctx->max_interval;
+        reason = SCHED_REASON_MAX_LIMIT;
+    }
+
+    return reason;
+}
+
+static uint64_t sched_get_cpu_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+//Parse a list on the format used by taskset/cpuset, for example 0-3,6
+static bool sched_parse_cpu_list(const char *cpu_list, cpu_set_t *cpu_set)
+{
+    const char *cur = cpu_list;
+    char *end;
+    unsigned long first, last;
+
+    CPU_ZERO(cpu_set);
+
+    while (*cur) {
+        first = strtoul(cur, &end, 10);
+
+        if (end == cur) {
+            return false;
+        }
+
+        last = first;
+        cur = end;
+
+        if (*cur == '-') {
+            cur++;
+            last = strtoul(cur, &end, 10);
+
+            if (end == cur || last < first) {
+                return false;
+            }
+
+            cur = end;
+        }
+
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+
+        for (; first <= last; first++) {
+            CPU_SET(first, cpu_set);
+        }
+
+        if (*cur == ',') {
+            cur++;
+        } else if (*cur) {
+            return false;
+        }
+    }
+
+    return CPU_COUNT(cpu_set) > 0;
+}
+
+bool tcp_closer_sched_apply_cpu(struct tcp_closer_ctx *ctx)
+{
+    cpu_set_t cpu_set;
+    struct sched_param param;
+
+    if (ctx->cpu_list) {
+        if (!sched_parse_cpu_list(ctx->cpu_list, &cpu_set)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Invalid CPU list %s\n",
+                                    ctx->cpu_list);
+            return false;
+        }
+
+        if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to set CPU affinity. "
+                                    "Error: %s (%u)\n", strerror(errno),
+                                    errno);
+            return false;
+        }
+    }
+
+    //SCHED_IDLE and SCHED_BATCH require the static priority to be 0
+    if (ctx->sched_policy != SCHED_OTHER) {
+        memset(&param, 0, sizeof(param));
+
+        if (sched_setscheduler(0, ctx->sched_policy, &param)) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to set scheduling "
+                                    "policy. Error: %s (%u)\n",
+                                    strerror(errno), errno);
+            return false;
+        }
+    }
+
+    if (ctx->set_nice && setpriority(PRIO_PROCESS, 0, ctx->nice_value)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to set nice value. "
+                                "Error: %s (%u)\n", strerror(errno), errno);
+        return false;
+    }
+
+    return true;
+}
+
+//Write the port range of the current shard into the start of the shard filter.
+//A socket outside of the range jumps past the end of the filter (len becomes
+//negative) and is rejected, a socket inside the range continues to the port
+//filter
+static void sched_select_shard(struct tcp_closer_ctx *ctx)
+{
+    struct inet_diag_bc_op *ops = ctx->shard_filter;
+    uint32_t filter_len = ctx->diag_filter_len +
+                          sizeof(struct inet_diag_bc_op) *
+                          SCHED_SHARD_FILTER_OPS;
+    uint32_t range = ctx->shard_port_hi - ctx->shard_port_lo + 1;
+    uint32_t shard_width = range / ctx->num_shards;
+    uint16_t port_lo, port_hi;
+
+    port_lo = ctx->shard_port_lo + (ctx->shard_idx * shard_width);
+
+    if (ctx->shard_idx == ctx->num_shards - 1) {
+        port_hi = ctx->shard_port_hi;
+    } else {
+        port_hi = port_lo + shard_width - 1;
+    }
+
+    ops[0].code = ctx->shard_on_sport ? INET_DIAG_BC_S_GE : INET_DIAG_BC_D_GE;
+    ops[0].yes = sizeof(struct inet_diag_bc_op) * 2;
+    ops[0].no = filter_len + 4;
+    ops[1].code = INET_DIAG_BC_NOP;
+    ops[1].yes = sizeof(struct inet_diag_bc_op);
+    ops[1].no = port_lo;
+    ops[2].code = ctx->shard_on_sport ? INET_DIAG_BC_S_LE : INET_DIAG_BC_D_LE;
+    ops[2].yes = sizeof(struct inet_diag_bc_op) * 2;
+    ops[2].no = filter_len - (sizeof(struct inet_diag_bc_op) * 2) + 4;
+    ops[3].code = INET_DIAG_BC_NOP;
+    ops[3].yes = sizeof(struct inet_diag_bc_op);
+    ops[3].no = port_hi;
+
+    ctx->use_shard_filter = ctx->num_shards > 1 || ctx->shard_port_lo ||
+                            ctx->shard_port_hi != 0xFFFF;
+}
+
+bool tcp_closer_sched_init_shards(struct tcp_closer_ctx *ctx)
+{
+    uint32_t prefix_len = sizeof(struct inet_diag_bc_op) *
+                          SCHED_SHARD_FILTER_OPS;
+
+    ctx->shard_filter = calloc(ctx->diag_filter_len + prefix_len, 1);
+
+    if (!ctx->shard_filter) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "shard filter\n");
+        return false;
+    }
+
+    memcpy(((uint8_t*) ctx->shard_filter) + prefix_len, ctx->diag_filter,
+           ctx->diag_filter_len);
+
+    if (!ctx->num_shards) {
+        ctx->num_shards = 1;
+    }
+
+    sched_select_shard(ctx);
+    return true;
+}
+
+void tcp_closer_sched_set_port_range(struct tcp_closer_ctx *ctx, uint16_t lo,
+                                     uint16_t hi)
+{
+    ctx->shard_port_lo = lo;
+    ctx->shard_port_hi = hi;
+    ctx->shard_idx = 0;
+    sched_select_shard(ctx);
+}
+
+//Split the port space further if the last dump exceeded the CPU budget, merge
+//shards again after a full pass where the cost was well below the budget
+static void sched_update_shards(struct tcp_closer_ctx *ctx)
+{
+    uint32_t cpu_ms = ctx->last_dump_cpu_us / 1000;
+
+    if (cpu_ms > ctx->dump_budget && ctx->num_shards < SCHED_MAX_SHARDS) {
+        ctx->num_shards *= 2;
+        ctx->shard_idx = 0;
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Dump used %ums CPU (budget "
+                                "%ums), splitting dumps into %u shards\n",
+                                cpu_ms, ctx->dump_budget, ctx->num_shards);
+    } else if (++ctx->shard_idx >= ctx->num_shards) {
+        ctx->shard_idx = 0;
+
+        if (ctx->num_shards > 1 && cpu_ms * 4 < ctx->dump_budget) {
+            ctx->num_shards /= 2;
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Dump used %ums CPU (budget "
+                                    "%ums), reducing to %u shards\n", cpu_ms,
+                                    ctx->dump_budget, ctx->num_shards);
+        }
+    }
+
+    sched_select_shard(ctx);
+}
+
+void tcp_closer_sched_dump_start(struct tcp_closer_ctx *ctx)
+{
+    ctx->dump_in_progress = true;
+    ctx->dump_start = backend_get_time_ms();
+    ctx->dump_cpu_start = sched_get_cpu_time_ns();
+    ctx->dump_matched = 0;
+
+    TCP_CLOSER_PROBE2(dump__start, ctx->shard_port_lo, ctx->shard_port_hi);
+}
+
+void tcp_closer_sched_dump_done(struct tcp_closer_ctx *ctx)
+{
+    uint64_t cur_time = backend_get_time_ms();
+    uint32_t next_interval;
+    uint8_t reason;
+
+    ctx->dump_in_progress = false;
+    TCP_CLOSER_STATS_ADD(ctx, dumps, 1);
+    ctx->last_dump_duration = cur_time - ctx->dump_start;
+    ctx->last_dump_cpu_us = (sched_get_cpu_time_ns() - ctx->dump_cpu_start) /
+                            1000;
+
+    TCP_CLOSER_PROBE2(dump__end, ctx->last_dump_duration, ctx->dump_matched);
+    tcp_closer_sched_record_latency(ctx->dump_hist, ctx->last_dump_duration);
+
+    if (ctx->dump_budget) {
+        sched_update_shards(ctx);
+    }
+
+    if (ctx->adaptive_interval) {
+        reason = sched_next_interval(ctx, &next_interval);
+
+        if (next_interval != ctx->cur_interval ||
+            reason != ctx->interval_reason) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Dump interval: %ums "
+                                    "(%s). Last dump took %ums and matched %u "
+                                    "socket(s)\n", next_interval,
+                                    tcp_closer_sched_reason_str(reason),
+                                    ctx->last_dump_duration,
+                                    ctx->dump_matched);
+        }
+
+        ctx->cur_interval = next_interval;
+        ctx->interval_reason = reason;
+
+        //Next dump is scheduled relative to when this dump finished, so dumps
+        //never overlap. The timeout is periodic and always in the list while
+        //we wait for a dump to finish
+        backend_remove_timeout(ctx->dump_timeout);
+        ctx->dump_timeout->timeout_clock = cur_time + next_interval;
+        ctx->dump_timeout->intvl = next_interval;
+        backend_insert_timeout(ctx->event_loop, ctx->dump_timeout);
+    } else if (ctx->verbose_mode) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_DEBUG, "Dump took %ums (%uus CPU) "
+                                "and matched %u socket(s)\n",
+                                ctx->last_dump_duration,
+                                ctx->last_dump_cpu_us, ctx->dump_matched);
+    }
+
+    ctx->last_dump_matched = ctx->dump_matched;
+}
+
+bool tcp_closer_sched_init_latency(struct tcp_closer_ctx *ctx)
+{
+    ctx->latency_hist = calloc(SCHED_LATENCY_MAX_MS + 1, sizeof(uint32_t));
+    ctx->dump_hist = calloc(SCHED_LATENCY_MAX_MS + 1, sizeof(uint32_t));
+
+    return ctx->latency_hist != NULL && ctx->dump_hist != NULL;
+}
+
+//Sum of bucket idx of the latency (or dump time) histogram over all workers
+static uint64_t sched_latency_bucket(struct tcp_closer_ctx *ctx, bool dump,
+                                     uint32_t idx)
+{
+    uint64_t count = 0;
+    uint16_t i;
+
+    if (!ctx->workers) {
+        return dump ? ctx->dump_hist[idx] : ctx->latency_hist[idx];
+    }
+
+    for (i = 0; i < ctx->num_threads; i++) {
+        count += dump ? ctx->workers[i]->dump_hist[idx] :
+                        ctx->workers[i]->latency_hist[idx];
+    }
+
+    return count;
+}
+
+static void sched_log_hist(struct tcp_closer_ctx *ctx, bool dump)
+{
+    static const uint16_t percentiles[] = {500, 900, 990, 999};
+    uint32_t values[sizeof(percentiles) / sizeof(percentiles[0])] = {0};
+    uint64_t total = 0, count = 0;
+    uint32_t i, max = 0;
+    uint8_t pct_idx = 0;
+
+    for (i = 0; i <= SCHED_LATENCY_MAX_MS; i++) {
+        total += sched_latency_bucket(ctx, dump, i);
+    }
+
+    if (!total) {
+        return;
+    }
+
+    //Percentiles are in 1/1000
+    for (i = 0; i <= SCHED_LATENCY_MAX_MS; i++) {
+        if (!sched_latency_bucket(ctx, dump, i)) {
+            continue;
+        }
+
+        count += sched_latency_bucket(ctx, dump, i);
+        max = i;
+
+        while (pct_idx < sizeof(values) / sizeof(values[0]) &&
+               count * 1000 >= total * percentiles[pct_idx]) {
+            values[pct_idx++] = i;
+        }
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%s for %lu %s: p50 %ums p90 %ums "
+                            "p99 %ums p99.9 %ums max %ums%s\n",
+                            dump ? "Dump time" : "Idle-to-destroy latency",
+                            total, dump ? "dump(s)" : "socket(s)", values[0],
+                            values[1], values[2], values[3], max,
+                            max == SCHED_LATENCY_MAX_MS ? " (or more)" : "");
+}
+
+void tcp_closer_sched_log_latency(struct tcp_closer_ctx *ctx)
+{
+    sched_log_hist(ctx, false);
+    sched_log_hist(ctx, true);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_SCHED_H
+#define TCP_CLOSER_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//A dump is considered expensive if it takes more than 1/SCHED_COST_RATIO of
+//the configured interval
+#define SCHED_COST_RATIO        10
+#define SCHED_DEFAULT_MIN_INTVL 1000
+#define SCHED_DEFAULT_MAX_MULT  8
+
+//Max number of port ranges a dump will be split into when the CPU budget is
+//exceeded
+#define SCHED_MAX_SHARDS        64
+
+//A shard is selected by prepending a GE and a LE port comparison to the filter
+#define SCHED_SHARD_FILTER_OPS  4
+
+//Idle-to-destroy latencies are counted in 1ms buckets, larger latencies are
+//counted in the last bucket
+#define SCHED_LATENCY_MAX_MS    10000
+
+enum {
+    SCHED_REASON_BASE = 0,
+    SCHED_REASON_RETURN_TO_BASE,
+    SCHED_REASON_EXPENSIVE_NO_MATCH,
+    SCHED_REASON_MATCHES_INCREASING,
+    SCHED_REASON_MIN_LIMIT,
+    SCHED_REASON_MAX_LIMIT,
+    SCHED_REASON_MAX
+};
+
+struct tcp_closer_ctx;
+
+//Apply CPU affinity, scheduling policy and nice value (if set). Threads created
+//after this call inherit the settings
+bool tcp_closer_sched_apply_cpu(struct tcp_closer_ctx *ctx);
+
+//Allocate the shard filter. Must be called after the port filter is created
+bool tcp_closer_sched_init_shards(struct tcp_closer_ctx *ctx);
+
+//Restrict the dumps of ctx to ports in the range lo - hi (inclusive)
+void tcp_closer_sched_set_port_range(struct tcp_closer_ctx *ctx, uint16_t lo,
+                                     uint16_t hi);
+
+//Called when a dump request has been sent successfully
+void tcp_closer_sched_dump_start(struct tcp_closer_ctx *ctx);
+
+//Called when a dump is finished (or failed). Updates the dump statistics and,
+//if adaptive interval is enabled, computes and schedules the next dump
+void tcp_closer_sched_dump_done(struct tcp_closer_ctx *ctx);
+
+const char *tcp_closer_sched_reason_str(uint8_t reason);
+
+//Allocate the latency and dump time histograms of ctx
+bool tcp_closer_sched_init_latency(struct tcp_closer_ctx *ctx);
+
+//Record that a socket was destroyed latency ms after it became idle
+static inline void tcp_closer_sched_record_latency(uint32_t *latency_hist,
+                                                   uint32_t latency)
+{
+    latency_hist[latency < SCHED_LATENCY_MAX_MS ? latency :
+                                                  SCHED_LATENCY_MAX_MS]++;
+}
+
+//Log latency and dump time percentiles for all workers
+void tcp_closer_sched_log_latency(struct tcp_closer_ctx *ctx);
+
+#endif
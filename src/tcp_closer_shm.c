@@ -0,0 +1,227 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_shm.h"
+#include "tcp_closer.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+bool tcp_closer_shm_init(struct tcp_closer_ctx *ctx, const char *name)
+{
+    struct tcp_closer_shm_writer *writer;
+    struct tcp_closer_shm *seg;
+    int fd;
+
+    if (!(writer = calloc(sizeof(struct tcp_closer_shm_writer), 1))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "statistics segment\n");
+        return false;
+    }
+
+    //shm_open() expects a name starting with '/'
+    snprintf(writer->name, sizeof(writer->name), "%s%s",
+             name[0] == '/' ? "" : "/", name);
+
+    //Readers that have the old segment mapped keep their (stale) copy
+    shm_unlink(writer->name);
+    fd = shm_open(writer->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (fd < 0 || ftruncate(fd, sizeof(struct tcp_closer_shm)) < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create statistics "
+                                "segment %s. Error: %s (%u)\n", writer->name,
+                                strerror(errno), errno);
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(writer->name);
+        }
+        free(writer);
+        return false;
+    }
+
+    seg = mmap(NULL, sizeof(struct tcp_closer_shm), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (seg == MAP_FAILED) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to map statistics "
+                                "segment. Error: %s (%u)\n", strerror(errno),
+                                errno);
+        shm_unlink(writer->name);
+        free(writer);
+        return false;
+    }
+
+    seg->version = SHM_VERSION;
+    seg->size = sizeof(struct tcp_closer_shm);
+    seg->pid = getpid();
+    seg->started = backend_get_time_ms();
+    seg->num_workers = 1;
+    seg->idle_time = ctx->idle_time;
+    seg->workers[0].interval = ctx->dump_interval;
+    __atomic_store_n(&(seg->magic), SHM_MAGIC, __ATOMIC_RELEASE);
+
+    writer->seg = seg;
+    ctx->shm = writer;
+    ctx->shm_worker = &(seg->workers[0]);
+
+    return true;
+}
+
+void tcp_closer_shm_add_rule(struct tcp_closer_ctx *ctx, uint16_t port,
+                             uint8_t side)
+{
+    struct tcp_closer_shm_writer *writer = ctx->shm;
+    struct tcp_closer_shm_rule *rule;
+
+    //Ports can be given more than once
+    if (writer->rule_idx[side][port] ||
+        writer->seg->num_rules == SHM_MAX_RULES) {
+        return;
+    }
+
+    rule = &(writer->seg->rules[writer->seg->num_rules++]);
+    rule->port = port;
+    rule->side = side;
+    writer->rule_idx[side][port] = writer->seg->num_rules;
+}
+
+void tcp_closer_shm_clone(struct tcp_closer_ctx *worker,
+                          struct tcp_closer_ctx *ctx, uint16_t idx)
+{
+    struct tcp_closer_shm *seg = ctx->shm->seg;
+
+    worker->shm_worker = &(seg->workers[idx]);
+    worker->shm_worker->interval = ctx->dump_interval;
+
+    if (idx >= seg->num_workers) {
+        seg->num_workers = idx + 1;
+    }
+}
+
+void tcp_closer_shm_match(struct tcp_closer_ctx *ctx,
+                          struct inet_diag_msg *diag_msg,
+                          uint32_t last_data_recv, uint8_t action)
+{
+    struct tcp_closer_shm_writer *writer = ctx->shm;
+    struct tcp_closer_shm *seg = writer->seg;
+    uint16_t sport = ntohs(diag_msg->id.idiag_sport);
+    uint16_t dport = ntohs(diag_msg->id.idiag_dport);
+    struct tcp_closer_shm_decision *decision;
+    uint8_t idx;
+    uint64_t n;
+
+    if ((idx = writer->rule_idx[SHM_RULE_SPORT][sport])) {
+        __atomic_add_fetch(&(seg->rules[idx - 1].matched), 1,
+                           __ATOMIC_RELAXED);
+    }
+
+    if ((idx = writer->rule_idx[SHM_RULE_DPORT][dport])) {
+        __atomic_add_fetch(&(seg->rules[idx - 1].matched), 1,
+                           __ATOMIC_RELAXED);
+    }
+
+    //Slots are claimed without a lock. If the ring wraps around while a slot
+    //is written (SHM_RING_SIZE matches in between), the entry can be mixed up.
+    //It is only a log of recent decisions, so this is accepted
+    n = __atomic_fetch_add(&(seg->ring_head), 1, __ATOMIC_RELAXED);
+    decision = &(seg->ring[n % SHM_RING_SIZE]);
+
+    __atomic_store_n(&(decision->seq), (n * 2) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    decision->time = backend_get_time_ms();
+    memcpy(decision->saddr, diag_msg->id.idiag_src, sizeof(decision->saddr));
+    memcpy(decision->daddr, diag_msg->id.idiag_dst, sizeof(decision->daddr));
+    decision->last_data_recv = last_data_recv;
+    decision->sport = sport;
+    decision->dport = dport;
+    decision->family = diag_msg->idiag_family;
+    decision->action = action;
+
+    __atomic_store_n(&(decision->seq), (n + 1) * 2, __ATOMIC_RELEASE);
+}
+
+static void shm_publish_counters(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_shm_counters *counters = &(ctx->shm->seg->counters);
+    struct tcp_closer_stats *stats = ctx->stats;
+
+    tcp_closer_shm_write_begin(&(ctx->shm->seg->seq));
+    counters->dumps = __atomic_load_n(&(stats->dumps), __ATOMIC_RELAXED);
+    counters->sockets_matched = __atomic_load_n(&(stats->sockets_matched),
+                                                __ATOMIC_RELAXED);
+    counters->destroy_sent = __atomic_load_n(&(stats->destroy_sent),
+                                             __ATOMIC_RELAXED);
+    counters->destroy_failed = __atomic_load_n(&(stats->destroy_failed),
+                                               __ATOMIC_RELAXED);
+    counters->destroy_fallbacks = __atomic_load_n(&(stats->destroy_fallbacks),
+                                                  __ATOMIC_RELAXED);
+    counters->proc_shutdowns = __atomic_load_n(&(stats->proc_shutdowns),
+                                               __ATOMIC_RELAXED);
+    counters->proc_kills = __atomic_load_n(&(stats->proc_kills),
+                                           __ATOMIC_RELAXED);
+    counters->datagrams = __atomic_load_n(&(stats->datagrams),
+                                          __ATOMIC_RELAXED);
+    counters->overruns = __atomic_load_n(&(stats->overruns), __ATOMIC_RELAXED);
+    counters->dump_restarts = __atomic_load_n(&(stats->dump_restarts),
+                                              __ATOMIC_RELAXED);
+    tcp_closer_shm_write_end(&(ctx->shm->seg->seq));
+}
+
+void tcp_closer_shm_dump_done(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_shm_worker *worker = ctx->shm_worker;
+
+    tcp_closer_shm_write_begin(&(worker->seq));
+    worker->dumps++;
+    worker->last_dump_end = backend_get_time_ms();
+    worker->last_dump_duration = ctx->last_dump_duration;
+    worker->last_dump_cpu_us = ctx->last_dump_cpu_us;
+    worker->last_dump_matched = ctx->dump_matched;
+    worker->interval = ctx->adaptive_interval ? ctx->cur_interval :
+                                                ctx->dump_interval;
+    worker->destroy_queue = ctx->destroy_batch_len;
+    worker->proc_queue = ctx->proc_inodes_len;
+    tcp_closer_shm_write_end(&(worker->seq));
+
+    //The statistics are shared, so any worker can publish them. If another
+    //worker is publishing, this snapshot would be (almost) the same
+    if (__atomic_test_and_set(&(ctx->shm->lock), __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    shm_publish_counters(ctx);
+    __atomic_clear(&(ctx->shm->lock), __ATOMIC_RELEASE);
+}
+
+void tcp_closer_shm_close(struct tcp_closer_ctx *ctx)
+{
+    //All workers have stopped, so this is the final state
+    shm_publish_counters(ctx);
+    shm_unlink(ctx->shm->name);
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_SHM_H
+#define TCP_CLOSER_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Layout of the statistics segment (--shm), shared with tcp-closer-top. The
+//daemon only writes to memory, readers map the segment read-only, so reading
+//never affects the daemon. Parts that are updated together are protected by
+//a sequence lock: seq is odd while a writer is updating, and a reader retries
+//if seq was odd or changed during its copy. Counters that are only ever
+//incremented are read directly
+#define SHM_MAGIC           0x4d484354 //"TCHM"
+#define SHM_VERSION         1
+#define SHM_MAX_RULES       128
+#define SHM_MAX_WORKERS     64
+#define SHM_RING_SIZE       256
+#define SHM_DEFAULT_NAME    "/tcp_closer"
+
+enum {
+    SHM_RULE_SPORT = 0,
+    SHM_RULE_DPORT
+};
+
+enum {
+    SHM_ACTION_DESTROY = 0,
+    SHM_ACTION_PROC,
+    SHM_ACTION_DRY_RUN
+};
+
+//One per given port. A socket that matches both a source and a destination
+//port is counted for both
+struct tcp_closer_shm_rule {
+    uint64_t matched;
+    uint16_t port;
+    uint8_t side;
+    uint8_t pad[5];
+};
+
+struct tcp_closer_shm_counters {
+    uint64_t dumps;
+    uint64_t sockets_matched;
+    uint64_t destroy_sent;
+    uint64_t destroy_failed;
+    uint64_t destroy_fallbacks;
+    uint64_t proc_shutdowns;
+    uint64_t proc_kills;
+    uint64_t datagrams;
+    uint64_t overruns;
+    uint64_t dump_restarts;
+};
+
+//Written by the worker when it has completed a dump. Queue depths are the
+//destroy requests not sent yet and the sockets waiting to be closed through
+///proc, when the dump was done
+struct tcp_closer_shm_worker {
+    uint32_t seq;
+    uint32_t interval;
+    uint64_t dumps;
+    uint64_t last_dump_end;
+    uint32_t last_dump_duration;
+    uint32_t last_dump_cpu_us;
+    uint32_t last_dump_matched;
+    uint32_t destroy_queue;
+    uint32_t proc_queue;
+    uint32_t pad;
+};
+
+//A matched socket. Slots are claimed by incrementing ring_head, slot number n
+//is written to ring[n % SHM_RING_SIZE] and seq is (n + 1) * 2 when done
+struct tcp_closer_shm_decision {
+    uint64_t seq;
+    uint64_t time;
+    uint32_t saddr[4];
+    uint32_t daddr[4];
+    uint32_t last_data_recv;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t family;
+    uint8_t action;
+    uint8_t pad[6];
+};
+
+//Times are wallclock in ms. magic is written last when the segment is created
+struct tcp_closer_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t pid;
+    uint64_t started;
+    uint32_t num_rules;
+    uint32_t num_workers;
+    uint32_t idle_time;
+    uint32_t seq;
+    struct tcp_closer_shm_counters counters;
+    struct tcp_closer_shm_rule rules[SHM_MAX_RULES];
+    struct tcp_closer_shm_worker workers[SHM_MAX_WORKERS];
+    uint64_t ring_head;
+    struct tcp_closer_shm_decision ring[SHM_RING_SIZE];
+};
+
+static inline void tcp_closer_shm_write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void tcp_closer_shm_write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+//Copy len bytes from src, protected by seq, into dst
+static inline void tcp_closer_shm_read(const uint32_t *seq, void *dst,
+                                       const void *src, uint32_t len)
+{
+    uint32_t start;
+
+    do {
+        start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        __builtin_memcpy(dst, src, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((start & 1) || start != __atomic_load_n(seq, __ATOMIC_RELAXED));
+}
+
+struct tcp_closer_ctx;
+struct inet_diag_msg;
+
+//Daemon side. The segment and the port lookup tables are shared by all
+//workers, while every worker writes its own tcp_closer_shm_worker
+struct tcp_closer_shm_writer {
+    struct tcp_closer_shm *seg;
+    char name[64];
+
+    //Rule index + 1 of every source and destination port, 0 if not a rule
+    uint8_t rule_idx[2][65536];
+
+    //Serializes writers of the counters
+    bool lock;
+};
+
+//Create (or replace) the segment with the given name under /dev/shm
+bool tcp_closer_shm_init(struct tcp_closer_ctx *ctx, const char *name);
+
+//Add a port given on the command line, side is SHM_RULE_SPORT/DPORT
+void tcp_closer_shm_add_rule(struct tcp_closer_ctx *ctx, uint16_t port,
+                             uint8_t side);
+
+//Let worker number idx write to its own part of the segment
+void tcp_closer_shm_clone(struct tcp_closer_ctx *worker,
+                          struct tcp_closer_ctx *ctx, uint16_t idx);
+
+//Count a matched socket for its rule(s) and add it to the recent decisions.
+//action is one of SHM_ACTION_*
+void tcp_closer_shm_match(struct tcp_closer_ctx *ctx,
+                          struct inet_diag_msg *diag_msg,
+                          uint32_t last_data_recv, uint8_t action);
+
+//Publish the state of the worker and the global counters
+void tcp_closer_shm_dump_done(struct tcp_closer_ctx *ctx);
+
+//Publish the final counters and remove the segment. Readers that have it
+//mapped keep the last state
+void tcp_closer_shm_close(struct tcp_closer_ctx *ctx);
+
+#endif
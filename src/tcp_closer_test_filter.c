@@ -0,0 +1,360 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Check the filters written by tcp_closer_lib_filter_write() against
+//tcp_closer_lib_filter_run(). A filter must pass the audit and match a socket
+//exactly when its source port is in the source ports (if any) and its
+//destination port in the destination ports (if any).
+//
+//Built as a test that checks random port sets (tcp-closer-test-filter, the
+//seed and number of sets can be given as arguments) and, with -DFUZZ=ON, as a
+//libFuzzer target that reads the port sets from the input
+//(tcp-closer-fuzz-filter). The test also prints the throughput of the
+//interpreter for filters of different sizes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_lib.h"
+
+//Same limit as tcp_closer (MAX_NUM_PORTS)
+#define TEST_MAX_PORTS 128
+#define TEST_RANDOM_SOCKS 64
+
+//Sockets run through the interpreter per filter size when measuring its
+//throughput, and the number of different sockets they are taken from
+#define TEST_BENCH_RUNS 2000000
+#define TEST_BENCH_SOCKS 4096
+
+static bool test_port_in_list(const uint16_t *ports, uint16_t num_ports,
+                              uint16_t port)
+{
+    uint16_t i;
+
+    for (i = 0; i < num_ports; i++) {
+        if (ports[i] == port) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool test_sock(const void *filter, uint32_t filter_len,
+                      const uint16_t *sports, uint16_t num_sport,
+                      const uint16_t *dports, uint16_t num_dport,
+                      uint16_t sport, uint16_t dport)
+{
+    struct tcp_closer_lib_sock sock;
+    bool expected, match;
+
+    memset(&sock, 0, sizeof(sock));
+    sock.family = AF_INET;
+    sock.sport = sport;
+    sock.dport = dport;
+
+    expected = (!num_sport || test_port_in_list(sports, num_sport, sport)) &&
+               (!num_dport || test_port_in_list(dports, num_dport, dport));
+    match = !filter_len ||
+            tcp_closer_lib_filter_run(filter, filter_len, &sock);
+
+    if (match != expected) {
+        fprintf(stderr, "Filter for %u source and %u destination port(s) %s "
+                "sport %u dport %u\n", num_sport, num_dport,
+                expected ? "does not match" : "matches", sport, dport);
+        return false;
+    }
+
+    return true;
+}
+
+//The ports to try for one side: 0, 65535, every configured port of either
+//side and its neighbours, and a few random ports
+static uint16_t test_candidates(uint16_t *candidates, const uint16_t *sports,
+                                uint16_t num_sport, const uint16_t *dports,
+                                uint16_t num_dport, uint32_t (*rnd)(void *),
+                                void *rnd_data)
+{
+    uint16_t num = 0, i;
+
+    candidates[num++] = 0;
+    candidates[num++] = 0xFFFF;
+
+    for (i = 0; i < num_sport; i++) {
+        candidates[num++] = sports[i] - 1;
+        candidates[num++] = sports[i];
+        candidates[num++] = sports[i] + 1;
+    }
+
+    for (i = 0; i < num_dport; i++) {
+        candidates[num++] = dports[i] - 1;
+        candidates[num++] = dports[i];
+        candidates[num++] = dports[i] + 1;
+    }
+
+    for (i = 0; i < TEST_RANDOM_SOCKS; i++) {
+        candidates[num++] = rnd(rnd_data);
+    }
+
+    return num;
+}
+
+static bool test_filter(const uint16_t *sports, uint16_t num_sport,
+                        const uint16_t *dports, uint16_t num_dport,
+                        uint32_t (*rnd)(void *), void *rnd_data)
+{
+    uint16_t candidates[3 * TEST_MAX_PORTS + 2 + TEST_RANDOM_SOCKS];
+    uint32_t filter_len = tcp_closer_lib_filter_len(num_sport, num_dport);
+    uint16_t num_candidates, i, other;
+    struct inet_diag_bc_op *filter = NULL;
+    bool retval = false;
+
+    if (filter_len) {
+        filter = calloc(1, filter_len);
+
+        if (!filter) {
+            fprintf(stderr, "Failed to allocate filter\n");
+            return false;
+        }
+
+        tcp_closer_lib_filter_write(filter, sports, num_sport, dports,
+                                    num_dport);
+
+        if (!tcp_closer_lib_filter_audit(filter, filter_len)) {
+            fprintf(stderr, "Filter for %u source and %u destination port(s) "
+                    "fails the audit\n", num_sport, num_dport);
+            goto out;
+        }
+    }
+
+    num_candidates = test_candidates(candidates, sports, num_sport, dports,
+                                     num_dport, rnd, rnd_data);
+
+    //Every candidate on one side, against a port the other side accepts (if
+    //any) and against a random candidate
+    for (i = 0; i < num_candidates; i++) {
+        other = candidates[rnd(rnd_data) % num_candidates];
+
+        if (!test_sock(filter, filter_len, sports, num_sport, dports,
+                       num_dport, candidates[i],
+                       num_dport ? dports[i % num_dport] : other) ||
+            !test_sock(filter, filter_len, sports, num_sport, dports,
+                       num_dport, num_sport ? sports[i % num_sport] : other,
+                       candidates[i]) ||
+            !test_sock(filter, filter_len, sports, num_sport, dports,
+                       num_dport, candidates[i], other)) {
+            goto out;
+        }
+    }
+
+    retval = true;
+out:
+    free(filter);
+    return retval;
+}
+
+#ifdef TCP_CLOSER_FUZZ
+struct fuzz_input {
+    const uint8_t *data;
+    size_t size;
+};
+
+//Consume the input two bytes at a time, and zeros when it runs out
+static uint32_t fuzz_rnd(void *ptr)
+{
+    struct fuzz_input *input = ptr;
+    uint32_t val = 0;
+
+    if (input->size >= 2) {
+        val = (input->data[0] << 8) | input->data[1];
+        input->data += 2;
+        input->size -= 2;
+    }
+
+    return val;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint16_t sports[TEST_MAX_PORTS], dports[TEST_MAX_PORTS];
+    struct fuzz_input input = { data, size };
+    uint16_t num_sport, num_dport, i;
+
+    num_sport = fuzz_rnd(&input) % (TEST_MAX_PORTS + 1);
+    num_dport = fuzz_rnd(&input) % (TEST_MAX_PORTS - num_sport + 1);
+
+    for (i = 0; i < num_sport; i++) {
+        sports[i] = fuzz_rnd(&input);
+    }
+
+    for (i = 0; i < num_dport; i++) {
+        dports[i] = fuzz_rnd(&input);
+    }
+
+    if (!test_filter(sports, num_sport, dports, num_dport, fuzz_rnd,
+                     &input)) {
+        abort();
+    }
+
+    return 0;
+}
+#else
+//Fill ports with num_ports ports. Ports are mostly clustered, so that the
+//sets contain neighbours and duplicates, which is where off-by-one mistakes in
+//the comparisons show up
+static void test_random_ports(uint16_t *ports, uint16_t num_ports,
+                              uint32_t (*rnd)(void *), void *rnd_data)
+{
+    uint16_t base = rnd(rnd_data), i;
+
+    for (i = 0; i < num_ports; i++) {
+        if (rnd(rnd_data) % 4) {
+            ports[i] = base + rnd(rnd_data) % 8;
+        } else {
+            ports[i] = rnd(rnd_data);
+        }
+    }
+}
+
+//xorshift32, so that a failing seed gives the same port sets everywhere
+static uint32_t test_rnd(void *ptr)
+{
+    uint32_t *state = ptr;
+
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state;
+}
+
+static uint64_t test_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Run TEST_BENCH_RUNS sockets through the filter for num_ports source ports.
+//Half of the sockets match, a socket that does not match is compared against
+//every port
+static bool test_throughput(uint16_t num_ports, uint32_t *state)
+{
+    uint32_t filter_len = tcp_closer_lib_filter_len(num_ports, 0);
+    struct tcp_closer_lib_sock *socks;
+    uint16_t ports[TEST_MAX_PORTS], i;
+    struct inet_diag_bc_op *filter;
+    uint32_t run, num_matched = 0;
+    uint64_t elapsed;
+
+    filter = calloc(1, filter_len);
+    socks = calloc(TEST_BENCH_SOCKS, sizeof(struct tcp_closer_lib_sock));
+
+    if (!filter || !socks) {
+        fprintf(stderr, "Failed to allocate filter\n");
+        free(filter);
+        free(socks);
+        return false;
+    }
+
+    //Ports 1 - num_ports are matched, non-matching sockets use a higher port
+    for (i = 0; i < num_ports; i++) {
+        ports[i] = i + 1;
+    }
+
+    tcp_closer_lib_filter_write(filter, ports, num_ports, NULL, 0);
+
+    for (run = 0; run < TEST_BENCH_SOCKS; run++) {
+        socks[run].family = AF_INET;
+        socks[run].sport = run % 2 ? ports[test_rnd(state) % num_ports] :
+                                     num_ports + 1 + test_rnd(state) % 1000;
+        socks[run].dport = test_rnd(state);
+    }
+
+    elapsed = test_time_ns();
+
+    for (run = 0; run < TEST_BENCH_RUNS; run++) {
+        num_matched += tcp_closer_lib_filter_run(filter, filter_len,
+                                                 &(socks[run %
+                                                         TEST_BENCH_SOCKS]));
+    }
+
+    elapsed = test_time_ns() - elapsed;
+
+    fprintf(stdout, "Interpreter, %u source port(s): %.1fns/socket (%.1fM "
+            "sockets/s)\n", num_ports, (double) elapsed / TEST_BENCH_RUNS,
+            TEST_BENCH_RUNS * 1000.0 / (elapsed ? elapsed : 1));
+
+    free(filter);
+    free(socks);
+    return num_matched == TEST_BENCH_RUNS / 2;
+}
+
+int main(int argc, char *argv[])
+{
+    uint16_t sports[TEST_MAX_PORTS], dports[TEST_MAX_PORTS];
+    uint32_t seed = 1, num_sets = 20000, state, i;
+    uint16_t num_sport, num_dport;
+
+    if (argc > 1) {
+        seed = strtoul(argv[1], NULL, 10);
+    }
+
+    if (argc > 2) {
+        num_sets = strtoul(argv[2], NULL, 10);
+    }
+
+    //xorshift never leaves 0
+    state = seed ? seed : 1;
+
+    for (i = 0; i < num_sets; i++) {
+        //Mostly small sets, like most configurations, but also full ones
+        if (test_rnd(&state) % 8) {
+            num_sport = test_rnd(&state) % 9;
+            num_dport = test_rnd(&state) % 9;
+        } else {
+            num_sport = test_rnd(&state) % (TEST_MAX_PORTS + 1);
+            num_dport = test_rnd(&state) % (TEST_MAX_PORTS - num_sport + 1);
+        }
+
+        test_random_ports(sports, num_sport, test_rnd, &state);
+        test_random_ports(dports, num_dport, test_rnd, &state);
+
+        if (!test_filter(sports, num_sport, dports, num_dport, test_rnd,
+                         &state)) {
+            fprintf(stderr, "Port set %u of seed %u failed\n", i, seed);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(stdout, "Checked %u port sets (seed %u)\n", num_sets, seed);
+
+    if (!test_throughput(1, &state) || !test_throughput(8, &state) ||
+        !test_throughput(TEST_MAX_PORTS, &state)) {
+        fprintf(stderr, "Interpreter matched the wrong number of sockets\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Check that the flow table keeps the flows of every shard when dumps are
+//split with --dump_budget. Dumps are simulated by feeding the sockets of the
+//current shard to tcp_closer_flows_update() and moving through the shards the
+//way tcp_closer_sched.c does, including splitting the shards in the middle of
+//a cycle. A flow must keep its first seen time as long as it exists, and only
+//be removed once every shard has been dumped without it.
+//
+//The snapshot is checked by saving a table of TEST_SNAPSHOT_FLOWS flows,
+//loading it into a new table and dumping the same sockets again. The time it
+//takes to save and load the snapshot is printed
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer.h"
+#include "tcp_closer_flows.h"
+
+#define TEST_NUM_SOCKETS 4000
+#define TEST_DUMP_INTVL 1000
+#define TEST_SNAPSHOT_FLOWS 1000000
+
+//Port of socket idx, spread over the whole port space so that every shard has
+//sockets
+static uint16_t test_port(uint32_t idx)
+{
+    return (idx * 7919) & 0xFFFF;
+}
+
+//Shard that the port belongs to, computed like sched_select_shard()
+static uint16_t test_shard(uint16_t port, uint16_t num_shards)
+{
+    uint32_t width = 0x10000 / num_shards;
+
+    return port / width >= num_shards ? num_shards - 1 : port / width;
+}
+
+//Socket idx has been closed if closed_mod is set and idx is a multiple of it
+static bool test_is_open(uint32_t idx, uint32_t closed_mod)
+{
+    return !closed_mod || idx % closed_mod;
+}
+
+//Dump the current shard (ctx->shard_idx of ctx->num_shards). first_seen is
+//the time every socket was first dumped, the age reported by the flow table
+//must match it
+static bool test_dump(struct tcp_closer_ctx *ctx, uint64_t *first_seen,
+                      uint32_t closed_mod)
+{
+    struct inet_diag_msg diag_msg;
+    uint64_t age;
+    uint32_t idx;
+
+    ctx->dump_start += TEST_DUMP_INTVL;
+
+    for (idx = 0; idx < TEST_NUM_SOCKETS; idx++) {
+        if (!test_is_open(idx, closed_mod) ||
+            test_shard(test_port(idx), ctx->num_shards) != ctx->shard_idx) {
+            continue;
+        }
+
+        memset(&diag_msg, 0, sizeof(diag_msg));
+        diag_msg.idiag_inode = idx + 1;
+        diag_msg.id.idiag_sport = htons(5555);
+        diag_msg.id.idiag_dport = htons(test_port(idx));
+
+        if (!first_seen[idx]) {
+            first_seen[idx] = ctx->dump_start;
+        }
+
+        age = tcp_closer_flows_update(ctx, &diag_msg);
+
+        if (age != ctx->dump_start - first_seen[idx]) {
+            fprintf(stderr, "Socket %u in shard %u/%u: age %lu, expected "
+                    "%lu\n", idx, ctx->shard_idx, ctx->num_shards, age,
+                    ctx->dump_start - first_seen[idx]);
+            return false;
+        }
+    }
+
+    tcp_closer_flows_dump_done(ctx);
+    return true;
+}
+
+//Number of flows that should be in the table after a dump, i.e., sockets that
+//have been dumped. Sockets closed since the last full cycle (removed_mod) are
+//only removed when the last shard has been dumped
+static uint32_t test_expected(const struct tcp_closer_ctx *ctx,
+                              const uint64_t *first_seen,
+                              uint32_t removed_mod, uint32_t closed_mod)
+{
+    uint32_t idx, num_flows = 0;
+
+    if (ctx->shard_idx + 1 < ctx->num_shards) {
+        closed_mod = removed_mod;
+    }
+
+    for (idx = 0; idx < TEST_NUM_SOCKETS; idx++) {
+        if (first_seen[idx] && test_is_open(idx, closed_mod)) {
+            num_flows++;
+        }
+    }
+
+    return num_flows;
+}
+
+//Dump the shards from ctx->shard_idx to the end of the cycle, checking the
+//size of the flow table after each dump. Every socket that is a multiple of
+//closed_mod has been closed, the ones that are multiples of *removed_mod were
+//already removed by the previous cycle
+static bool test_cycle(struct tcp_closer_ctx *ctx, uint64_t *first_seen,
+                       uint32_t *removed_mod, uint32_t closed_mod,
+                       uint16_t num_dumps)
+{
+    uint32_t expected;
+
+    for (; num_dumps; num_dumps--) {
+        if (!test_dump(ctx, first_seen, closed_mod)) {
+            return false;
+        }
+
+        expected = test_expected(ctx, first_seen, *removed_mod, closed_mod);
+
+        if (ctx->flows->num_flows != expected) {
+            fprintf(stderr, "%u flows after shard %u/%u, expected %u\n",
+                    ctx->flows->num_flows, ctx->shard_idx, ctx->num_shards,
+                    expected);
+            return false;
+        }
+
+        if (++ctx->shard_idx == ctx->num_shards) {
+            ctx->shard_idx = 0;
+            *removed_mod = closed_mod;
+        }
+    }
+
+    return true;
+}
+
+static bool test_shards(FILE *logfile, uint16_t num_shards)
+{
+    struct tcp_closer_ctx *ctx = calloc(sizeof(struct tcp_closer_ctx), 1);
+    uint64_t *first_seen = calloc(TEST_NUM_SOCKETS, sizeof(uint64_t));
+    uint32_t removed_mod = 0;
+    bool retval;
+
+    if (!ctx || !first_seen) {
+        return false;
+    }
+
+    ctx->logfile = logfile;
+    ctx->num_shards = num_shards;
+
+    if (!tcp_closer_flows_init(ctx, NULL)) {
+        return false;
+    }
+
+    //Two full cycles, then one where every tenth socket has been closed. Then
+    //every fifth socket is closed, and the cycle is interrupted by splitting
+    //the shards after the first dump (the scheduler restarts from the first
+    //shard). Finally a full cycle with the new number of shards
+    retval = test_cycle(ctx, first_seen, &removed_mod, 0, num_shards * 2) &&
+             test_cycle(ctx, first_seen, &removed_mod, 10, num_shards);
+
+    if (retval && num_shards > 1) {
+        retval = test_cycle(ctx, first_seen, &removed_mod, 5, 1);
+        ctx->num_shards *= 2;
+        ctx->shard_idx = 0;
+    }
+
+    retval = retval &&
+             test_cycle(ctx, first_seen, &removed_mod, 5, ctx->num_shards);
+
+    fprintf(stdout, "%u shard(s): %s, %u flows\n", num_shards,
+            retval ? "OK" : "FAILED", ctx->flows->num_flows);
+
+    return retval;
+}
+
+static uint64_t test_time_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//Dump TEST_SNAPSHOT_FLOWS sockets, the first seen time of each is its inode
+static bool test_snapshot_dump(struct tcp_closer_ctx *ctx)
+{
+    struct inet_diag_msg diag_msg;
+    uint32_t idx;
+
+    memset(&diag_msg, 0, sizeof(diag_msg));
+    diag_msg.id.idiag_sport = htons(5555);
+
+    for (idx = 1; idx <= TEST_SNAPSHOT_FLOWS; idx++) {
+        ctx->dump_start = idx;
+        diag_msg.idiag_inode = idx;
+        diag_msg.id.idiag_dport = htons(test_port(idx));
+
+        if (tcp_closer_flows_update(ctx, &diag_msg)) {
+            return false;
+        }
+    }
+
+    tcp_closer_flows_dump_done(ctx);
+    return ctx->flows->num_flows == TEST_SNAPSHOT_FLOWS;
+}
+
+static bool test_snapshot(FILE *logfile, const char *path)
+{
+    struct tcp_closer_ctx *ctx = calloc(sizeof(struct tcp_closer_ctx), 1);
+    struct tcp_closer_ctx *loaded = calloc(sizeof(struct tcp_closer_ctx), 1);
+    struct inet_diag_msg diag_msg;
+    uint64_t save_us, load_us;
+    uint32_t idx;
+
+    if (!ctx || !loaded) {
+        return false;
+    }
+
+    ctx->logfile = logfile;
+    ctx->num_shards = 1;
+    loaded->logfile = logfile;
+    loaded->num_shards = 1;
+
+    if (!tcp_closer_flows_init(ctx, path) || !test_snapshot_dump(ctx)) {
+        fprintf(stderr, "Failed to create flows\n");
+        return false;
+    }
+
+    save_us = test_time_us();
+
+    if (!tcp_closer_flows_save(ctx)) {
+        return false;
+    }
+
+    save_us = test_time_us() - save_us;
+    load_us = test_time_us();
+
+    if (!tcp_closer_flows_init(loaded, path)) {
+        return false;
+    }
+
+    load_us = test_time_us() - load_us;
+
+    fprintf(stdout, "Snapshot of %u flows: saved in %lu.%03lums, loaded in "
+            "%lu.%03lums\n", loaded->flows->num_flows, save_us / 1000,
+            save_us % 1000, load_us / 1000, load_us % 1000);
+
+    if (loaded->flows->num_flows != TEST_SNAPSHOT_FLOWS) {
+        fprintf(stderr, "Loaded %u flows, expected %u\n",
+                loaded->flows->num_flows, TEST_SNAPSHOT_FLOWS);
+        return false;
+    }
+
+    //Every flow keeps the first seen time it had before the restart
+    memset(&diag_msg, 0, sizeof(diag_msg));
+    diag_msg.id.idiag_sport = htons(5555);
+    loaded->dump_start = TEST_SNAPSHOT_FLOWS + 1;
+
+    for (idx = 1; idx <= TEST_SNAPSHOT_FLOWS; idx++) {
+        diag_msg.idiag_inode = idx;
+        diag_msg.id.idiag_dport = htons(test_port(idx));
+
+        if (tcp_closer_flows_update(loaded, &diag_msg) !=
+            loaded->dump_start - idx) {
+            fprintf(stderr, "Flow %u lost its first seen time\n", idx);
+            return false;
+        }
+    }
+
+    tcp_closer_flows_dump_done(loaded);
+
+    return loaded->flows->num_loaded == TEST_SNAPSHOT_FLOWS &&
+           loaded->flows->num_flows == TEST_SNAPSHOT_FLOWS;
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/tcp-closer-test-XXXXXX";
+    FILE *logfile;
+    bool retval;
+    int fd;
+
+    if (!(logfile = fopen("/dev/null", "w"))) {
+        return EXIT_FAILURE;
+    }
+
+    //A single shard is the default without --dump_budget
+    if (!test_shards(logfile, 1) ||
+        !test_shards(logfile, 4) || !test_shards(logfile, 16)) {
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+
+    close(fd);
+    retval = test_snapshot(logfile, path);
+    unlink(path);
+
+    return retval ? EXIT_SUCCESS : EXIT_FAILURE;
+}
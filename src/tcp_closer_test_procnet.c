@@ -0,0 +1,217 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Check the /proc/net/tcp parser (--proc_net) against a naive parser using
+//fgets() and sscanf(). A file in the format of /proc/net/tcp is generated
+//(1M lines by default, the number can be given as an argument) and scanned by
+//tcp_closer_procnet_scan() with "-s TEST_PORT --dry_run --quiet", and by the
+//naive parser. Both must match the sockets the file was generated with, and
+//the lines per second of both are printed
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "tcp_closer_worker.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_procnet.h"
+#include "tcp_closer_lib.h"
+
+#define TEST_PORT 5555
+#define TEST_NUM_LINES 1000000
+
+//Lines are padded to 149 characters, like the kernel does
+#define TEST_LINE_LEN 149
+
+static uint64_t test_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Every other socket uses TEST_PORT, and three out of four are established. The
+//rest are in TIME_WAIT, which is the most common other state on a busy host.
+//Returns the number of sockets that should match
+static uint32_t test_create_file(FILE *fp, uint32_t num_lines)
+{
+    uint32_t idx, num_matching = 0;
+    uint8_t state;
+    int len;
+
+    fprintf(fp, "%-*s\n", TEST_LINE_LEN, "  sl  local_address rem_address   "
+            "st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode");
+
+    for (idx = 0; idx < num_lines; idx++) {
+        state = idx % 4 ? TCP_ESTABLISHED : TCP_TIME_WAIT;
+
+        if (state == TCP_ESTABLISHED && idx % 2) {
+            num_matching++;
+        }
+
+        len = fprintf(fp, "%4u: %08X:%04X %08X:%04X %02X %08X:%08X %02X:%08X "
+                      "%08X %5u %8d %u 1 0000000000000000 20 4 30 10 -1",
+                      idx, 0x0100007F, idx % 2 ? TEST_PORT : 1024 + idx % 60000,
+                      0x0A000000 + idx, 1024 + (idx * 7) % 60000, state, 0,
+                      idx % 100, 0, 0, 0, 1000 + idx % 10, 0, idx + 1);
+        fprintf(fp, "%*s\n", len < TEST_LINE_LEN ? TEST_LINE_LEN - len : 0,
+                "");
+    }
+
+    return num_matching;
+}
+
+//What a naive implementation would do
+static uint32_t test_naive(const char *path, uint32_t *num_lines)
+{
+    uint32_t saddr, sport, daddr, dport, state, uid, num_matching = 0;
+    unsigned long inode;
+    char line[256];
+    FILE *fp;
+
+    *num_lines = 0;
+
+    if (!(fp = fopen(path, "r")) || !fgets(line, sizeof(line), fp)) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        (*num_lines)++;
+
+        if (sscanf(line, "%*d: %8X:%4X %8X:%4X %2X %*X:%*X %*X:%*X %*X %u %*d "
+                   "%lu", &saddr, &sport, &daddr, &dport, &state, &uid,
+                   &inode) != 7) {
+            continue;
+        }
+
+        if (state == TCP_ESTABLISHED && sport == TEST_PORT) {
+            num_matching++;
+        }
+    }
+
+    fclose(fp);
+    return num_matching;
+}
+
+//Set up ctx like main() and configure() do for "-s TEST_PORT --dry_run
+//--quiet --proc_net", but read path instead of /proc/net/tcp
+static struct tcp_closer_ctx *test_create_ctx(FILE *logfile, const char *path)
+{
+    struct tcp_closer_ctx *ctx = calloc(sizeof(struct tcp_closer_ctx), 1);
+    uint16_t sport = TEST_PORT;
+
+    if (!ctx || !(ctx->stats = calloc(sizeof(struct tcp_closer_stats), 1))) {
+        return NULL;
+    }
+
+    ctx->logfile = logfile;
+    ctx->socket_family = AF_INET;
+    ctx->sched_policy = SCHED_OTHER;
+    ctx->shard_port_hi = 0xFFFF;
+    ctx->dry_run = true;
+    ctx->quiet_mode = true;
+
+    if (!tcp_closer_worker_init(ctx)) {
+        return NULL;
+    }
+
+    ctx->diag_filter_len = tcp_closer_lib_filter_len(1, 0);
+
+    if (!(ctx->diag_filter = calloc(ctx->diag_filter_len, 1))) {
+        return NULL;
+    }
+
+    tcp_closer_lib_filter_write(ctx->diag_filter, &sport, 1, NULL, 0);
+    tcp_closer_netlink_select_parser(ctx);
+
+    if (!tcp_closer_sched_init_shards(ctx) || !tcp_closer_procnet_init(ctx)) {
+        return NULL;
+    }
+
+    close(ctx->procnet->fd);
+
+    if ((ctx->procnet->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/tcp-closer-test-XXXXXX";
+    uint32_t num_lines = TEST_NUM_LINES, num_matching, naive_matching;
+    uint32_t naive_lines;
+    uint64_t naive_ns, scan_ns;
+    struct tcp_closer_ctx *ctx;
+    FILE *logfile, *fp;
+    bool retval;
+    int fd;
+
+    if (argc > 1) {
+        num_lines = strtoul(argv[1], NULL, 10);
+    }
+
+    if ((fd = mkstemp(path)) < 0 || !(fp = fdopen(fd, "w"))) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+
+    num_matching = test_create_file(fp, num_lines);
+
+    //Scans are logged, keep it out of the test output
+    if (fclose(fp) || !(logfile = fopen("/dev/null", "w")) ||
+        !(ctx = test_create_ctx(logfile, path))) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+
+    naive_ns = test_time_ns();
+    naive_matching = test_naive(path, &naive_lines);
+    naive_ns = test_time_ns() - naive_ns;
+
+    scan_ns = test_time_ns();
+    tcp_closer_sched_dump_start(ctx);
+    tcp_closer_procnet_scan(ctx);
+    scan_ns = test_time_ns() - scan_ns;
+
+    unlink(path);
+
+    fprintf(stdout, "%u lines, %u matching. sscanf(): %u matched, %.2fM "
+            "lines/s. --proc_net: %lu matched, %.2fM lines/s\n", num_lines,
+            num_matching, naive_matching,
+            num_lines * 1000.0 / (naive_ns ? naive_ns : 1),
+            ctx->stats->sockets_matched,
+            num_lines * 1000.0 / (scan_ns ? scan_ns : 1));
+
+    retval = naive_lines == num_lines && naive_matching == num_matching &&
+             ctx->stats->sockets_matched == num_matching;
+
+    return retval ? EXIT_SUCCESS : EXIT_FAILURE;
+}
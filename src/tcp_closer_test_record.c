@@ -0,0 +1,395 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Check that a dump allocates nothing from the heap once tcp_closer has warmed
+//up. A capture of dumps of different sizes is generated and replayed with
+//tcp_closer_record_replay(), first a few times to warm up and then thousands
+//of dumps while malloc() and friends are counted. Run with the default path,
+//with peer aggregation and idle statistics (which use the dump arena), with
+//every match logged as text and with NDJSON events instead (--events). The
+//logs and events are written to /dev/null, and the sockets per second of
+//every mode are printed, so the cost of the two outputs can be compared.
+//
+//malloc() is replaced in the executable, so allocations made by libc on our
+//behalf (qsort(), stdio) are counted as well. memcpy() is replaced too, and
+//the copies are printed per socket. Datagrams are parsed in place, so the
+//default path must not copy anything (the peer table keeps a copy of every
+//candidate). The target is built with -fno-builtin-memcpy, so that copies
+//are not inlined
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <libmnl/libmnl.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "tcp_closer_worker.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_record.h"
+#include "tcp_closer_peers.h"
+#include "tcp_closer_idle.h"
+#include "tcp_closer_lib.h"
+#include "tcp_closer_events.h"
+
+#define TEST_PORT 5555
+#define TEST_IDLE_TIME 10000
+#define TEST_WARMUP_REPLAYS 4
+#define TEST_REPLAYS 500
+
+//Dumps of one replay of the capture. The largest comes first, so that the
+//arena has grown to its final size before counting starts, and an empty dump
+//is included
+static const uint32_t test_dump_sizes[] = {
+    4000, 10, 2500, 0, 1000, 3999, 50, 2000
+};
+
+#define TEST_NUM_DUMPS (sizeof(test_dump_sizes) / sizeof(test_dump_sizes[0]))
+
+enum test_mode {
+    TEST_MODE_DEFAULT = 0,
+    TEST_MODE_AGGREGATE,
+    TEST_MODE_TEXT,
+    TEST_MODE_EVENTS,
+};
+
+static const char *test_mode_names[] = {
+    "default",
+    "peers and idle stats",
+    "text log",
+    "NDJSON events"
+};
+
+//glibc's allocator, which the replacements below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static volatile bool test_counting;
+static uint64_t test_num_allocs, test_num_copies, test_copied_bytes;
+
+static void test_count_alloc()
+{
+    if (test_counting) {
+        __atomic_add_fetch(&test_num_allocs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void *malloc(size_t size)
+{
+    test_count_alloc();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    test_count_alloc();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    test_count_alloc();
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    test_count_alloc();
+    *memptr = __libc_memalign(alignment, size);
+    return *memptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    test_count_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+//Forwards to memmove(), which is not replaced
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    if (test_counting) {
+        __atomic_add_fetch(&test_num_copies, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&test_copied_bytes, n, __ATOMIC_RELAXED);
+    }
+
+    return memmove(dest, src, n);
+}
+
+//Append a record to the capture
+static bool test_write_entry(FILE *fp, const uint8_t *buf, uint32_t len,
+                             uint64_t time_ns)
+{
+    static const uint8_t pad[8];
+    struct tcp_closer_record_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.len = len;
+    entry.type = RECORD_TYPE_DUMP;
+    entry.time_ns = time_ns;
+
+    return fwrite(&entry, sizeof(entry), 1, fp) == 1 &&
+           fwrite(buf, len, 1, fp) == 1 &&
+           fwrite(pad, RECORD_ALIGN(len) - len, 1, fp) <= 1;
+}
+
+static void test_put_socket(struct nlmsghdr *nlh, uint32_t idx)
+{
+    struct inet_diag_msg *diag_msg;
+    struct tcp_info tcpi;
+
+    nlh->nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    nlh->nlmsg_flags = NLM_F_MULTI;
+
+    diag_msg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct inet_diag_msg));
+    diag_msg->idiag_family = AF_INET;
+    diag_msg->idiag_state = TCP_ESTABLISHED;
+    diag_msg->idiag_inode = idx + 1;
+    diag_msg->id.idiag_sport = htons(TEST_PORT);
+    diag_msg->id.idiag_dport = htons(1024 + (idx % 60000));
+    diag_msg->id.idiag_src[0] = htonl(0x7F000001);
+    //A few sockets per peer, so that peer aggregation has work to do
+    diag_msg->id.idiag_dst[0] = htonl(0x0A000000 + (idx / 4));
+
+    memset(&tcpi, 0, sizeof(tcpi));
+    tcpi.tcpi_state = TCP_ESTABLISHED;
+    //Spread around the idle limit, so that about half of the sockets match
+    tcpi.tcpi_last_data_recv = (idx * 7919) % (2 * TEST_IDLE_TIME);
+    mnl_attr_put(nlh, INET_DIAG_INFO, sizeof(tcpi), &tcpi);
+}
+
+//Write the dumps as datagrams of at most RECV_SLOT_SIZE bytes, the last one
+//ending with NLMSG_DONE
+static bool test_create_capture(const char *path)
+{
+    uint8_t buf[RECV_SLOT_SIZE];
+    struct tcp_closer_record_hdr hdr;
+    struct nlmsghdr *nlh;
+    uint64_t time_ns = 1;
+    uint32_t dump, idx, len;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "w"))) {
+        return false;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RECORD_MAGIC;
+    hdr.version = RECORD_VERSION;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+
+    for (dump = 0; dump < TEST_NUM_DUMPS; dump++) {
+        len = 0;
+
+        for (idx = 0; idx <= test_dump_sizes[dump]; idx++) {
+            //Room for a socket (or NLMSG_DONE)
+            if (len + 512 > sizeof(buf)) {
+                if (!test_write_entry(fp, buf, len, time_ns++)) {
+                    fclose(fp);
+                    return false;
+                }
+
+                len = 0;
+            }
+
+            nlh = mnl_nlmsg_put_header(buf + len);
+
+            if (idx == test_dump_sizes[dump]) {
+                nlh->nlmsg_type = NLMSG_DONE;
+                nlh->nlmsg_flags = NLM_F_MULTI;
+                mnl_nlmsg_put_extra_header(nlh, sizeof(int32_t));
+            } else {
+                test_put_socket(nlh, idx);
+            }
+
+            len += nlh->nlmsg_len;
+        }
+
+        if (!test_write_entry(fp, buf, len, time_ns++)) {
+            fclose(fp);
+            return false;
+        }
+    }
+
+    return !fclose(fp);
+}
+
+static uint64_t test_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Set up ctx like main() and configure() do for "-s TEST_PORT -t
+//TEST_IDLE_TIME --dry_run --quiet". TEST_MODE_AGGREGATE adds
+//--peer_idle_fraction and --idle_stats, TEST_MODE_TEXT removes --quiet and
+//TEST_MODE_EVENTS adds --events /dev/null
+static struct tcp_closer_ctx *test_create_ctx(FILE *logfile,
+                                              enum test_mode mode)
+{
+    struct tcp_closer_ctx *ctx = calloc(sizeof(struct tcp_closer_ctx), 1);
+    uint16_t sport = TEST_PORT;
+
+    if (!ctx || !(ctx->stats = calloc(sizeof(struct tcp_closer_stats), 1))) {
+        return NULL;
+    }
+
+    ctx->logfile = logfile;
+    ctx->socket_family = AF_INET;
+    ctx->sched_policy = SCHED_OTHER;
+    ctx->shard_port_hi = 0xFFFF;
+    ctx->idle_time = TEST_IDLE_TIME;
+    ctx->dry_run = true;
+    ctx->quiet_mode = mode != TEST_MODE_TEXT;
+
+    if (!tcp_closer_worker_init(ctx)) {
+        return NULL;
+    }
+
+    ctx->diag_filter_len = tcp_closer_lib_filter_len(1, 0);
+
+    if (!(ctx->diag_filter = calloc(ctx->diag_filter_len, 1))) {
+        return NULL;
+    }
+
+    tcp_closer_lib_filter_write(ctx->diag_filter, &sport, 1, NULL, 0);
+
+    if (mode == TEST_MODE_EVENTS &&
+        !tcp_closer_events_init(ctx, "/dev/null")) {
+        return NULL;
+    }
+
+    if (mode == TEST_MODE_AGGREGATE) {
+        ctx->idle_stats_intvl = 1000;
+        ctx->peer_idle_pct = 50;
+
+        if (!tcp_closer_idle_init(ctx, &sport, 1, NULL, 0) ||
+            !tcp_closer_peers_init(ctx, 32, ctx->peer_idle_pct)) {
+            return NULL;
+        }
+    }
+
+    tcp_closer_netlink_select_parser(ctx);
+
+    if (!tcp_closer_sched_init_shards(ctx)) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static bool test_replay(const char *path, FILE *logfile, enum test_mode mode)
+{
+    struct tcp_closer_ctx *ctx = test_create_ctx(logfile, mode);
+    uint64_t num_allocs, num_copies, num_sockets = 0, elapsed;
+    uint32_t i;
+
+    if (!ctx) {
+        fprintf(stderr, "Failed to create context\n");
+        return false;
+    }
+
+    for (i = 0; i < TEST_WARMUP_REPLAYS; i++) {
+        if (!tcp_closer_record_replay(ctx, path, false)) {
+            return false;
+        }
+    }
+
+    test_num_allocs = 0;
+    test_num_copies = 0;
+    test_copied_bytes = 0;
+    test_counting = true;
+    elapsed = test_time_ns();
+
+    for (i = 0; i < TEST_REPLAYS; i++) {
+        if (!tcp_closer_record_replay(ctx, path, false)) {
+            test_counting = false;
+            return false;
+        }
+    }
+
+    elapsed = test_time_ns() - elapsed;
+    test_counting = false;
+    num_allocs = test_num_allocs;
+    num_copies = test_num_copies;
+
+    for (i = 0; i < TEST_NUM_DUMPS; i++) {
+        num_sockets += test_dump_sizes[i] * TEST_REPLAYS;
+    }
+
+    fprintf(stdout, "%s: %lu dumps, %lu sockets matched, %lu allocation(s) "
+            "after warm-up, %.3f copies (%.1f bytes) per socket, %.2fM "
+            "sockets/s\n", test_mode_names[mode], ctx->stats->dumps,
+            ctx->stats->sockets_matched, num_allocs,
+            (double) num_copies / num_sockets,
+            (double) test_copied_bytes / num_sockets,
+            num_sockets * 1000.0 / (elapsed ? elapsed : 1));
+
+    //Logs and events are formatted from the sockets in the receive buffer
+    return ctx->stats->dumps ==
+           (TEST_WARMUP_REPLAYS + TEST_REPLAYS) * TEST_NUM_DUMPS &&
+           !num_allocs && (mode != TEST_MODE_DEFAULT || !num_copies);
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/tcp-closer-test-XXXXXX";
+    bool retval;
+    FILE *logfile;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+
+    close(fd);
+
+    //Replays are logged, keep it out of the test output
+    if (!(logfile = fopen("/dev/null", "w")) || !test_create_capture(path)) {
+        fprintf(stderr, "Failed to create capture %s\n", path);
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+
+    retval = test_replay(path, logfile, TEST_MODE_DEFAULT) &&
+             test_replay(path, logfile, TEST_MODE_AGGREGATE) &&
+             test_replay(path, logfile, TEST_MODE_TEXT) &&
+             test_replay(path, logfile, TEST_MODE_EVENTS);
+
+    unlink(path);
+    return retval ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+//tcp-closer-top: show the statistics segment of a running tcp_closer
+//(--shm). The segment is mapped read-only, so this never affects the daemon
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "tcp_closer_shm.h"
+
+#define TOP_NUM_DECISIONS 10
+
+static const char *top_action_str[] = {
+    "destroy", "proc", "dry-run"
+};
+
+static uint64_t top_get_time_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static const struct tcp_closer_shm *top_map(const char *name)
+{
+    const struct tcp_closer_shm *seg;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Failed to open %s: %s. Is tcp_closer running with "
+                "--shm?\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct tcp_closer_shm)) {
+        fprintf(stderr, "%s is not a tcp_closer statistics segment\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    seg = mmap(NULL, sizeof(struct tcp_closer_shm), PROT_READ, MAP_SHARED, fd,
+               0);
+    close(fd);
+
+    if (seg == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if (__atomic_load_n(&(seg->magic), __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        seg->version != SHM_VERSION) {
+        fprintf(stderr, "%s has an unknown format (version %u, expected "
+                "%u)\n", name, seg->version, SHM_VERSION);
+        munmap((void*) seg, sizeof(struct tcp_closer_shm));
+        return NULL;
+    }
+
+    return seg;
+}
+
+static double top_rate(uint64_t cur, uint64_t prev, uint64_t elapsed_ms)
+{
+    return elapsed_ms && cur >= prev ? (cur - prev) * 1000.0 / elapsed_ms : 0;
+}
+
+static void top_show_decisions(const struct tcp_closer_shm *seg)
+{
+    uint64_t head = __atomic_load_n(&(seg->ring_head), __ATOMIC_ACQUIRE), n;
+    char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+    const struct tcp_closer_shm_decision *slot;
+    struct tcp_closer_shm_decision decision;
+    uint32_t shown = 0;
+    time_t secs;
+
+    fprintf(stdout, "\nRecent decisions (%lu in total):\n", head);
+
+    for (n = head; n > 0 && shown < TOP_NUM_DECISIONS; n--) {
+        slot = &(seg->ring[(n - 1) % SHM_RING_SIZE]);
+
+        //The slot is still being written, or has been reused
+        if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != n * 2) {
+            continue;
+        }
+
+        memcpy(&decision, slot, sizeof(decision));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != n * 2) {
+            continue;
+        }
+
+        inet_ntop(decision.family, decision.saddr, saddr, sizeof(saddr));
+        inet_ntop(decision.family, decision.daddr, daddr, sizeof(daddr));
+        secs = decision.time / 1000;
+
+        fprintf(stdout, "  %.8s %-7s %s:%u -> %s:%u last_data_recv: %ums\n",
+                ctime(&secs) + 11,
+                decision.action < 3 ? top_action_str[decision.action] : "?",
+                saddr, decision.sport, daddr, decision.dport,
+                decision.last_data_recv);
+        shown++;
+    }
+}
+
+static void top_show(const struct tcp_closer_shm *seg,
+                     struct tcp_closer_shm_counters *prev, uint64_t *prev_time,
+                     uint64_t *prev_rules)
+{
+    struct tcp_closer_shm_counters counters;
+    struct tcp_closer_shm_worker worker;
+    uint64_t cur_time = top_get_time_ms(), elapsed, matched;
+    uint32_t i, num_workers, num_rules;
+    bool running;
+
+    tcp_closer_shm_read(&(seg->seq), &counters, &(seg->counters),
+                        sizeof(counters));
+    elapsed = *prev_time ? cur_time - *prev_time : 0;
+    running = !kill(seg->pid, 0) || errno == EPERM;
+
+    fprintf(stdout, "tcp_closer (pid %u, %s), up %lus, idle time %ums\n\n",
+            seg->pid, running ? "running" : "not running",
+            (cur_time - seg->started) / 1000, seg->idle_time);
+    fprintf(stdout, "Dumps:     %12lu %10.1f/s\n", counters.dumps,
+            top_rate(counters.dumps, prev->dumps, elapsed));
+    fprintf(stdout, "Matched:   %12lu %10.1f/s\n", counters.sockets_matched,
+            top_rate(counters.sockets_matched, prev->sockets_matched,
+                     elapsed));
+    fprintf(stdout, "Destroyed: %12lu %10.1f/s (%lu failed, %lu closed "
+            "through /proc after failing)\n", counters.destroy_sent,
+            top_rate(counters.destroy_sent, prev->destroy_sent, elapsed),
+            counters.destroy_failed, counters.destroy_fallbacks);
+    fprintf(stdout, "/proc:     %12lu shut down, %lu killed\n",
+            counters.proc_shutdowns, counters.proc_kills);
+    fprintf(stdout, "Netlink:   %12lu datagrams, %lu overruns, %lu dumps "
+            "restarted\n", counters.datagrams, counters.overruns,
+            counters.dump_restarts);
+
+    num_workers = seg->num_workers < SHM_MAX_WORKERS ? seg->num_workers :
+                                                       SHM_MAX_WORKERS;
+
+    fprintf(stdout, "\n%6s %10s %9s %10s %10s %8s %8s %8s\n", "worker",
+            "dumps", "interval", "last (ms)", "cpu (us)", "matched",
+            "destroyq", "procq");
+
+    for (i = 0; i < num_workers; i++) {
+        tcp_closer_shm_read(&(seg->workers[i].seq), &worker,
+                            &(seg->workers[i]), sizeof(worker));
+        fprintf(stdout, "%6u %10lu %9u %10u %10u %8u %8u %8u\n", i,
+                worker.dumps, worker.interval, worker.last_dump_duration,
+                worker.last_dump_cpu_us, worker.last_dump_matched,
+                worker.destroy_queue, worker.proc_queue);
+    }
+
+    num_rules = seg->num_rules < SHM_MAX_RULES ? seg->num_rules :
+                                                 SHM_MAX_RULES;
+
+    fprintf(stdout, "\n%6s %6s %12s %10s\n", "rule", "port", "matched",
+            "rate");
+
+    for (i = 0; i < num_rules; i++) {
+        matched = __atomic_load_n(&(seg->rules[i].matched), __ATOMIC_RELAXED);
+        fprintf(stdout, "%6s %6u %12lu %8.1f/s\n",
+                seg->rules[i].side == SHM_RULE_SPORT ? "sport" : "dport",
+                seg->rules[i].port, matched,
+                top_rate(matched, prev_rules[i], elapsed));
+        prev_rules[i] = matched;
+    }
+
+    top_show_decisions(seg);
+
+    memcpy(prev, &counters, sizeof(counters));
+    *prev_time = cur_time;
+}
+
+static void top_usage()
+{
+    fprintf(stdout, "Usage: tcp-closer-top [-n name] [-i interval] [-1]\n");
+    fprintf(stdout, "\t-n : Name of the segment (as given to --shm, default "
+            "%s)\n", SHM_DEFAULT_NAME);
+    fprintf(stdout, "\t-i : Refresh interval in ms (default 1000)\n");
+    fprintf(stdout, "\t-1 : Print the statistics once and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct tcp_closer_shm_counters prev;
+    uint64_t prev_rules[SHM_MAX_RULES] = {0}, prev_time = 0;
+    const struct tcp_closer_shm *seg;
+    char name[64] = SHM_DEFAULT_NAME;
+    uint32_t interval = 1000;
+    bool once = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:1h")) != -1) {
+        if (opt == 'n') {
+            snprintf(name, sizeof(name), "%s%s", optarg[0] == '/' ? "" : "/",
+                     optarg);
+        } else if (opt == 'i' && atoi(optarg) > 0) {
+            interval = atoi(optarg);
+        } else if (opt == '1') {
+            once = true;
+        } else {
+            top_usage();
+            return opt != 'h';
+        }
+    }
+
+    if (!(seg = top_map(name))) {
+        return 1;
+    }
+
+    memset(&prev, 0, sizeof(prev));
+
+    while (true) {
+        if (!once) {
+            fprintf(stdout, "\033[H\033[2J");
+        }
+
+        top_show(seg, &prev, &prev_time, prev_rules);
+        fflush(stdout);
+
+        if (once) {
+            return 0;
+        }
+
+        usleep(interval * 1000);
+    }
+}
@@ -0,0 +1,558 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <libmnl/libmnl.h>
+#include <linux/inet_diag.h>
+
+#include "tcp_closer_worker.h"
+#include "tcp_closer.h"
+#include "tcp_closer_netlink.h"
+#include "tcp_closer_sched.h"
+#include "tcp_closer_flows.h"
+#include "tcp_closer_peers.h"
+#include "tcp_closer_events.h"
+#include "tcp_closer_exclude.h"
+#include "tcp_closer_control.h"
+#include "tcp_closer_record.h"
+#include "tcp_closer_procnet.h"
+#include "tcp_closer_arena.h"
+#include "tcp_closer_shm.h"
+#include "tcp_closer_profile.h"
+#include "tcp_closer_idle.h"
+#include "backend_event_loop.h"
+#include "tcp_closer_log.h"
+
+static void dump_timeout_cb(void *ptr)
+{
+    struct tcp_closer_ctx *ctx = ptr;
+
+    //Periodic dumps are paused through the control socket
+    if (__atomic_load_n(&(ctx->paused), __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    //Check if dump is in progress
+
+    if (ctx->dump_in_progress) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Dump in progress\n");
+        //Start some shorter interval?
+        return;
+    }
+
+    if (ctx->exclude) {
+        tcp_closer_exclude_dump_start(ctx);
+    }
+
+    //The scan is synchronous, so there is no dump to watch
+    if (ctx->procnet) {
+        tcp_closer_sched_dump_start(ctx);
+        tcp_closer_procnet_scan(ctx);
+        return;
+    }
+
+    if (send_diag_msg(ctx) < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Sending diag message failed "
+                                "with %s (%u)\n", strerror(errno), errno);
+        //Start some shorter interval?
+        return;
+    }
+
+    tcp_closer_sched_dump_start(ctx);
+    tcp_closer_worker_watch_dump(ctx);
+}
+
+static void worker_add_sockets(struct tcp_closer_ctx *ctx)
+{
+    //With io_uring, the datagrams are received straight into the receive
+    //slots. The handles are polled if this is not supported
+    if (!ctx->dump_handle->buf_group) {
+        backend_event_loop_set_recv_bufs(ctx->event_loop, ctx->dump_handle,
+                                         ctx->recv_buf, RECV_SLOT_SIZE,
+                                         RECV_NUM_SLOTS);
+    }
+
+    if (!ctx->destroy_handle->buf_group) {
+        backend_event_loop_set_recv_bufs(ctx->event_loop, ctx->destroy_handle,
+                                         ctx->destroy_ack_buf,
+                                         DESTROY_ACK_SLOT_SIZE,
+                                         DESTROY_ACK_NUM_SLOTS);
+    }
+
+    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                              mnl_socket_get_fd(ctx->diag_dump_socket),
+                              ctx->dump_handle);
+
+    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                              mnl_socket_get_fd(ctx->diag_destroy_socket),
+                              ctx->destroy_handle);
+}
+
+static struct mnl_socket *worker_open_socket(struct tcp_closer_ctx *ctx)
+{
+    struct mnl_socket *nl = mnl_socket_open(NETLINK_INET_DIAG);
+
+    if (!nl) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create inet_diag "
+                                "socket. Error: %s (%u)\n", strerror(errno),
+                                errno);
+        return NULL;
+    }
+
+    mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID);
+    tcp_closer_netlink_set_rcvbuf(ctx, mnl_socket_get_fd(nl));
+
+    return nl;
+}
+
+//Closing the socket makes the kernel abort the dump. The current shard is
+//dumped again on a new socket, so the dumps continue from where the restarted
+//dump started
+static void worker_restart_dump(struct tcp_closer_ctx *ctx)
+{
+    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_DEL,
+                              mnl_socket_get_fd(ctx->diag_dump_socket),
+                              ctx->dump_handle);
+    mnl_socket_close(ctx->diag_dump_socket);
+
+    if (!(ctx->diag_dump_socket = worker_open_socket(ctx))) {
+        backend_event_loop_stop(ctx->event_loop);
+        return;
+    }
+
+    ctx->dump_handle->fd = mnl_socket_get_fd(ctx->diag_dump_socket);
+    backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                              ctx->dump_handle->fd, ctx->dump_handle);
+
+    //The cached request contains the port id of the old socket
+    free(ctx->dump_req);
+    ctx->dump_req = NULL;
+
+    if (ctx->control_scan) {
+        tcp_closer_control_scan_done(ctx, ETIMEDOUT);
+        return;
+    }
+
+    if (ctx->peers) {
+        tcp_closer_peers_reset(ctx);
+    }
+
+    tcp_closer_arena_reset(ctx->arena);
+
+    if (ctx->exclude) {
+        tcp_closer_exclude_dump_start(ctx);
+    }
+
+    ctx->dump_last_recv = backend_get_time_ms();
+
+    if (send_diag_msg(ctx) < 0) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Restarting dump failed with "
+                                "%s (%u)\n", strerror(errno), errno);
+        ctx->dump_in_progress = false;
+    }
+}
+
+//The watchdog runs while a dump is in progress. The timer loop reads intvl
+//after the callback, so the callback decides when it runs next (0 disarms it)
+static void dump_watchdog_cb(void *ptr)
+{
+    struct tcp_closer_ctx *ctx = ptr;
+    uint64_t idle_ms = backend_get_time_ms() - ctx->dump_last_recv;
+
+    if (!ctx->dump_in_progress) {
+        ctx->dump_watchdog->intvl = 0;
+        return;
+    }
+
+    if (idle_ms < TCP_CLOSER_DUMP_WATCHDOG_MS) {
+        ctx->dump_watchdog->intvl = TCP_CLOSER_DUMP_WATCHDOG_MS - idle_ms;
+        return;
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Dump made no progress for %lums, "
+                            "restarting it\n", idle_ms);
+    TCP_CLOSER_STATS_ADD(ctx, dump_restarts, 1);
+    ctx->dump_watchdog->intvl = TCP_CLOSER_DUMP_WATCHDOG_MS;
+    worker_restart_dump(ctx);
+}
+
+void tcp_closer_worker_watch_dump(struct tcp_closer_ctx *ctx)
+{
+    struct backend_timeout_handle *watchdog = ctx->dump_watchdog;
+
+    ctx->dump_last_recv = backend_get_time_ms();
+
+    //Still armed from the previous dump
+    if (watchdog->timeout_next.le_prev) {
+        return;
+    }
+
+    watchdog->timeout_clock = ctx->dump_last_recv + TCP_CLOSER_DUMP_WATCHDOG_MS;
+    watchdog->intvl = TCP_CLOSER_DUMP_WATCHDOG_MS;
+    backend_insert_timeout(ctx->event_loop, watchdog);
+}
+
+bool tcp_closer_worker_init(struct tcp_closer_ctx *ctx)
+{
+    if (!(ctx->event_loop = backend_event_loop_create())) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create event loop\n");
+        return false;
+    }
+
+    ctx->event_loop->busy_poll = ctx->busy_poll;
+
+    //Workers are created after the main thread has switched to io_uring, so
+    //if that failed use_io_uring is already cleared
+    if (ctx->use_io_uring &&
+        !backend_event_loop_use_uring(ctx->event_loop)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "io_uring is not available, "
+                                "using epoll\n");
+    }
+
+    if (!tcp_closer_sched_init_latency(ctx)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate latency "
+                                "histogram\n");
+        return false;
+    }
+
+    if (!(ctx->diag_dump_socket = worker_open_socket(ctx)) ||
+        !(ctx->diag_destroy_socket = worker_open_socket(ctx))) {
+        return false;
+    }
+
+    tcp_closer_netlink_set_destroy_rcvbuf(ctx);
+
+    if (!(ctx->arena = tcp_closer_arena_create(ARENA_INITIAL_SIZE))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate dump "
+                                "arena\n");
+        return false;
+    }
+
+    if (!tcp_closer_netlink_init_recv(ctx)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate receive "
+                                "buffer. Error: %s (%u)\n", strerror(errno),
+                                errno);
+        return false;
+    }
+
+    if (!(ctx->dump_handle = backend_create_epoll_handle(ctx,
+                                                         mnl_socket_get_fd(ctx->diag_dump_socket),
+                                                         recv_diag_msg))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create diag dump "
+                                "epoll handle\n");
+        return false;
+    }
+
+    //Set clock to 0 so we send first dump request right away
+    if (!(ctx->dump_timeout = backend_event_loop_create_timeout(0,
+                                                                dump_timeout_cb,
+                                                                ctx,
+                                                                ctx->dump_interval))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create dump "
+                                "timeout\n");
+        return false;
+    }
+    backend_insert_timeout(ctx->event_loop, ctx->dump_timeout);
+
+    //Armed by tcp_closer_worker_watch_dump()
+    if (!(ctx->dump_watchdog = backend_event_loop_create_timeout(0,
+                                                                 dump_watchdog_cb,
+                                                                 ctx, 0))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create dump "
+                                "watchdog\n");
+        return false;
+    }
+
+    if (!(ctx->destroy_handle = backend_create_epoll_handle(ctx,
+                                                            mnl_socket_get_fd(ctx->diag_destroy_socket),
+                                                            recv_destroy_msg))) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to create diag dump "
+                                "epoll handle\n");
+        return false;
+    }
+
+    ctx->dump_handle->recv_cb = recv_diag_datagram;
+    ctx->destroy_handle->recv_cb = recv_destroy_datagram;
+    ctx->destroy_handle->send_cb = destroy_batch_sent;
+
+    worker_add_sockets(ctx);
+
+    return true;
+}
+
+bool tcp_closer_worker_use_uring(struct tcp_closer_ctx *ctx)
+{
+    if (!backend_event_loop_use_uring(ctx->event_loop)) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "io_uring is not available, "
+                                "using epoll. Error: %s (%u)\n",
+                                strerror(errno), errno);
+        ctx->use_io_uring = false;
+        return false;
+    }
+
+    worker_add_sockets(ctx);
+    return true;
+}
+
+//Most connections use ports from the ephemeral range on at least one side, so
+//in order to spread the load evenly we partition the local port range. The
+//first and last worker also cover the ports below/above the range
+static void workers_get_port_range(uint16_t *range_lo, uint16_t *range_hi)
+{
+    FILE *range_file;
+    unsigned int lo, hi;
+
+    *range_lo = 0;
+    *range_hi = 0xFFFF;
+
+    range_file = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+
+    if (!range_file) {
+        return;
+    }
+
+    if (fscanf(range_file, "%u %u", &lo, &hi) == 2 && lo < hi && hi <= 0xFFFF) {
+        *range_lo = lo;
+        *range_hi = hi;
+    }
+
+    fclose(range_file);
+}
+
+//Every worker keeps its own flow table and snapshot (path.<worker>), since
+//the workers dump disjoint parts of the port space. Flows are not moved
+//between snapshots if the number of threads changes
+static bool workers_init_flows(struct tcp_closer_ctx *worker, uint16_t idx)
+{
+    char *snapshot_path = NULL;
+    size_t path_len;
+
+    if (worker->snapshot_path) {
+        path_len = strlen(worker->snapshot_path) + 7;
+        snapshot_path = malloc(path_len);
+
+        if (!snapshot_path) {
+            return false;
+        }
+
+        snprintf(snapshot_path, path_len, "%s.%u", worker->snapshot_path, idx);
+    }
+
+    return tcp_closer_flows_init(worker, snapshot_path);
+}
+
+bool tcp_closer_workers_create(struct tcp_closer_ctx *ctx)
+{
+    struct tcp_closer_ctx *worker;
+    uint16_t range_lo, range_hi, port_lo, port_hi;
+    uint32_t width;
+    uint16_t i;
+
+    if (ctx->num_threads < 2) {
+        return true;
+    }
+
+    ctx->workers = calloc(ctx->num_threads, sizeof(struct tcp_closer_ctx*));
+
+    if (!ctx->workers) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory for "
+                                "workers\n");
+        return false;
+    }
+
+    workers_get_port_range(&range_lo, &range_hi);
+    width = (range_hi - range_lo + 1) / ctx->num_threads;
+
+    for (i = 0; i < ctx->num_threads; i++) {
+        port_lo = i ? range_lo + (i * width) : 0;
+        port_hi = i == ctx->num_threads - 1 ? 0xFFFF :
+                                              range_lo + ((i + 1) * width) - 1;
+
+        //The main thread is worker 0
+        if (!i) {
+            ctx->workers[i] = ctx;
+            tcp_closer_sched_set_port_range(ctx, port_lo, port_hi);
+            continue;
+        }
+
+        worker = calloc(sizeof(struct tcp_closer_ctx), 1);
+
+        if (!worker) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to allocate memory "
+                                    "for worker\n");
+            return false;
+        }
+
+        //Configuration, the filter and the statistics are shared. Everything
+        //else belongs to the worker
+        memcpy(worker, ctx, sizeof(struct tcp_closer_ctx));
+        worker->workers = NULL;
+        worker->control = NULL;
+        worker->flows = NULL;
+        worker->peers = NULL;
+        worker->events = NULL;
+        worker->record = NULL;
+        worker->dump_req = NULL;
+        worker->exclude_inodes = NULL;
+        worker->exclude_num_inodes = 0;
+        worker->exclude_inodes_size = 0;
+        worker->num_threads = 0;
+        worker->shard_port_lo = port_lo;
+        worker->shard_port_hi = port_hi;
+        ctx->workers[i] = worker;
+
+        if (!tcp_closer_sched_init_shards(worker) ||
+            !tcp_closer_worker_init(worker) ||
+            (ctx->track_flows && !workers_init_flows(worker, i)) ||
+            (ctx->peer_idle_pct &&
+             !tcp_closer_peers_init(worker, ctx->peer_prefix,
+                                    ctx->peer_idle_pct)) ||
+            (ctx->events && !tcp_closer_events_clone(worker, ctx)) ||
+            (ctx->record && !tcp_closer_record_clone(worker, ctx, i)) ||
+            (ctx->idle && !tcp_closer_idle_clone(worker, ctx))) {
+            return false;
+        }
+
+        if (ctx->shm) {
+            tcp_closer_shm_clone(worker, ctx, i);
+        }
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Dumping with %u threads, port "
+                            "range per thread: %u\n", ctx->num_threads, width);
+
+    return true;
+}
+
+static void *workers_thread_main(void *ptr)
+{
+    struct tcp_closer_ctx *worker = ptr;
+
+    if (worker->use_profile) {
+        tcp_closer_profile_start(worker);
+    }
+
+    backend_event_loop_run(worker->event_loop);
+    tcp_closer_netlink_drain_destroy(worker);
+    return NULL;
+}
+
+void tcp_closer_workers_run(struct tcp_closer_ctx *ctx)
+{
+    uint16_t i, num_started = 1;
+    int retval;
+
+    for (i = 1; i < ctx->num_threads; i++, num_started++) {
+        retval = pthread_create(&(ctx->workers[i]->thread), NULL,
+                                workers_thread_main, ctx->workers[i]);
+
+        if (retval) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to start worker %u. "
+                                    "Error: %s (%u)\n", i, strerror(retval),
+                                    retval);
+            break;
+        }
+    }
+
+    if (ctx->use_profile) {
+        tcp_closer_profile_start(ctx);
+    }
+
+    backend_event_loop_run(ctx->event_loop);
+    tcp_closer_netlink_drain_destroy(ctx);
+
+    for (i = 1; i < num_started; i++) {
+        //When stopped by a signal, wake up workers that are waiting for
+        //their next dump. Otherwise, the workers stop by themselves when their
+        //(only) dump is done and must not be interrupted
+        if (ctx->stop_signaled) {
+            pthread_kill(ctx->workers[i]->thread, SIGTERM);
+        }
+
+        pthread_join(ctx->workers[i]->thread, NULL);
+    }
+
+    if (ctx->events) {
+        tcp_closer_events_flush(ctx);
+
+        for (i = 1; i < num_started; i++) {
+            tcp_closer_events_flush(ctx->workers[i]);
+        }
+    }
+
+    if (ctx->record) {
+        tcp_closer_record_flush(ctx);
+
+        for (i = 1; i < num_started; i++) {
+            tcp_closer_record_flush(ctx->workers[i]);
+        }
+    }
+
+    if (ctx->flows) {
+        tcp_closer_flows_save(ctx);
+
+        for (i = 1; i < num_started; i++) {
+            tcp_closer_flows_save(ctx->workers[i]);
+        }
+    }
+
+    TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Completed %lu dumps, matched "
+                            "%lu sockets, sent %lu destroy requests (%lu "
+                            "failed). Shut down %lu and killed %lu through /proc. "
+                            "Received %lu datagrams in %lu calls\n",
+                            ctx->stats->dumps, ctx->stats->sockets_matched,
+                            ctx->stats->destroy_sent,
+                            ctx->stats->destroy_failed,
+                            ctx->stats->proc_shutdowns, ctx->stats->proc_kills,
+                            ctx->stats->datagrams,
+                            ctx->stats->recv_calls);
+
+    for (i = 0; i < TCP_CLOSER_MAX_ERRNO; i++) {
+        if (ctx->stats->destroy_errno[i]) {
+            TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%lu destroy request(s) "
+                                    "failed with %s (%u)\n",
+                                    ctx->stats->destroy_errno[i],
+                                    i ? strerror(i) : "other error", i);
+        }
+    }
+
+    if (ctx->stats->overruns || ctx->stats->dump_restarts) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "%lu receive buffer overrun(s), "
+                                "%lu dump(s) restarted by the watchdog\n",
+                                ctx->stats->overruns,
+                                ctx->stats->dump_restarts);
+    }
+
+    if (ctx->stats->destroy_fallbacks) {
+        TCP_CLOSER_PRINT_SYSLOG(ctx, LOG_INFO, "Closed %lu socket(s) through "
+                                "/proc after a failed destroy request\n",
+                                ctx->stats->destroy_fallbacks);
+    }
+
+    tcp_closer_sched_log_latency(ctx);
+    tcp_closer_profile_log(ctx);
+
+    if (ctx->shm) {
+        tcp_closer_shm_close(ctx);
+    }
+}
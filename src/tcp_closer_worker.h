@@ -0,0 +1,51 @@
+/*
+ * Copyright 2017 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of TCP closer. TCP closer is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * TCP closer is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * TCP closer. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef TCP_CLOSER_WORKER_H
+#define TCP_CLOSER_WORKER_H
+
+#include <stdbool.h>
+
+#define TCP_CLOSER_MAX_THREADS 64
+
+//A dump is restarted if no datagram has been received for this long (ms)
+#define TCP_CLOSER_DUMP_WATCHDOG_MS 5000
+
+struct tcp_closer_ctx;
+
+//Create the event loop, netlink sockets, handles and dump timeout used by one
+//worker (the main thread is also a worker)
+bool tcp_closer_worker_init(struct tcp_closer_ctx *ctx);
+
+//Called when a dump request has been sent. Arms the watchdog that restarts
+//the dump if it stops making progress
+void tcp_closer_worker_watch_dump(struct tcp_closer_ctx *ctx);
+
+//Switch the event loop of the main thread to io_uring, after the options have
+//been parsed. Falls back to epoll (and clears use_io_uring) if io_uring is not
+//available
+bool tcp_closer_worker_use_uring(struct tcp_closer_ctx *ctx);
+
+//Partition the port space between the main thread and num_threads - 1 new
+//workers. Each worker is a copy of ctx with its own sockets, buffers and
+//filter. Must be called after the filter has been created
+bool tcp_closer_workers_create(struct tcp_closer_ctx *ctx);
+
+//Start the additional workers, run the event loop of the main thread and wait
+//for the workers to finish (only happens when no interval is set)
+void tcp_closer_workers_run(struct tcp_closer_ctx *ctx);
+
+#endif